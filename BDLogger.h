@@ -34,6 +34,136 @@ typedef NS_OPTIONS(NSUInteger, BDSeverity) {
 	BDSeverityDebug     = 7
 };
 
+/**
+ * Controls the trade-off between durability and write throughput that the log store is opened with.
+ *
+ *   - BDLoggerDurabilityStrict uses a rollback journal with synchronous=FULL (the traditional behaviour)
+ *   - BDLoggerDurabilityNormal uses a write-ahead log with synchronous=NORMAL.  Committed entries survive an
+ *     application crash, but the most recent commits can be lost if the device loses power.
+ *   - BDLoggerDurabilityFast uses a write-ahead log with synchronous=OFF.  Fastest, but an OS crash or power loss
+ *     can lose recent entries.
+ */
+typedef NS_ENUM(NSUInteger, BDLoggerDurability) {
+	BDLoggerDurabilityStrict = 0,
+	BDLoggerDurabilityNormal = 1,
+	BDLoggerDurabilityFast   = 2
+};
+
+/**
+ * How log entries are laid out in the log store (see BDLogger's partitioning property).
+ *
+ *   - BDLoggerPartitioningNone keeps every entry in the one LOG_ENTRIES table
+ *   - BDLoggerPartitioningDaily keeps each (UTC) day's entries in a table of their own
+ *   - BDLoggerPartitioningHourly keeps each hour's entries in a table of their own
+ */
+typedef NS_ENUM(NSUInteger, BDLoggerPartitioning) {
+	BDLoggerPartitioningNone   = 0,
+	BDLoggerPartitioningDaily  = 1,
+	BDLoggerPartitioningHourly = 2
+};
+
+/**
+ * What a thread does when its ring buffer is full (see BDLogger's ringBufferEnabled property).
+ *
+ *   - BDRingBufferOverflowDrop throws the entry away.  A warning recording how many were dropped is written later.
+ *   - BDRingBufferOverflowBlock waits for the writer to make room.  If it's still full after 100ms (or the store
+ *     is closed, or the entry is being logged from the dispatchQueue itself), the entry is spilled instead.
+ *   - BDRingBufferOverflowSpill falls back to the normal (allocating) logging path.
+ */
+typedef NS_ENUM(NSUInteger, BDRingBufferOverflowPolicy) {
+	BDRingBufferOverflowDrop  = 0,
+	BDRingBufferOverflowBlock = 1,
+	BDRingBufferOverflowSpill = 2
+};
+
+/**
+ * What happens to a new entry when maxQueuedEntries are already waiting to be written (see BDLogger's
+ * queueOverflowPolicy property).
+ *
+ *   - BDQueueOverflowDropLowest throws away (and frees) the oldest queued entry that is less severe than the new
+ *     one, or the new entry if there isn't one.  A warning recording how many were dropped is logged later.
+ *   - BDQueueOverflowBlock makes the logging thread wait until the writer has made room.
+ *   - BDQueueOverflowCoalesce folds the new entry into the most recently queued one if they have the same severity
+ *     and message (or, for entries whose formatting is deferred, the same format and arguments), so that it is
+ *     written once with a repeat count.  Otherwise the new entry is dropped.
+ */
+typedef NS_ENUM(NSUInteger, BDQueueOverflowPolicy) {
+	BDQueueOverflowDropLowest = 0,
+	BDQueueOverflowBlock      = 1,
+	BDQueueOverflowCoalesce   = 2
+};
+
+/**
+ * Running totals describing how long retrievals have spent waiting to start, and how long they have spent
+ * actually querying the log store.  A wait time that climbs along with the write load means that readers are
+ * being held up by writers.
+ */
+typedef struct {
+	NSUInteger count;
+	NSTimeInterval totalWaitSecs;
+	NSTimeInterval maxWaitSecs;
+	NSTimeInterval totalQuerySecs;
+	NSTimeInterval maxQuerySecs;
+} BDRetrievalStats;
+
+/** How many buckets a BDMetricsHistogram has */
+#define BD_METRICS_HISTOGRAM_BUCKETS 32
+
+/**
+ * A distribution of values (durations in microseconds, or batch sizes).  Bucket 0 counts zeroes, and bucket i counts
+ * the values from 2^(i-1) up to 2^i - 1, with the last bucket also taking anything larger.
+ */
+typedef struct {
+	uint64_t count;
+	uint64_t total;
+	uint64_t max;
+	uint64_t buckets[BD_METRICS_HISTOGRAM_BUCKETS];
+} BDMetricsHistogram;
+
+/**
+ * Totals describing what the logger has done since it was created (see BDLogger's -metrics).  Every entry that is
+ * submitted ends up filtered (by severity or rate limiting), dropped (a full queue or ring buffer), written, failed
+ * (the insert or its batch's commit failed, so it only went to NSLog) or is still on its way.
+ */
+typedef struct {
+	uint64_t entriesSubmitted;
+	uint64_t entriesFiltered;
+	uint64_t entriesDropped;
+	uint64_t entriesWritten;
+	uint64_t entriesFailed;
+	uint64_t queueDepth;
+	/** How many entries were written together */
+	BDMetricsHistogram batchSize;
+	/** How long each sqlite3_step() of an insert took */
+	BDMetricsHistogram insertMicros;
+	/** How long each batch's COMMIT took */
+	BDMetricsHistogram commitMicros;
+	/** How long each prune took from start to finish, including the time spent letting inserts run in between */
+	BDMetricsHistogram pruneMicros;
+	/** How long each retrieval took, including waiting to start */
+	BDMetricsHistogram retrievalMicros;
+} BDLoggerMetrics;
+
+/**
+ * How many entries of each severity were logged within one time bucket (see BDLogger's
+ * -severityCountsBetweenStart:end:bucketSecs:error:).  counts is indexed by BDSeverity.
+ */
+typedef struct {
+	/** The start of the bucket, in seconds since 1970 */
+	NSTimeInterval start;
+	uint32_t counts[BDSeverityDebug + 1];
+} BDSeverityCounts;
+
+/**
+ * The timestamps of the oldest and newest of a set of entries, in seconds since 1970, and how many there are.
+ * Both timestamps are 0 when count is 0.
+ */
+typedef struct {
+	NSTimeInterval first;
+	NSTimeInterval last;
+	uint64_t count;
+} BDEntrySpan;
+
 /**
  * Represents a single log entry in the log store.  Is used both when creating an entry to
  * write to the log store, and also when retrieving from the log store.
@@ -55,6 +185,160 @@ typedef NS_OPTIONS(NSUInteger, BDSeverity) {
 @end
 
 
+/**
+ * A view of one log entry as it comes out of the log store (see BDLogger's
+ * -enumerateRowsBetweenStart:end:severity:ascending:error:usingBlock:).  The timestamp and severity are read
+ * straight from the row; the message and userInfo are only decoded the first time they are asked for.  The same
+ * row is reused for every entry in an enumeration, so a row (and any bytes it returns) is only valid inside the
+ * block it was handed to.  Use -entry, or keep the message and userInfo, to hold on to an entry.
+ */
+@interface BDLogRow : NSObject
+
+/** The timestamp of the log entry, in seconds since 1970 */
+@property (nonatomic, readonly) NSTimeInterval timeIntervalSince1970;
+
+@property (nonatomic, readonly) BDSeverity severity;
+
+/** The message as UTF-8 (not NUL terminated), decompressed or rendered if need be, without creating an NSString */
+-(const char *)messageBytes NS_RETURNS_INNER_POINTER;
+
+/** The length of messageBytes */
+-(NSUInteger)messageLength;
+
+/** The message, decoded the first time it is asked for */
+@property (nonatomic, readonly) NSString *message;
+
+/** The userInfo, decoded the first time it is asked for. Can be nil. */
+@property (nonatomic, readonly) NSDictionary *userInfo;
+
+/** Creates a BDEntry from the row, which can be kept after the block returns */
+-(BDEntry *)entry;
+
+@end
+
+
+/**
+ * Returned by BDLogger's asynchronous retrievals, eg.
+ * -retrieveBetweenStart:end:severity:maxEntries:ascending:pageSize:queue:pageHandler:, to cancel them with.
+ */
+@interface BDRetrievalHandle : NSObject
+
+/**
+ * Stops the retrieval.  A query that is still running in sqlite is interrupted, rather than left to finish, and
+ * the page handler is not called again (pages already on their way to the queue are thrown away).
+ */
+-(void)cancel;
+
+@property (nonatomic, readonly, getter=isCancelled) BOOL cancelled;
+
+@end
+
+
+/** How many times a message was logged (see BDLogger's -topMessagesBetweenStart:end:severity:maxMessages:error:) */
+@interface BDMessageCount : NSObject
+
+/** The message, or for templated entries (see templateInterning) the format string they were logged with */
+@property (nonatomic, readonly) NSString *message;
+
+/** YES if message is a format string that covers every entry logged with it, whatever its arguments */
+@property (nonatomic, readonly) BOOL templated;
+
+@property (nonatomic, readonly) NSUInteger count;
+
+@end
+
+
+/**
+ * Converts an entry's userInfo dictionary to and from the bytes stored in the log store.  A codec's decoder will
+ * be handed every row's stored userInfo, including rows written by a different codec, so a decoder should
+ * recognise its own format and hand anything else on to BDKeyedArchiverUserInfoCodec.
+ */
+@protocol BDUserInfoCodec <NSObject>
+
+/** Returns the bytes to store for the dictionary. Called on the logger's background queue. */
+-(NSData *)encodeUserInfo:(NSDictionary *)userInfo;
+
+/** Returns the dictionary for some stored bytes, or nil if they can't be decoded */
+-(NSDictionary *)decodeUserInfo:(NSData *)data;
+
+@end
+
+/** Stores userInfo using NSKeyedArchiver. This was the only format prior to codecs being introduced. */
+@interface BDKeyedArchiverUserInfoCodec : NSObject <BDUserInfoCodec>
+@end
+
+/**
+ * Stores userInfo in a compact tagged binary format that is much quicker to encode and decode than a keyed
+ * archive, and usually a fraction of the size.  Supports dictionaries and arrays of strings, numbers, dates, data
+ * and NSNull.  Dictionaries holding anything else are stored as a keyed archive instead.  Rows written as keyed
+ * archives can still be read.
+ */
+@interface BDCompactUserInfoCodec : NSObject <BDUserInfoCodec>
+@end
+
+
+/**
+ * Receives a copy of every entry that the logger accepts, in addition to it being saved in the log store (eg. the
+ * console, a file or a network endpoint).  Each sink added to a logger gets its own serial queue and bounded buffer,
+ * so a slow sink can't hold up the log store or any other sink.
+ */
+@protocol BDLogSink <NSObject>
+
+/** Writes a batch of entries, oldest first. Called on the sink's own queue. The entries must not be modified. */
+-(void)writeEntries:(NSArray *)entries;
+
+@optional
+
+/** Called (on the sink's own queue) when the logger is flushed, after everything buffered so far has been written */
+-(void)flush;
+
+@end
+
+/** Writes entries to the unified logging system with os_log, mapping each severity to the nearest os_log type */
+@interface BDConsoleLogSink : NSObject <BDLogSink>
+
+/** Creates a sink whose messages are tagged with the given subsystem and category */
+-(instancetype)initWithSubsystem:(NSString *)subsystem category:(NSString *)category;
+
+@end
+
+
+/**
+ * The rate limiting state for one place that logs (see callSiteRateLimit).  The BDLog macros keep a static one
+ * for each use, so there's normally no need to touch these.  The state belongs to the first logger that checks the
+ * site; any other logger keeps its own copy in a table of its own.  Accessed with atomic builtins rather than being
+ * _Atomic so that the header can still be used from C++.
+ */
+typedef struct BDCallSite {
+	const char *file;
+	unsigned int line;
+	/** The earliest time (CLOCK_UPTIME_RAW, in nanoseconds) the next entry would be admitted without using the burst */
+	int64_t nextAllowed;
+	/** Entries turned away since the last suppression summary */
+	int64_t suppressed;
+	/** Non-zero once the site is on the logger's list of sites to summarise */
+	int32_t registered;
+	/** The unique identifier of the logger the state above belongs to, or zero until one claims it */
+	uint64_t owner;
+	struct BDCallSite *next;
+} BDCallSite;
+
+
+/**
+ * The layout of a filter state word.  The low byte holds one more than the most verbose severity that anything
+ * wants (so zero means nothing), while the next two bytes hold the same for the log store and the flight recorder.
+ */
+#define BD_FILTER_ADMIT_MASK   0x000000FFu
+#define BD_FILTER_STORE_SHIFT  8
+#define BD_FILTER_RECORD_SHIFT 16
+
+/** Whether a filter state word lets entries of the given severity in at all */
+static inline BOOL BDFilterStateAdmits(uint32_t filterState, BDSeverity severity) {
+	return severity < (filterState & BD_FILTER_ADMIT_MASK);
+}
+
+@class BDLogCategory;
+
 /**
  * Provides the ability to store and retrieve log entries into a simple log store for later
  * retrieval and analysis.  Key features include:
@@ -105,18 +389,30 @@ typedef NS_OPTIONS(NSUInteger, BDSeverity) {
  * 
  * Pruning the entries out of the log file can be controlled via the pruneLimitDays and pruneFrequencySecs properties.
  * By default, the logger will keep one week's worth of entries in the file and will prune off the trailing records every
- * hour.  
+ * hour.  Pruning runs from a maintenance timer (see maintenanceIntervalSecs), so logging never has to check for it.
  * @warning Because the settings for pruning are *not* persisted across application launches, if you want to set the 
  * pruneLimitDays to a longer period than a week, you will need make sure that you set it again when the application 
- * relaunches *before* any calls to -log get invoked.  Otherwise, the very first call the the BDLogger code will trigger
- * a prune based on the default period of 7 days.
+ * relaunches, *before* the first maintenance pass after -open:.  Otherwise, that pass will trigger a prune based on the
+ * default period of 7 days.
  */
-@interface BDLogger : NSObject
+@interface BDLogger : NSObject {
+@public
+	/**
+	 * filterSeverity and the flight recorder's severity, packed into one word (see BD_FILTER_ADMIT_MASK) so that
+	 * every caller can check them inline with a single load.  Public only so that
+	 * BDLoggerShouldLog() can be inlined; use the properties to change it.
+	 */
+	uint32_t _filterState;
+}
 
 /** Sets the most verbose severity to log. Defaults to BDSeverityWarning */
 @property (nonatomic, assign) BDSeverity filterSeverity;
 
-/** In addition to logging to the store, should it also log using NSLog. Defaults to YES when running in simulator, NO otherwise. */
+/**
+ * In addition to logging to the store, should it also log to the console.  Setting this adds (or removes) a
+ * BDConsoleLogSink, so console output happens off the log store's queue.  Defaults to YES when running in
+ * simulator, NO otherwise.
+ */
 @property (nonatomic, assign) BOOL shouldNSLog;
 
 /** Controls how many day's worth of log entries are kept in the store. Defaults to 7.0 */
@@ -125,6 +421,251 @@ typedef NS_OPTIONS(NSUInteger, BDSeverity) {
 /** Controls how often the log store will check for entries that are due to be pruned. Defaults to 3600 (1 hour) */
 @property (nonatomic, strong) NSNumber *pruneFrequencySecs;
 
+/**
+ * How often the maintenance timer fires while the log store is open.  Each time, it runs whichever of pruning
+ * (see pruneFrequencySecs), a catch-up WAL checkpoint (with backgroundCheckpoint) and PRAGMA optimize are due, at
+ * utility QoS and preferably while nothing is waiting to be written.  Must be set before calling -open:.  Defaults to 60.
+ */
+@property (nonatomic, strong) NSNumber *maintenanceIntervalSecs;
+
+/** How often the maintenance timer runs PRAGMA optimize, which keeps the query planner's statistics up to date. Defaults to 86400 (1 day) */
+@property (nonatomic, strong) NSNumber *optimizeFrequencySecs;
+
+/**
+ * Controls whether new entries are written to a single table, or to a separate table per day or hour.  With
+ * partitions, pruning can drop a whole day (or hour) at once rather than deleting its entries one by one, and
+ * retrievals only look at the partitions that overlap the requested dates.  Partitions already in the store are
+ * always read and pruned, whatever this is set to.  Defaults to BDLoggerPartitioningNone.
+ */
+@property (nonatomic, assign) BDLoggerPartitioning partitioning;
+
+/**
+ * The most entries that a single prune step will delete.  A large prune is broken up into steps of this size,
+ * with inserts allowed to run in between them, so that logging never has to wait behind one giant DELETE.
+ * Defaults to 1000.
+ */
+@property (nonatomic, strong) NSNumber *pruneChunkSize;
+
+/**
+ * When YES, new log stores are created with auto_vacuum=INCREMENTAL, and the space freed up by pruning is
+ * handed back to the file system a vacuumChunkPages at a time after each prune.  Existing log stores keep the
+ * auto_vacuum mode they were created with.  Must be set before calling -open:. Defaults to NO.
+ */
+@property (nonatomic, assign) BOOL incrementalVacuum;
+
+/** The most free pages that a single incremental vacuum step will release. Defaults to 256 */
+@property (nonatomic, strong) NSNumber *vacuumChunkPages;
+
+/**
+ * When YES, a copy of the most recent entries is kept in a memory mapped file alongside the log store (the
+ * "flight recorder").  Every entry of flightRecorderSeverity or worse goes into it straight away, from the logging
+ * thread and without locking, even if it is more verbose than filterSeverity.  Because the file is mapped, its
+ * contents survive the process dying; the next -open: writes whatever didn't make it into the log store into it.
+ * If the process is known to have crashed (see BDLoggerRecordCrash()), the more verbose entries leading up to the
+ * crash are written too; otherwise they are dropped, as most apps are ended by the system killing them, and
+ * filterSeverity would mean nothing if every launch kept them.  See also BDLoggerDumpFlightRecorder().  Can be set
+ * at any time, but the flight recorder file is only mapped by -open:. Defaults to NO.
+ */
+@property (nonatomic, assign) BOOL flightRecorderEnabled;
+
+/** The most verbose severity that the flight recorder keeps. Defaults to BDSeverityDebug. */
+@property (nonatomic, assign) BDSeverity flightRecorderSeverity;
+
+/**
+ * How many entries the flight recorder holds before the oldest are overwritten.  Each takes 256 bytes, and
+ * messages longer than 232 bytes are cut short.  Must be set before calling -open:. Defaults to 1024.
+ */
+@property (nonatomic, strong) NSNumber *flightRecorderCapacity;
+
+/**
+ * When YES, messages logged with -log:messageWithFormat: (and the BDLog macros) while deferredFormatting is on
+ * are stored as a reference to their format string, which is kept just once in a LOG_TEMPLATES table, plus their
+ * arguments.  The message is rendered again as it is retrieved, and object arguments are stored as their
+ * descriptions.  This also lets -countEntriesWithFormat:betweenStart:end:severity:error: use an index.  Entries
+ * that go through memoryMappedSegments are stored in full.  Must be set before calling -open:. Defaults to NO.
+ */
+@property (nonatomic, assign) BOOL templateInterning;
+
+/**
+ * When set, each call site may log at most this many entries per second, on average, with bursts of up to
+ * callSiteBurst entries.  Call sites are the individual uses of the BDLog macros, while direct calls to
+ * -log:messageWithFormat: are limited per format string (by its text).  Each logger tracks up to 128 different
+ * format strings, for its whole life, and ones beyond that are never limited, so formats built at run time should go
+ * through -log:message: instead.  (A BDLog macro used with more than one logger is tracked the same way by all but the
+ * first, with room for 256 sites in all.)  Entries that are turned away are counted, and every callSiteSummarySecs a
+ * warning is logged for each call site saying how many were lost.  The check is lock free and happens before the
+ * message is formatted.  Doesn't apply to -log:message: or -log:.
+ * Defaults to nil (no limit).
+ */
+@property (nonatomic, strong) NSNumber *callSiteRateLimit;
+
+/** How many entries a call site may log back to back before callSiteRateLimit applies. Defaults to 10. */
+@property (nonatomic, strong) NSNumber *callSiteBurst;
+
+/**
+ * When set to a fraction between 0 and 1, only that proportion of the entries from each call site (chosen at
+ * random) are logged, before callSiteRateLimit is applied.  The rest count towards the suppression summary.
+ * Defaults to nil (log everything).
+ */
+@property (nonatomic, strong) NSNumber *callSiteSampleRate;
+
+/** How long after the first suppressed entry the suppression summary is logged. Defaults to 60 seconds. */
+@property (nonatomic, strong) NSNumber *callSiteSummarySecs;
+
+/**
+ * When YES, messages and userInfo of at least compressionMinimumBytes are LZ4 compressed by the writer before
+ * they are stored, and decompressed again as they are retrieved.  Existing entries are left as they are, and
+ * compressed and uncompressed entries can be read side by side.  The full text index (see fullTextIndexing)
+ * always holds the uncompressed text.  Defaults to NO.
+ */
+@property (nonatomic, assign) BOOL compression;
+
+/**
+ * Messages and userInfo shorter than this are never compressed, as they barely shrink and would still cost a
+ * decompression every time they are retrieved.  Defaults to 128.
+ */
+@property (nonatomic, strong) NSNumber *compressionMinimumBytes;
+
+/**
+ * When YES, new entries are appended to a preallocated, memory mapped segment file (kept in a directory next to the
+ * log store) rather than inserted into the log store, which turns each write into little more than a memcpy.  Full
+ * segments are compacted into the log store in the background, and retrievals merge in entries that are still
+ * waiting in segments.  Entries are only searchable (see fullTextIndexing and indexedUserInfoKeys) once they have
+ * been compacted.  Segments are written without msync, so a power loss can lose recent entries, much like
+ * BDLoggerDurabilityFast.  Must be set before calling -open:. Defaults to NO.
+ */
+@property (nonatomic, assign) BOOL memoryMappedSegments;
+
+/** The size each segment file is preallocated to. Must be set before calling -open:. Defaults to 4MB. */
+@property (nonatomic, strong) NSNumber *segmentSizeBytes;
+
+/**
+ * When YES, the log store can be shared with loggers in other processes (say, an app and its extensions writing to
+ * a store in their shared container) without them fighting over it.  Each process appends its entries to staging
+ * segments of its own (as with memoryMappedSegments, in a directory next to the log store), and a single process,
+ * elected with a file lock, merges everyone's staged entries into the log store in batches every
+ * sharedMergeIntervalSecs.  If the elected process goes away, another takes over, and merges whatever the departed
+ * process left behind.  The log store is always in WAL mode, and a write that finds it locked retries with backoff
+ * for up to busyTimeoutSecs rather than failing.  Only the elected process prunes.  Retrievals see entries from
+ * other processes once they have been merged.  The flight recorder, which can't be shared, is not available.  Must
+ * be set before calling -open:. Defaults to NO.
+ */
+@property (nonatomic, assign) BOOL sharedStore;
+
+/** How often, with sharedStore, staged entries are handed over to be merged into the log store. Must be set before calling -open:. Defaults to 1. */
+@property (nonatomic, strong) NSNumber *sharedMergeIntervalSecs;
+
+/** How long, with sharedStore, a write keeps retrying while another process holds the log store locked. Defaults to 5. */
+@property (nonatomic, strong) NSNumber *busyTimeoutSecs;
+
+/**
+ * When YES, each entry's message is also added to an FTS5 full text index (LOG_FTS, one per partition) so that
+ * -searchEntriesMatching:betweenStart:end:severity:maxEntries:ranked:error: doesn't have to scan every entry.  The
+ * index is written in the same transaction as each entry (sharing the batch's transaction with groupCommit), and
+ * only holds the index itself rather than another copy of each message.  Entries logged while this was off are not
+ * searchable.  Must be set before calling -open:. Defaults to NO.
+ */
+@property (nonatomic, assign) BOOL fullTextIndexing;
+
+/**
+ * When YES, a LOG_ROLLUP table holding the number of entries of each severity logged in each minute is kept up to
+ * date by a trigger as entries are inserted, so that -severityCountsBetweenStart:end:bucketSecs:error: (for whole
+ * minute buckets) and -spanOfEntriesBetweenStart:end:severity:error: (for the whole store) only have to read one
+ * row per minute rather than every entry.  Each insert costs one extra upsert.  The rollup is filled from the
+ * existing entries the first time the store is opened with this on, and removed when it is opened with this off
+ * (unless sharedStore is on, as other processes may still be using it).  Must be set before calling -open:.
+ * Defaults to NO.
+ */
+@property (nonatomic, assign) BOOL rollupEnabled;
+
+/**
+ * When set, the most recent entries of each severity (up to this many of each) written since the log store was
+ * opened are also kept in memory, so that -retrieveRecent:severity:error: can answer without a query when asking
+ * for no more than this many entries.  Not used with sharedStore, as other processes' entries wouldn't be in it.
+ * Must be set before calling -open:. Defaults to nil (no cache).
+ */
+@property (nonatomic, strong) NSNumber *recentEntryCacheSize;
+
+/**
+ * The userInfo keys whose values are copied into a field index (LOG_FIELDS, one per partition) as entries are
+ * written, so that -retrieveWithUserInfoKey:value:betweenStart:end:severity:maxEntries:ascending:error: can find
+ * them without decoding every entry's userInfo.  Only NSString and NSNumber values are indexed.  Must be set before
+ * calling -open:. Defaults to nil (nothing is indexed).
+ */
+@property (nonatomic, strong) NSSet *indexedUserInfoKeys;
+
+/**
+ * When YES, entries are gathered up and written to the log store in a single transaction rather than one
+ * transaction per entry.  A batch is committed once it reaches batchMaxEntries, or once its first entry has
+ * been waiting for batchLingerSecs, whichever comes first.  Defaults to NO.
+ */
+@property (nonatomic, assign) BOOL groupCommit;
+
+/** The most entries that will be written in a single group commit. Defaults to 500 */
+@property (nonatomic, strong) NSNumber *batchMaxEntries;
+
+/** The longest time an entry will wait for its group commit batch to fill up. Defaults to 0.25 */
+@property (nonatomic, strong) NSNumber *batchLingerSecs;
+
+/**
+ * When YES, -log:message: and -log:messageWithFormat: copy the entry into a per-thread lock-free ring buffer
+ * instead of allocating a BDEntry and dispatching a block for it.  The writer drains all of the ring buffers in
+ * batches.  Messages that don't fit in a ring record (200 bytes of UTF-8) and entries passed to -log: always take
+ * the normal path.  Must be set before anything is logged. Defaults to NO.
+ */
+@property (nonatomic, assign) BOOL ringBufferEnabled;
+
+/** How many records each thread's ring buffer can hold (rounded up to a power of two). Must be set before anything is logged. Defaults to 256 */
+@property (nonatomic, strong) NSNumber *ringBufferCapacity;
+
+/** What happens when a thread's ring buffer is full. Defaults to BDRingBufferOverflowSpill */
+@property (nonatomic, assign) BDRingBufferOverflowPolicy ringBufferOverflowPolicy;
+
+/**
+ * When set, the most entries that may be waiting for the writer at once.  Each waiting entry keeps its message and
+ * userInfo in memory, so this stops a slow disk from turning into unbounded memory growth.  The limit is
+ * approximate under contention, and entries logged from the writer itself (such as warnings) are never held back.
+ * Defaults to nil (no limit).
+ */
+@property (nonatomic, strong) NSNumber *maxQueuedEntries;
+
+/** What happens when maxQueuedEntries has been reached. Defaults to BDQueueOverflowDropLowest */
+@property (nonatomic, assign) BDQueueOverflowPolicy queueOverflowPolicy;
+
+/** How many entries are currently waiting for the writer. Cheap enough to poll. */
+@property (nonatomic, readonly) NSUInteger queueDepth;
+
+/** The most entries that have been waiting for the writer at once, since the logger was created or -resetQueueHighWaterMark */
+@property (nonatomic, readonly) NSUInteger queueHighWaterMark;
+
+/** How many entries have been dropped (or coalesced) because the queue was full, since the logger was created */
+@property (nonatomic, readonly) NSUInteger queueDroppedEntries;
+
+/** Converts userInfo dictionaries to and from stored bytes. Must be set before calling -open:. Defaults to a BDCompactUserInfoCodec */
+@property (nonatomic, strong) id<BDUserInfoCodec> userInfoCodec;
+
+/**
+ * When YES, -log:messageWithFormat: doesn't build the message on the calling thread.  Instead it keeps hold of the
+ * format string along with a compact copy of the arguments, and the message is built later on the logger's
+ * background queue.  Object arguments (%@) are retained rather than described straight away, so they should not be
+ * mutated after being logged.  Formats using positional arguments or '*' widths are still formatted immediately.
+ * Entries logged this way bypass the ring buffers. Defaults to NO.
+ */
+@property (nonatomic, assign) BOOL deferredFormatting;
+
+/** The journal and sync settings applied by -open:. Must be set before calling -open:. Defaults to BDLoggerDurabilityStrict */
+@property (nonatomic, assign) BDLoggerDurability durability;
+
+/** How many pages the write-ahead log can grow to before it is checkpointed (ignored for BDLoggerDurabilityStrict). Defaults to 1000 */
+@property (nonatomic, strong) NSNumber *walAutocheckpointPages;
+
+/**
+ * When YES, write-ahead log checkpoints are run on a separate connection and queue rather than inline with
+ * whichever insert happens to cross the walAutocheckpointPages threshold.  Ignored for BDLoggerDurabilityStrict.
+ * Must be set before calling -open:. Defaults to YES.
+ */
+@property (nonatomic, assign) BOOL backgroundCheckpoint;
+
 /**
  * Initialises the logger with a custom log store location
  *
@@ -169,6 +710,16 @@ typedef NS_OPTIONS(NSUInteger, BDSeverity) {
  */
 -(void)log:(BDSeverity)severity messageWithFormat:(NSString *)messageFormat, ...;
 
+/**
+ * Used by the BDLog macros once BDLoggerAdmitCallSite() has let the entry through.  The same as
+ * -log:messageWithFormat:, except that callSiteRateLimit and callSiteSampleRate are not checked again.
+ *
+ * @param severity The severity of the message
+ * @param callSite The call site that has already been admitted
+ * @param messageFormat A format string, followed by the parameter to be substituted
+ */
+-(void)log:(BDSeverity)severity callSite:(BDCallSite *)callSite messageWithFormat:(NSString *)messageFormat, ...;
+
 /**
  * Write a pre-created log entry.  Only log entries that are of equal or worse severity to the filterSeverity property 
  * will be written to the log store. Places the message on a background GCD queue, and returns immediately.
@@ -177,6 +728,40 @@ typedef NS_OPTIONS(NSUInteger, BDSeverity) {
  */
 -(void)log:(BDEntry *)entry;
 
+/**
+ * Blocks until every entry that has been passed to one of the log: methods has been written to the log store, and
+ * handed to every sink.  Retrievals run on their own connection and only see entries that have been written, so call this first if a
+ * retrieval must include entries that were only just logged.
+ */
+-(void)flush;
+
+/**
+ * Returns the category with the given name, creating it the first time.  Keep hold of the result rather than
+ * calling this for every entry logged.
+ *
+ * @param name The name of the category, eg. @"network" or @"com.example.app.sync"
+ */
+-(BDLogCategory *)categoryNamed:(NSString *)name;
+
+/** Starts queueHighWaterMark again from the current queueDepth, eg. after it has been reported */
+-(void)resetQueueHighWaterMark;
+
+/**
+ * Returns the latency totals for all retrievals made since the logger was created.
+ *
+ * @return A copy of the current retrieval statistics
+ */
+-(BDRetrievalStats)retrievalStats;
+
+/**
+ * Returns a snapshot of the logger's own counters and latency histograms.  Taking one is lock free and costs a few
+ * hundred loads, so it's fine to poll every few seconds.  The counters are read one at a time while entries are
+ * being logged, so they may be very slightly out of step with each other.
+ *
+ * @return A copy of the current metrics
+ */
+-(BDLoggerMetrics)metrics;
+
 /**
  * Retrieves all log entries within a given date range, with equal to or worse severity.  The entries will be sorted in
  * descending timestamp order (ie. most recent first).
@@ -189,6 +774,126 @@ typedef NS_OPTIONS(NSUInteger, BDSeverity) {
  */
 -(NSArray *)retrieveBetweenStart:(NSDate *)startDate end:(NSDate *)endDate severity:(BDSeverity)severity error:(NSError **)error;
 
+/**
+ * Enumerates all log entries within a given date range, with equal to or worse severity, without loading them all
+ * into memory first.  Entries are read from the log store one at a time as the block asks for them, so memory use
+ * stays the same no matter how many entries match.  The block is called synchronously on the logger's read queue,
+ * so it must not call any of the logger's retrieval methods itself.
+ *
+ * @param startDate The start date.  If nil, an unbounded start date will be used.
+ * @param endDate The end date.  If nil, an unbounded end date will be used.
+ * @param severity The level of entry severity (or worse) to be enumerated
+ * @param ascending YES to enumerate oldest first, NO to enumerate most recent first
+ * @param error A pointer to an NSError instance which will be populated upon error
+ * @param block Called for each matching entry.  Set *stop to YES to end the enumeration early.
+ * @return A boolean indicating whether the enumeration completed (or was stopped) without error
+ */
+-(BOOL)enumerateEntriesBetweenStart:(NSDate *)startDate end:(NSDate *)endDate severity:(BDSeverity)severity ascending:(BOOL)ascending error:(NSError **)error usingBlock:(void (^)(BDEntry *entry, BOOL *stop))block;
+
+/**
+ * Like -enumerateEntriesBetweenStart:end:severity:ascending:error:usingBlock:, but hands the block a BDLogRow rather
+ * than a BDEntry, so nothing is allocated for an entry unless the block asks for its message or userInfo.  Anything
+ * that has to be decompressed goes into a buffer that is reused from row to row, so a scan of even a very large
+ * range costs only a handful of allocations.  The same BDLogRow is handed to the block each time, and is only valid
+ * inside the block.
+ *
+ * @param startDate The start date.  If nil, an unbounded start date will be used.
+ * @param endDate The end date.  If nil, an unbounded end date will be used.
+ * @param severity The level of entry severity (or worse) to be enumerated
+ * @param ascending YES to enumerate oldest first, NO to enumerate most recent first
+ * @param error A pointer to an NSError instance which will be populated upon error
+ * @param block Called for each matching entry.  Set *stop to YES to end the enumeration early.
+ * @return A boolean indicating whether the enumeration completed (or was stopped) without error
+ */
+-(BOOL)enumerateRowsBetweenStart:(NSDate *)startDate end:(NSDate *)endDate severity:(BDSeverity)severity ascending:(BOOL)ascending error:(NSError **)error usingBlock:(void (^)(BDLogRow *row, BOOL *stop))block;
+
+/**
+ * Searches the full text index (see fullTextIndexing) for log entries whose message matches an FTS5 query, within
+ * a given date range and with equal to or worse severity.  Each partition (see partitioning) has its own index, so
+ * a ranked search scores matches against the other entries in their partition, and the scores of matches from
+ * different partitions are only roughly comparable.
+ *
+ * @param query An FTS5 match expression, eg. @"timeout OR refused", @"\"connection reset\"" or @"sync*"
+ * @param startDate The start date.  If nil, an unbounded start date will be used.
+ * @param endDate The end date.  If nil, an unbounded end date will be used.
+ * @param severity The level of entry severity (or worse) to be returned
+ * @param maxEntries The maximum number of entries to return
+ * @param ranked YES to return the best matches first, NO to return the most recent first
+ * @param error A pointer to an NSError instance which will be populated upon error (including a malformed query)
+ * @return A collection of the log entries matching the input criteria, or nil if an error occurs.
+ */
+-(NSArray *)searchEntriesMatching:(NSString *)query betweenStart:(NSDate *)startDate end:(NSDate *)endDate severity:(BDSeverity)severity maxEntries:(NSUInteger)maxEntries ranked:(BOOL)ranked error:(NSError **)error;
+
+/**
+ * Retrieves the log entries whose userInfo has a given value for one of the indexedUserInfoKeys, within a given
+ * date range and with equal to or worse severity.
+ *
+ * @param key One of the indexedUserInfoKeys
+ * @param value The NSString or NSNumber value that the key must have
+ * @param startDate The start date.  If nil, an unbounded start date will be used.
+ * @param endDate The end date.  If nil, an unbounded end date will be used.
+ * @param severity The level of entry severity (or worse) to be returned
+ * @param maxEntries The maximum number of entries to return
+ * @param ascending YES to return the oldest first, NO to return the most recent first
+ * @param error A pointer to an NSError instance which will be populated upon error
+ * @return A collection of the log entries matching the input criteria, or nil if an error occurs.
+ */
+-(NSArray *)retrieveWithUserInfoKey:(NSString *)key value:(id)value betweenStart:(NSDate *)startDate end:(NSDate *)endDate severity:(BDSeverity)severity maxEntries:(NSUInteger)maxEntries ascending:(BOOL)ascending error:(NSError **)error;
+
+/**
+ * Counts the log entries that were logged with a given format string (see templateInterning) within a given date
+ * range, and with equal to or worse severity.
+ *
+ * @param format The format string exactly as it was passed to -log:messageWithFormat:
+ * @param startDate The start date.  If nil, an unbounded start date will be used.
+ * @param endDate The end date.  If nil, an unbounded end date will be used.
+ * @param severity The level of entry severity (or worse) to be counted
+ * @param error A pointer to an NSError instance which will be populated upon error
+ * @return The number of matching entries, or NSNotFound if an error occurs (including templateInterning being off).
+ */
+-(NSUInteger)countEntriesWithFormat:(NSString *)format betweenStart:(NSDate *)startDate end:(NSDate *)endDate severity:(BDSeverity)severity error:(NSError **)error;
+
+/**
+ * Counts the log entries of each severity within a given date range, in buckets of a given length, eg. to draw a
+ * chart.  The counting is done by sqlite, using the timestamp index, so no entries are loaded.  When rollupEnabled
+ * is on and bucketSecs is a whole number of minutes, the counts come from the rollup instead, in which case the
+ * date range is widened to whole minutes.  Entries still waiting in memoryMappedSegments are not counted.
+ *
+ * @param startDate The start date.  If nil, an unbounded start date will be used.
+ * @param endDate The end date.  If nil, an unbounded end date will be used.
+ * @param bucketSecs The length of each bucket. Buckets start at whole multiples of it since 1970.
+ * @param error A pointer to an NSError instance which will be populated upon error
+ * @return Packed BDSeverityCounts, one for each bucket that has any entries in it, oldest first, or nil if an error occurs.
+ */
+-(NSData *)severityCountsBetweenStart:(NSDate *)startDate end:(NSDate *)endDate bucketSecs:(NSTimeInterval)bucketSecs error:(NSError **)error;
+
+/**
+ * Finds the messages logged most often within a given date range, and with equal to or worse severity.  When
+ * templateInterning is on, templated entries are counted by their format string rather than their rendered message.
+ * Entries still waiting in memoryMappedSegments are not counted.
+ *
+ * @param startDate The start date.  If nil, an unbounded start date will be used.
+ * @param endDate The end date.  If nil, an unbounded end date will be used.
+ * @param severity The level of entry severity (or worse) to be counted
+ * @param maxMessages The most messages to return
+ * @param error A pointer to an NSError instance which will be populated upon error
+ * @return BDMessageCount instances, most often logged first, or nil if an error occurs.
+ */
+-(NSArray *)topMessagesBetweenStart:(NSDate *)startDate end:(NSDate *)endDate severity:(BDSeverity)severity maxMessages:(NSUInteger)maxMessages error:(NSError **)error;
+
+/**
+ * Finds the oldest and newest log entries within a given date range, and with equal to or worse severity, and
+ * counts them.  When rollupEnabled is on and both dates are nil, this is answered from the rollup.  Entries still
+ * waiting in memoryMappedSegments are not included.
+ *
+ * @param startDate The start date.  If nil, an unbounded start date will be used.
+ * @param endDate The end date.  If nil, an unbounded end date will be used.
+ * @param severity The level of entry severity (or worse) to be included
+ * @param error A pointer to an NSError instance which will be populated upon error
+ * @return The span of the matching entries.  Its count is 0 if there are none, or if an error occurs.
+ */
+-(BDEntrySpan)spanOfEntriesBetweenStart:(NSDate *)startDate end:(NSDate *)endDate severity:(BDSeverity)severity error:(NSError **)error;
+
 /**
  * Retrieves the most recent log entries, with equal to or worse severity.  The entries will be sorted in descending 
  * timestamp order (ie. most recent first).
@@ -200,6 +905,100 @@ typedef NS_OPTIONS(NSUInteger, BDSeverity) {
  */
 -(NSArray *)retrieveRecent:(NSUInteger)entryCount severity:(BDSeverity)severity error:(NSError **)error;
 
+/**
+ * Retrieves log entries within a given date range, with equal to or worse severity, without blocking the caller.
+ * The entries are handed to the page handler on the given queue a page at a time as they are read, so the first
+ * of them can be shown before the rest have been read.  The handler is called one last time with finished set to
+ * YES (or with an error), unless the retrieval is cancelled first.
+ *
+ * @param startDate The start date.  If nil, an unbounded start date will be used.
+ * @param endDate The end date.  If nil, an unbounded end date will be used.
+ * @param severity The level of entry severity (or worse) to be returned
+ * @param maxEntries The most entries to retrieve
+ * @param ascending YES for oldest first, NO for most recent first
+ * @param pageSize The most entries handed to the page handler at once
+ * @param queue The queue the page handler is called on
+ * @param pageHandler Called with each page of entries. The last call has finished set to YES, and error set if the retrieval failed.
+ * @return A handle that can be used to cancel the retrieval
+ */
+-(BDRetrievalHandle *)retrieveBetweenStart:(NSDate *)startDate end:(NSDate *)endDate severity:(BDSeverity)severity maxEntries:(NSUInteger)maxEntries ascending:(BOOL)ascending pageSize:(NSUInteger)pageSize queue:(dispatch_queue_t)queue pageHandler:(void (^)(NSArray *entries, BOOL finished, NSError *error))pageHandler;
+
+/**
+ * Retrieves the most recent log entries, with equal to or worse severity, most recent first, without blocking the
+ * caller.  See -retrieveBetweenStart:end:severity:maxEntries:ascending:pageSize:queue:pageHandler:.
+ *
+ * @param entryCount The maximum number of recent entries to retrieve.
+ * @param severity The level of entry severity (or worse) to be returned
+ * @param pageSize The most entries handed to the page handler at once
+ * @param queue The queue the page handler is called on
+ * @param pageHandler Called with each page of entries. The last call has finished set to YES, and error set if the retrieval failed.
+ * @return A handle that can be used to cancel the retrieval
+ */
+-(BDRetrievalHandle *)retrieveRecent:(NSUInteger)entryCount severity:(BDSeverity)severity pageSize:(NSUInteger)pageSize queue:(dispatch_queue_t)queue pageHandler:(void (^)(NSArray *entries, BOOL finished, NSError *error))pageHandler;
+
+/**
+ * Writes the log entries within a given date range out to a compact archive file, eg. to upload for support.  The
+ * rows are streamed straight from the log store into columns (delta encoded timestamps, packed severities, and LZ4
+ * compressed messages and userInfo) without creating any BDEntry objects.  Entries still waiting in
+ * memoryMappedSegments are not included, and timestamps are kept to the microsecond.
+ *
+ * @param archiveURL Where to write the archive. Any existing file is replaced.
+ * @param startDate The earliest date to export. Can be nil.
+ * @param endDate The latest date to export. Can be nil, which will be now.
+ * @param severity The lowest severity of entries to export
+ * @param error Error information
+ * @return YES if the archive was written, otherwise NO.  A partly written archive is removed.
+ */
+-(BOOL)exportArchiveToURL:(NSURL *)archiveURL betweenStart:(NSDate *)startDate end:(NSDate *)endDate severity:(BDSeverity)severity error:(NSError **)error;
+
+/**
+ * Loads every entry in an archive written by -exportArchiveToURL:betweenStart:end:severity:error: into the log
+ * store, in a single transaction.  The timestamp indexes are dropped while the rows go in and rebuilt once at the
+ * end.  userInfo is loaded as it was stored, so both loggers must use the same userInfoCodec.
+ *
+ * @param archiveURL The archive to load
+ * @param error Error information
+ * @return YES if the whole archive was loaded, otherwise NO (in which case none of it was)
+ */
+-(BOOL)importArchiveFromURL:(NSURL *)archiveURL error:(NSError **)error;
+
+/**
+ * Adds a sink that will be handed every entry logged from now on, using a buffer of 10000 entries and batches of
+ * up to 100 entries lingering for up to 0.25 seconds.
+ */
+-(void)addSink:(id<BDLogSink>)sink;
+
+/**
+ * Adds a sink that will be handed every entry logged from now on.
+ *
+ * @param sink The sink to add
+ * @param bufferLimit The most entries that can be waiting for the sink. Entries beyond that are dropped, and a warning saying how many is written to the sink once it catches up.
+ * @param batchMaxEntries The most entries handed to the sink in one go
+ * @param batchLingerSecs How long an entry can wait for others to join its batch
+ */
+-(void)addSink:(id<BDLogSink>)sink bufferLimit:(NSUInteger)bufferLimit batchMaxEntries:(NSUInteger)batchMaxEntries batchLingerSecs:(NSTimeInterval)batchLingerSecs;
+
+/**
+ * Removes a sink, once the entries already handed to it have been written.  Can be called from the sink itself, in
+ * which case those entries are handed over once its current -writeEntries: returns, rather than before this does.
+ */
+-(void)removeSink:(id<BDLogSink>)sink;
+
+/**
+ * Registers a block to be handed entries as soon as they have been written to the log store (with groupCommit, once
+ * their batch has committed), eg. to keep a log viewer up to date without polling.  Entries written close together
+ * are handed over together, oldest first.  Unlike a sink, an observer only sees entries that made it into the store.
+ *
+ * @param severity The level of entry severity (or worse) to be handed to the block
+ * @param queue The queue the block is called on
+ * @param block Called with each batch of newly written entries
+ * @return An observer to pass to -removeTailObserver:
+ */
+-(id)addTailObserverWithSeverity:(BDSeverity)severity queue:(dispatch_queue_t)queue usingBlock:(void (^)(NSArray *entries))block;
+
+/** Stops handing entries to an observer returned by -addTailObserverWithSeverity:queue:usingBlock: */
+-(void)removeTailObserver:(id)observer;
+
 /**
  * Returns an application-wide instance of a logger using the default settings.
  * @return Application-wide instance of BDLogger
@@ -207,3 +1006,119 @@ typedef NS_OPTIONS(NSUInteger, BDSeverity) {
 +(instancetype)logger;
 
 @end
+
+
+/**
+ * Logs into a BDLogger under a name (say, a subsystem or a category), with its own filterSeverity.  Get one from
+ * -[BDLogger categoryNamed:] once and keep hold of it: its filter is precomputed into its own state word whenever
+ * a setting changes, so checking it costs the same single load as the logger's.  Entries that get past it are
+ * logged just like the logger's own, including the flight recorder and rate limits.
+ */
+@interface BDLogCategory : NSObject {
+@public
+	/** The category's filter state, laid out like BDLogger's. Public only so that BDLogCategoryShouldLog() can be inlined. */
+	uint32_t _filterState;
+}
+
+@property (nonatomic, readonly) NSString *name;
+@property (nonatomic, readonly, weak) BDLogger *logger;
+
+/** The most verbose severity to store from this category, as a BDSeverity. Defaults to nil, which follows the logger's filterSeverity. */
+@property (nonatomic, strong) NSNumber *filterSeverity;
+
+-(void)log:(BDSeverity)severity message:(NSString *)message;
+-(void)log:(BDSeverity)severity messageWithFormat:(NSString *)messageFormat, ...;
+-(void)log:(BDSeverity)severity callSite:(BDCallSite *)callSite messageWithFormat:(NSString *)messageFormat, ...;
+-(void)log:(BDEntry *)entry;
+
+@end
+
+
+/** The application-wide logger once +logger has created it, or nil before then. Use BDLoggerDefault() rather than this directly. */
+FOUNDATION_EXPORT BDLogger *BDLoggerSharedInstance;
+
+/**
+ * Writes the contents of the most recently opened flight recorder (see flightRecorderEnabled) to a file
+ * descriptor, oldest first, one entry per line.  Only uses async-signal-safe calls, so it can be called from a
+ * signal handler (eg. to append the lead-up to a crash to a crash report).  Also does BDLoggerRecordCrash().
+ */
+FOUNDATION_EXPORT void BDLoggerDumpFlightRecorder(int fd);
+
+/**
+ * Marks the most recently opened flight recorder as having crashed, so that the next -open: also keeps the entries
+ * leading up to the crash that were more verbose than filterSeverity.  Call it from your crash or uncaught
+ * exception handler.  Async-signal-safe.
+ */
+FOUNDATION_EXPORT void BDLoggerRecordCrash(void);
+
+/**
+ * Whether an entry from the given call site gets past callSiteSampleRate and callSiteRateLimit.  Counts the entry
+ * for the suppression summary if it doesn't.  Always YES when neither is set.
+ */
+FOUNDATION_EXPORT BOOL BDLoggerAdmitCallSite(BDLogger *logger, BDCallSite *site);
+
+/** Returns the application-wide logger without a message send once it has been created */
+static inline BDLogger *BDLoggerDefault(void) {
+	return BDLoggerSharedInstance != nil ? BDLoggerSharedInstance : [BDLogger logger];
+}
+
+/**
+ * Whether the logger wants entries of the given severity at all, either for the log store (see filterSeverity) or
+ * for its flight recorder.  Inlined so that it costs a single load rather than a message send.
+ */
+static inline BOOL BDLoggerShouldLog(BDLogger *logger, BDSeverity severity) {
+	return logger != nil && BDFilterStateAdmits(__atomic_load_n(&logger->_filterState, __ATOMIC_RELAXED), severity);
+}
+
+/** The same as BDLoggerShouldLog(), for a category */
+static inline BOOL BDLogCategoryShouldLog(BDLogCategory *category, BDSeverity severity) {
+	return category != nil && BDFilterStateAdmits(__atomic_load_n(&category->_filterState, __ATOMIC_RELAXED), severity);
+}
+
+/**
+ * The most verbose severity that the BDLog macros will compile in.  Anything more verbose is removed entirely at
+ * compile time, along with its arguments.  Defaults to BDSeverityDebug in DEBUG builds and BDSeverityInfo otherwise.
+ * Define it before importing BDLogger.h (or in your build settings) to change it.
+ */
+#ifndef BD_MIN_SEVERITY
+#ifdef DEBUG
+#define BD_MIN_SEVERITY BDSeverityDebug
+#else
+#define BD_MIN_SEVERITY BDSeverityInfo
+#endif
+#endif
+
+/**
+ * Logs a formatted message to the given logger.  Neither the logger's -log:messageWithFormat: nor any of the
+ * arguments are evaluated unless the severity is compiled in (see BD_MIN_SEVERITY), passes the logger's
+ * filterSeverity and gets past the rate limit for this call site (see callSiteRateLimit).
+ */
+#define BDLogTo(logger, severity, format, ...) \
+	do { \
+		if ((severity) <= BD_MIN_SEVERITY) { \
+			static BDCallSite _bd_site = { __FILE__, __LINE__, 0, 0, 0, 0, NULL }; \
+			BDLogger *_bd_logger = (logger); \
+			if (BDLoggerShouldLog(_bd_logger, (severity)) && BDLoggerAdmitCallSite(_bd_logger, &_bd_site)) \
+				[_bd_logger log:(severity) callSite:&_bd_site messageWithFormat:(format), ##__VA_ARGS__]; \
+		} \
+	} while (0)
+
+/** The same as BDLogTo(), for a BDLogCategory */
+#define BDLogCategoryTo(category, severity, format, ...) \
+	do { \
+		if ((severity) <= BD_MIN_SEVERITY) { \
+			static BDCallSite _bd_site = { __FILE__, __LINE__, 0, 0, 0, 0, NULL }; \
+			BDLogCategory *_bd_category = (category); \
+			if (BDLogCategoryShouldLog(_bd_category, (severity)) && BDLoggerAdmitCallSite(_bd_category.logger, &_bd_site)) \
+				[_bd_category log:(severity) callSite:&_bd_site messageWithFormat:(format), ##__VA_ARGS__]; \
+		} \
+	} while (0)
+
+#define BDLogEmergency(format, ...) BDLogTo(BDLoggerDefault(), BDSeverityEmergency, format, ##__VA_ARGS__)
+#define BDLogAlert(format, ...)     BDLogTo(BDLoggerDefault(), BDSeverityAlert, format, ##__VA_ARGS__)
+#define BDLogCritical(format, ...)  BDLogTo(BDLoggerDefault(), BDSeverityCritical, format, ##__VA_ARGS__)
+#define BDLogError(format, ...)     BDLogTo(BDLoggerDefault(), BDSeverityError, format, ##__VA_ARGS__)
+#define BDLogWarning(format, ...)   BDLogTo(BDLoggerDefault(), BDSeverityWarning, format, ##__VA_ARGS__)
+#define BDLogNotice(format, ...)    BDLogTo(BDLoggerDefault(), BDSeverityNotice, format, ##__VA_ARGS__)
+#define BDLogInfo(format, ...)      BDLogTo(BDLoggerDefault(), BDSeverityInfo, format, ##__VA_ARGS__)
+#define BDLogDebug(format, ...)     BDLogTo(BDLoggerDefault(), BDSeverityDebug, format, ##__VA_ARGS__)
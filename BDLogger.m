@@ -23,12 +23,425 @@
 
 #import "BDLogger.h"
 #import <sqlite3.h>
+#import <stdatomic.h>
+#import <os/lock.h>
+#import <pthread.h>
+#import <os/log.h>
+#import <sys/mman.h>
+#import <sys/stat.h>
+#import <compression.h>
+#import <fcntl.h>
+#import <sys/file.h>
+#import <unistd.h>
 
 #define BD_ERROR_DOMAIN @"com.blackdog.bdlogger"
 
+BDLogger *BDLoggerSharedInstance = nil;
+
+// --------------------------------------------------------------------------------------------------
+// Deferred formatting
+// --------------------------------------------------------------------------------------------------
+/** The C type that a single format specifier consumes from the argument list */
+typedef NS_ENUM(uint8_t, BDFormatArgKind) {
+	BDFormatArgNone = 0,
+	BDFormatArgInt,
+	BDFormatArgLong,
+	BDFormatArgLongLong,
+	BDFormatArgSize,
+	BDFormatArgPtrDiff,
+	BDFormatArgIntMax,
+	BDFormatArgDouble,
+	BDFormatArgLongDouble,
+	BDFormatArgCString,
+	BDFormatArgObject,
+	BDFormatArgPointer,
+	BDFormatArgUnsupported
+};
+
+/** A run of literal text, followed by (optionally) a single conversion specifier */
+typedef struct {
+	size_t literalStart;
+	size_t literalLength;
+	size_t specStart;
+	size_t specLength;
+	BDFormatArgKind kind;
+} BDFormatToken;
+
+/**
+ * Scans the next token out of a printf-style format string.  Anything we can't faithfully replay later (positional
+ * arguments, '*' widths, wide strings, %n) is reported as BDFormatArgUnsupported.
+ *
+ * @return NO once the end of the format string has been reached and there is nothing more to return
+ */
+static BOOL BDNextFormatToken(const char *format, size_t *position, BDFormatToken *token) {
+	size_t i = *position;
+	token->literalStart = i;
+	while (format[i] != '\0' && format[i] != '%')
+		i++;
+	token->literalLength = i - token->literalStart;
+	token->specStart = i;
+	token->specLength = 0;
+	token->kind = BDFormatArgNone;
+	if (format[i] == '\0') {
+		*position = i;
+		return token->literalLength > 0;
+	}
+
+	i++;
+	while (format[i] != '\0' && strchr("-+ #0'", format[i]) != NULL)
+		i++;
+	if (format[i] == '*')
+		token->kind = BDFormatArgUnsupported;
+	while (format[i] >= '0' && format[i] <= '9')
+		i++;
+	if (format[i] == '$')
+		token->kind = BDFormatArgUnsupported;
+	if (format[i] == '.') {
+		i++;
+		if (format[i] == '*')
+			token->kind = BDFormatArgUnsupported;
+		while (format[i] >= '0' && format[i] <= '9')
+			i++;
+	}
+
+	char length[3] = { 0 };
+	while (format[i] != '\0' && strchr("hlqLztj", format[i]) != NULL && strlen(length) < 2)
+		length[strlen(length)] = format[i++];
+
+	char conversion = format[i];
+	if (conversion != '\0')
+		i++;
+	*position = i;
+	token->specLength = i - token->specStart;
+	if (token->kind == BDFormatArgUnsupported)
+		return YES;
+
+	switch (conversion) {
+		case 'd': case 'i': case 'o': case 'u': case 'x': case 'X': case 'c':
+			if (conversion == 'c' && length[0] == 'l')
+				token->kind = BDFormatArgUnsupported;
+			else if (strcmp(length, "l") == 0)
+				token->kind = BDFormatArgLong;
+			else if (strcmp(length, "ll") == 0 || strcmp(length, "q") == 0)
+				token->kind = BDFormatArgLongLong;
+			else if (strcmp(length, "z") == 0)
+				token->kind = BDFormatArgSize;
+			else if (strcmp(length, "t") == 0)
+				token->kind = BDFormatArgPtrDiff;
+			else if (strcmp(length, "j") == 0)
+				token->kind = BDFormatArgIntMax;
+			else
+				token->kind = BDFormatArgInt;
+			break;
+		case 'C':
+			token->kind = BDFormatArgInt;
+			break;
+		case 'D': case 'U': case 'O':
+			token->kind = BDFormatArgLong;
+			break;
+		case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+			token->kind = strcmp(length, "L") == 0 ? BDFormatArgLongDouble : BDFormatArgDouble;
+			break;
+		case 's':
+			token->kind = length[0] == '\0' ? BDFormatArgCString : BDFormatArgUnsupported;
+			break;
+		case '@':
+			token->kind = BDFormatArgObject;
+			break;
+		case 'p':
+			token->kind = BDFormatArgPointer;
+			break;
+		case '%':
+			token->kind = BDFormatArgNone;
+			break;
+		default:
+			token->kind = BDFormatArgUnsupported;
+			break;
+	}
+	return YES;
+}
+
+/** The number of bytes that an argument of the given kind takes up in a captured argument list, after its kind */
+static size_t BDFormatArgSkip(BDFormatArgKind kind, const uint8_t *value) {
+	switch (kind) {
+		case BDFormatArgInt:        return sizeof(int);
+		case BDFormatArgLong:       return sizeof(long);
+		case BDFormatArgLongLong:   return sizeof(long long);
+		case BDFormatArgSize:       return sizeof(size_t);
+		case BDFormatArgPtrDiff:    return sizeof(ptrdiff_t);
+		case BDFormatArgIntMax:     return sizeof(intmax_t);
+		case BDFormatArgDouble:     return sizeof(double);
+		case BDFormatArgLongDouble: return sizeof(long double);
+		case BDFormatArgPointer:    return sizeof(void *);
+		case BDFormatArgCString: {
+			uint32_t length;
+			memcpy(&length, value, sizeof(length));
+			return sizeof(length) + length;
+		}
+		case BDFormatArgObject:
+			// captured objects live in the objects array; encoded ones are stored like C strings
+			return 0;
+		default:
+			return 0;
+	}
+}
+
+/** Returns the UTF-8 bytes of a format string, avoiding a copy for constant strings where possible */
+static const char *BDFormatBytes(NSString *format) {
+	const char *bytes = CFStringGetCStringPtr((__bridge CFStringRef)format, kCFStringEncodingUTF8);
+	return bytes != NULL ? bytes : [format UTF8String];
+}
+
+/** Stands in for a nil object argument, which an NSArray can't hold.  Not NSNull, as that can be an argument too. */
+static id BDDeferredNilObject(void) {
+	static id nilObject;
+	static dispatch_once_t onceToken;
+	dispatch_once(&onceToken, ^{
+		nilObject = [[NSObject alloc] init];
+	});
+	return nilObject;
+}
+
+/**
+ * Holds on to a format string plus a compact binary copy of its arguments, so that the (comparatively expensive)
+ * job of building the message string can be done later on the writer's queue.
+ */
+@interface BDDeferredFormat : NSObject
+
+@property (nonatomic, strong) NSString *format;
+@property (nonatomic, strong) NSData *arguments;
+@property (nonatomic, strong) NSArray *objects;
+
+/** Returns nil if the format uses something that can't be captured, in which case it should be formatted immediately */
++(instancetype)captureFormat:(NSString *)format arguments:(va_list)args;
+/** Recreates a deferred format from -encodedArguments, or returns nil if they don't match the format */
++(instancetype)deferredFormatWithFormat:(NSString *)format encodedArguments:(NSData *)encodedArguments;
+-(NSString *)render;
+/** The arguments in a form that can be stored, with each object argument replaced by its description */
+-(NSData *)encodedArguments;
+/** Whether the two would render the same, judged without rendering either of them */
+-(BOOL)isEqualToDeferredFormat:(BDDeferredFormat *)other;
+
+@end
+
+@implementation BDDeferredFormat
+
++(instancetype)captureFormat:(NSString *)format arguments:(va_list)args {
+	const char *formatBytes = BDFormatBytes(format);
+	if (formatBytes == NULL)
+		return nil;
+
+	NSMutableData *arguments = [NSMutableData data];
+	NSMutableArray *objects = nil;
+	size_t position = 0;
+	BDFormatToken token;
+	while (BDNextFormatToken(formatBytes, &position, &token)) {
+		BDFormatArgKind kind = token.kind;
+		if (kind == BDFormatArgUnsupported)
+			return nil;
+		if (kind == BDFormatArgNone)
+			continue;
+
+		[arguments appendBytes:&kind length:sizeof(kind)];
+		switch (kind) {
+			case BDFormatArgInt:        { int v = va_arg(args, int); [arguments appendBytes:&v length:sizeof(v)]; break; }
+			case BDFormatArgLong:       { long v = va_arg(args, long); [arguments appendBytes:&v length:sizeof(v)]; break; }
+			case BDFormatArgLongLong:   { long long v = va_arg(args, long long); [arguments appendBytes:&v length:sizeof(v)]; break; }
+			case BDFormatArgSize:       { size_t v = va_arg(args, size_t); [arguments appendBytes:&v length:sizeof(v)]; break; }
+			case BDFormatArgPtrDiff:    { ptrdiff_t v = va_arg(args, ptrdiff_t); [arguments appendBytes:&v length:sizeof(v)]; break; }
+			case BDFormatArgIntMax:     { intmax_t v = va_arg(args, intmax_t); [arguments appendBytes:&v length:sizeof(v)]; break; }
+			case BDFormatArgDouble:     { double v = va_arg(args, double); [arguments appendBytes:&v length:sizeof(v)]; break; }
+			case BDFormatArgLongDouble: { long double v = va_arg(args, long double); [arguments appendBytes:&v length:sizeof(v)]; break; }
+			case BDFormatArgPointer:    { void *v = va_arg(args, void *); [arguments appendBytes:&v length:sizeof(v)]; break; }
+			case BDFormatArgCString: {
+				// the caller's buffer may well be gone by the time we render, so it has to be copied
+				const char *v = va_arg(args, const char *);
+				if (v == NULL)
+					v = "(null)";
+				uint32_t length = (uint32_t)strlen(v) + 1;
+				[arguments appendBytes:&length length:sizeof(length)];
+				[arguments appendBytes:v length:length];
+				break;
+			}
+			case BDFormatArgObject: {
+				// objects are retained rather than described, so they need to be immutable (or at least not mutated)
+				id v = va_arg(args, id);
+				if (objects == nil)
+					objects = [NSMutableArray array];
+				[objects addObject:v == nil ? BDDeferredNilObject() : v];
+				break;
+			}
+			default:
+				break;
+		}
+	}
+
+	BDDeferredFormat *deferredFormat = [[BDDeferredFormat alloc] init];
+	deferredFormat.format = format;
+	deferredFormat.arguments = arguments;
+	deferredFormat.objects = objects;
+	return deferredFormat;
+}
+
+-(NSData *)encodedArguments {
+	if (self.objects == nil)
+		return self.arguments;
+
+	NSMutableData *encoded = [NSMutableData dataWithCapacity:[self.arguments length]];
+	const uint8_t *cursor = [self.arguments bytes];
+	const uint8_t *end = cursor + [self.arguments length];
+	NSUInteger objectIndex = 0;
+	while (cursor < end) {
+		const uint8_t *start = cursor;
+		BDFormatArgKind kind = *cursor;
+		cursor += sizeof(kind) + BDFormatArgSkip(kind, cursor + sizeof(kind));
+		if (kind != BDFormatArgObject) {
+			[encoded appendBytes:start length:cursor - start];
+			continue;
+		}
+		// stored the same way as a C string, so it can be read back without the object itself
+		id object = self.objects[objectIndex++];
+		const char *description = object == BDDeferredNilObject() ? "(null)" : [[object description] UTF8String];
+		uint32_t length = (uint32_t)strlen(description) + 1;
+		[encoded appendBytes:&kind length:sizeof(kind)];
+		[encoded appendBytes:&length length:sizeof(length)];
+		[encoded appendBytes:description length:length];
+	}
+	return encoded;
+}
+
+-(BOOL)isEqualToDeferredFormat:(BDDeferredFormat *)other {
+	return [self.format isEqualToString:other.format] && [self.arguments isEqualToData:other.arguments] && (self.objects == other.objects || [self.objects isEqualToArray:other.objects]);
+}
+
++(instancetype)deferredFormatWithFormat:(NSString *)format encodedArguments:(NSData *)encodedArguments {
+	const char *formatBytes = BDFormatBytes(format);
+	if (formatBytes == NULL)
+		return nil;
+
+	NSMutableData *arguments = [NSMutableData dataWithCapacity:[encodedArguments length]];
+	NSMutableArray *objects = nil;
+	const uint8_t *cursor = [encodedArguments bytes];
+	const uint8_t *end = cursor + [encodedArguments length];
+	size_t position = 0;
+	BDFormatToken token;
+	while (BDNextFormatToken(formatBytes, &position, &token)) {
+		if (token.kind == BDFormatArgUnsupported)
+			return nil;
+		if (token.kind == BDFormatArgNone)
+			continue;
+
+		// stored rows can't be trusted to match the format, so check every argument fits before it is used
+		if (cursor + sizeof(BDFormatArgKind) > end || *cursor != token.kind)
+			return nil;
+		const uint8_t *value = cursor + sizeof(BDFormatArgKind);
+		size_t size;
+		if (token.kind == BDFormatArgCString || token.kind == BDFormatArgObject) {
+			uint32_t length;
+			if (value + sizeof(length) > end)
+				return nil;
+			memcpy(&length, value, sizeof(length));
+			if (length == 0 || value + sizeof(length) + length > end || value[sizeof(length) + length - 1] != '\0')
+				return nil;
+			size = sizeof(length) + length;
+		}
+		else {
+			size = BDFormatArgSkip(token.kind, value);
+			if (value + size > end)
+				return nil;
+		}
+
+		if (token.kind == BDFormatArgObject) {
+			if (objects == nil)
+				objects = [NSMutableArray array];
+			[objects addObject:@((const char *)value + sizeof(uint32_t)) ?: @""];
+			[arguments appendBytes:cursor length:sizeof(BDFormatArgKind)];
+		}
+		else {
+			[arguments appendBytes:cursor length:sizeof(BDFormatArgKind) + size];
+		}
+		cursor = value + size;
+	}
+
+	BDDeferredFormat *deferredFormat = [[BDDeferredFormat alloc] init];
+	deferredFormat.format = format;
+	deferredFormat.arguments = arguments;
+	deferredFormat.objects = objects;
+	return deferredFormat;
+}
+
+-(NSString *)render {
+	const char *formatBytes = BDFormatBytes(self.format);
+	const uint8_t *cursor = [self.arguments bytes];
+	NSUInteger objectIndex = 0;
+	NSMutableString *result = [NSMutableString string];
+
+	size_t position = 0;
+	BDFormatToken token;
+	while (BDNextFormatToken(formatBytes, &position, &token)) {
+		if (token.literalLength > 0) {
+			NSString *literal = [[NSString alloc] initWithBytes:formatBytes + token.literalStart length:token.literalLength encoding:NSUTF8StringEncoding];
+			[result appendString:literal];
+		}
+		if (token.specLength == 0)
+			continue;
+		if (token.kind == BDFormatArgNone) {
+			[result appendString:@"%"];
+			continue;
+		}
+
+		NSString *spec = [[NSString alloc] initWithBytes:formatBytes + token.specStart length:token.specLength encoding:NSUTF8StringEncoding];
+		BDFormatArgKind kind = *cursor;
+		cursor += sizeof(kind);
+		switch (kind) {
+			case BDFormatArgInt:        { int v; memcpy(&v, cursor, sizeof(v)); cursor += sizeof(v); [result appendFormat:spec, v]; break; }
+			case BDFormatArgLong:       { long v; memcpy(&v, cursor, sizeof(v)); cursor += sizeof(v); [result appendFormat:spec, v]; break; }
+			case BDFormatArgLongLong:   { long long v; memcpy(&v, cursor, sizeof(v)); cursor += sizeof(v); [result appendFormat:spec, v]; break; }
+			case BDFormatArgSize:       { size_t v; memcpy(&v, cursor, sizeof(v)); cursor += sizeof(v); [result appendFormat:spec, v]; break; }
+			case BDFormatArgPtrDiff:    { ptrdiff_t v; memcpy(&v, cursor, sizeof(v)); cursor += sizeof(v); [result appendFormat:spec, v]; break; }
+			case BDFormatArgIntMax:     { intmax_t v; memcpy(&v, cursor, sizeof(v)); cursor += sizeof(v); [result appendFormat:spec, v]; break; }
+			case BDFormatArgDouble:     { double v; memcpy(&v, cursor, sizeof(v)); cursor += sizeof(v); [result appendFormat:spec, v]; break; }
+			case BDFormatArgLongDouble: { long double v; memcpy(&v, cursor, sizeof(v)); cursor += sizeof(v); [result appendFormat:spec, v]; break; }
+			case BDFormatArgPointer:    { void *v; memcpy(&v, cursor, sizeof(v)); cursor += sizeof(v); [result appendFormat:spec, v]; break; }
+			case BDFormatArgCString: {
+				uint32_t length;
+				memcpy(&length, cursor, sizeof(length));
+				cursor += sizeof(length);
+				[result appendFormat:spec, (const char *)cursor];
+				cursor += length;
+				break;
+			}
+			case BDFormatArgObject: {
+				id v = self.objects[objectIndex++];
+				[result appendFormat:spec, v == BDDeferredNilObject() ? nil : v];
+				break;
+			}
+			default:
+				break;
+		}
+	}
+	return result;
+}
+
+@end
+
+
 // --------------------------------------------------------------------------------------------------
 // BDEntry implementation
 // --------------------------------------------------------------------------------------------------
+@interface BDEntry ()
+
+/** When set, the message hasn't been built yet. Call -renderDeferredMessage (on the writer's queue) to build it. */
+@property (nonatomic, strong) BDDeferredFormat *deferredFormat;
+/** Set once -renderDeferredMessage has built the message from deferredFormat */
+@property (nonatomic, assign) BOOL messageRendered;
+/** How many identical entries were folded into this one while the queue was full. Guarded by the logger's queueLock. */
+@property (nonatomic, assign) NSUInteger coalescedCount;
+/** Orders the entry among the others in the logger's bounded queue */
+@property (nonatomic, assign) uint64_t queueSequence;
+
+@end
+
 @implementation BDEntry
 
 -(id)init {
@@ -48,315 +461,5732 @@
 	return [NSString stringWithFormat:@"%@ [%@] %@ %@", self.timestamp, severityDescription, self.message, self.userInfo == nil ? @"" : self.userInfo];
 }
 
+-(void)renderDeferredMessage {
+	if (self.deferredFormat == nil || self.messageRendered)
+		return;
+	// the deferred format is kept, as the writer may store it as a template rather than as the rendered message
+	self.message = [self.deferredFormat render];
+	self.messageRendered = YES;
+}
+
 @end
 
 
 // --------------------------------------------------------------------------------------------------
-// BDLogger implementation
+// BDMessageCount implementation
 // --------------------------------------------------------------------------------------------------
-@interface BDLogger ()
+@interface BDMessageCount ()
 
-/** The location of the log store */
-@property (nonatomic, strong) NSURL *logStoreURL;
+@property (nonatomic, strong) NSString *message;
+@property (nonatomic, assign) BOOL templated;
+@property (nonatomic, assign) NSUInteger count;
 
-/** The underlying sqlite connection object */
-@property (nonatomic, assign) sqlite3 *connection;
+@end
 
-/** The pre-prepared insert statement to insert new records */
-@property (nonatomic, assign) sqlite3_stmt *insertStatement;
+@implementation BDMessageCount
 
-/** The GCD background queue that all logging inserts get executed on */
-@property (nonatomic, strong) dispatch_queue_t dispatchQueue;
+-(NSString *)description {
+	return [NSString stringWithFormat:@"%lu x %@%@", (unsigned long)self.count, self.message, self.templated ? @" (format)" : @""];
+}
 
-/** When was the log store was last checked to see if needed pruning.  Does not persist over instiations of this class. */
-@property (nonatomic, strong) NSDate *lastCheckForPruning;
+@end
+
+
+// --------------------------------------------------------------------------------------------------
+// BDRetrievalHandle implementation
+// --------------------------------------------------------------------------------------------------
+@interface BDRetrievalHandle ()
+
+/** Called on the readQueue around the query, so that -cancel knows which connection to interrupt, and only while the query is running */
+-(void)beginQueryOnConnection:(sqlite3 *)connection;
+-(void)endQuery;
 
 @end
 
-@implementation BDLogger
+@implementation BDRetrievalHandle {
+	atomic_bool _cancelled;
+	/** Guards _connection, so that an interrupt can never land on the next retrieval to use the connection */
+	os_unfair_lock _lock;
+	sqlite3 *_connection;
+}
 
--(id)initWithURL:(NSURL *)logStoreURL {
+-(instancetype)init {
 	self = [super init];
 	if (self != nil) {
-		_logStoreURL = logStoreURL;
+		atomic_init(&_cancelled, false);
+		_lock = OS_UNFAIR_LOCK_INIT;
 		_connection = NULL;
-		_insertStatement = NULL;
-		_dispatchQueue = dispatch_queue_create("com.blackdog.bdlogger.queue", DISPATCH_QUEUE_SERIAL);
-		_lastCheckForPruning = [NSDate dateWithTimeIntervalSince1970:0];
-		_filterSeverity = BDSeverityWarning;
-		_pruneLimitDays = @(7);
-		_pruneFrequencySecs = @(3600);
-#if TARGET_IPHONE_SIMULATOR
-		_shouldNSLog = YES;
-#else
-		_shouldNSLog = NO;
-#endif
 	}
 	return self;
 }
 
-#
-#pragma mark - Setup and teardown
-#
--(BOOL)open:(NSError **)error {
-	__block BOOL success = YES;
-	dispatch_sync(self.dispatchQueue, ^(void) {
-		sqlite3 *connection;
-		
-		NSUInteger rc = sqlite3_open([[self.logStoreURL absoluteString] UTF8String], &connection);
-		if (rc != SQLITE_OK) {
-			if (error != NULL) {
-				NSString *message = [NSString stringWithFormat:@"Unable to open connection to %@ (rc=%d): %s", [self.logStoreURL absoluteString], rc, sqlite3_errmsg(connection)];
-				*error = [NSError errorWithDomain:BD_ERROR_DOMAIN code:rc userInfo:@{ NSLocalizedDescriptionKey : message }];
-				success = NO;
-				return;
-			}
+-(BOOL)isCancelled {
+	return atomic_load_explicit(&_cancelled, memory_order_relaxed);
+}
+
+-(void)cancel {
+	atomic_store_explicit(&_cancelled, true, memory_order_relaxed);
+	os_unfair_lock_lock(&_lock);
+	if (_connection != NULL)
+		sqlite3_interrupt(_connection);
+	os_unfair_lock_unlock(&_lock);
+}
+
+-(void)beginQueryOnConnection:(sqlite3 *)connection {
+	os_unfair_lock_lock(&_lock);
+	_connection = connection;
+	os_unfair_lock_unlock(&_lock);
+}
+
+-(void)endQuery {
+	os_unfair_lock_lock(&_lock);
+	_connection = NULL;
+	os_unfair_lock_unlock(&_lock);
+}
+
+@end
+
+
+// --------------------------------------------------------------------------------------------------
+// userInfo codecs
+// --------------------------------------------------------------------------------------------------
+@implementation BDKeyedArchiverUserInfoCodec
+
+-(NSData *)encodeUserInfo:(NSDictionary *)userInfo {
+	return [NSKeyedArchiver archivedDataWithRootObject:userInfo];
+}
+
+-(NSDictionary *)decodeUserInfo:(NSData *)data {
+	@try {
+		id userInfo = [NSKeyedUnarchiver unarchiveObjectWithData:data];
+		return [userInfo isKindOfClass:[NSDictionary class]] ? userInfo : nil;
+	}
+	@catch (NSException *exception) {
+		return nil;
+	}
+}
+
+@end
+
+/** Every compact blob starts with these two bytes. Keyed archives are binary plists, so they always start with 'b'. */
+#define BD_COMPACT_MAGIC   0xBD
+#define BD_COMPACT_VERSION 0x01
+
+typedef NS_ENUM(uint8_t, BDCompactTag) {
+	BDCompactTagDictionary = 0x01,
+	BDCompactTagArray      = 0x02,
+	BDCompactTagString     = 0x03,
+	BDCompactTagInteger    = 0x04,
+	BDCompactTagDouble     = 0x05,
+	BDCompactTagTrue       = 0x06,
+	BDCompactTagFalse      = 0x07,
+	BDCompactTagNull       = 0x08,
+	BDCompactTagData       = 0x09,
+	BDCompactTagDate       = 0x0A,
+	BDCompactTagUnsigned   = 0x0B
+};
+
+static void BDAppendVarint(NSMutableData *data, uint64_t value) {
+	uint8_t buffer[10];
+	size_t length = 0;
+	do {
+		uint8_t byte = value & 0x7F;
+		value >>= 7;
+		buffer[length++] = byte | (value != 0 ? 0x80 : 0);
+	} while (value != 0);
+	[data appendBytes:buffer length:length];
+}
+
+static BOOL BDReadVarint(const uint8_t **cursor, const uint8_t *end, uint64_t *value) {
+	uint64_t result = 0;
+	for (int shift = 0; shift < 64 && *cursor < end; shift += 7) {
+		uint8_t byte = *(*cursor)++;
+		result |= (uint64_t)(byte & 0x7F) << shift;
+		if ((byte & 0x80) == 0) {
+			*value = result;
+			return YES;
 		}
-		self.connection = connection;
+	}
+	return NO;
+}
 
-		NSString *createTableSQL = @"CREATE TABLE IF NOT EXISTS LOG_ENTRIES (Z_TIMESTAMP REAL, Z_SEVERITY INTEGER, Z_MESSAGE TEXT, Z_USERINFO BLOB)";
-		rc = sqlite3_exec(self.connection, [createTableSQL UTF8String], NULL, NULL, NULL);
-		if (rc != SQLITE_OK) {
-			if (error != NULL) {
-				NSString *message = [NSString stringWithFormat:@"Unable to create LOG_ENTRIES table (rc=%d): %s", rc, sqlite3_errmsg(self.connection)];
-				*error = [NSError errorWithDomain:BD_ERROR_DOMAIN code:rc userInfo:@{ NSLocalizedDescriptionKey : message }];
-				success = NO;
-				return;
-			}
+static BOOL BDCompactEncode(NSMutableData *data, id value) {
+	uint8_t tag;
+	if ([value isKindOfClass:[NSString class]]) {
+		tag = BDCompactTagString;
+		[data appendBytes:&tag length:1];
+		NSUInteger length = [value lengthOfBytesUsingEncoding:NSUTF8StringEncoding];
+		BDAppendVarint(data, length);
+		[data appendBytes:[value UTF8String] length:length];
+	}
+	else if ([value isKindOfClass:[NSNumber class]]) {
+		const char *type = [value objCType];
+		if (CFGetTypeID((__bridge CFTypeRef)value) == CFBooleanGetTypeID()) {
+			tag = [value boolValue] ? BDCompactTagTrue : BDCompactTagFalse;
+			[data appendBytes:&tag length:1];
 		}
-		
-		NSString *createIndexSQL = @"CREATE INDEX IF NOT EXISTS LOG_TSTAMP_I ON LOG_ENTRIES (Z_TIMESTAMP DESC, Z_SEVERITY DESC)";
-		rc = sqlite3_exec(self.connection, [createIndexSQL UTF8String], NULL, NULL, NULL);
-		if (rc != SQLITE_OK) {
-			if (error != NULL) {
-				NSString *message = [NSString stringWithFormat:@"Unable to create LOG_TSTAMP_I index (rc=%d): %s", rc, sqlite3_errmsg(self.connection)];
-				*error = [NSError errorWithDomain:BD_ERROR_DOMAIN code:rc userInfo:@{ NSLocalizedDescriptionKey : message }];
-				success = NO;
-				return;
+		else if (CFNumberIsFloatType((__bridge CFNumberRef)value)) {
+			tag = BDCompactTagDouble;
+			double v = [value doubleValue];
+			[data appendBytes:&tag length:1];
+			[data appendBytes:&v length:sizeof(v)];
+		}
+		else if (strcmp(type, @encode(unsigned long long)) == 0 && [value unsignedLongLongValue] > LLONG_MAX) {
+			tag = BDCompactTagUnsigned;
+			[data appendBytes:&tag length:1];
+			BDAppendVarint(data, [value unsignedLongLongValue]);
+		}
+		else {
+			// zigzag so that small negative numbers stay small
+			tag = BDCompactTagInteger;
+			int64_t v = [value longLongValue];
+			[data appendBytes:&tag length:1];
+			BDAppendVarint(data, ((uint64_t)v << 1) ^ (uint64_t)(v >> 63));
+		}
+	}
+	else if ([value isKindOfClass:[NSDictionary class]]) {
+		tag = BDCompactTagDictionary;
+		[data appendBytes:&tag length:1];
+		BDAppendVarint(data, [value count]);
+		for (id key in value) {
+			if (!BDCompactEncode(data, key) || !BDCompactEncode(data, value[key]))
+				return NO;
+		}
+	}
+	else if ([value isKindOfClass:[NSArray class]]) {
+		tag = BDCompactTagArray;
+		[data appendBytes:&tag length:1];
+		BDAppendVarint(data, [value count]);
+		for (id element in value) {
+			if (!BDCompactEncode(data, element))
+				return NO;
+		}
+	}
+	else if ([value isKindOfClass:[NSDate class]]) {
+		tag = BDCompactTagDate;
+		double v = [value timeIntervalSince1970];
+		[data appendBytes:&tag length:1];
+		[data appendBytes:&v length:sizeof(v)];
+	}
+	else if ([value isKindOfClass:[NSData class]]) {
+		tag = BDCompactTagData;
+		[data appendBytes:&tag length:1];
+		BDAppendVarint(data, [value length]);
+		[data appendData:value];
+	}
+	else if (value == [NSNull null]) {
+		tag = BDCompactTagNull;
+		[data appendBytes:&tag length:1];
+	}
+	else {
+		return NO;
+	}
+	return YES;
+}
+
+static id BDCompactDecode(const uint8_t **cursor, const uint8_t *end) {
+	if (*cursor >= end)
+		return nil;
+
+	uint8_t tag = *(*cursor)++;
+	uint64_t length;
+	switch (tag) {
+		case BDCompactTagString: {
+			if (!BDReadVarint(cursor, end, &length) || length > (uint64_t)(end - *cursor))
+				return nil;
+			NSString *string = [[NSString alloc] initWithBytes:*cursor length:(NSUInteger)length encoding:NSUTF8StringEncoding];
+			*cursor += length;
+			return string;
+		}
+		case BDCompactTagData: {
+			if (!BDReadVarint(cursor, end, &length) || length > (uint64_t)(end - *cursor))
+				return nil;
+			NSData *data = [NSData dataWithBytes:*cursor length:(NSUInteger)length];
+			*cursor += length;
+			return data;
+		}
+		case BDCompactTagInteger: {
+			uint64_t v;
+			if (!BDReadVarint(cursor, end, &v))
+				return nil;
+			return @((int64_t)(v >> 1) ^ -(int64_t)(v & 1));
+		}
+		case BDCompactTagUnsigned: {
+			uint64_t v;
+			if (!BDReadVarint(cursor, end, &v))
+				return nil;
+			return @(v);
+		}
+		case BDCompactTagDouble:
+		case BDCompactTagDate: {
+			double v;
+			if ((size_t)(end - *cursor) < sizeof(v))
+				return nil;
+			memcpy(&v, *cursor, sizeof(v));
+			*cursor += sizeof(v);
+			return tag == BDCompactTagDouble ? (id)@(v) : (id)[NSDate dateWithTimeIntervalSince1970:v];
+		}
+		case BDCompactTagTrue:
+			return @YES;
+		case BDCompactTagFalse:
+			return @NO;
+		case BDCompactTagNull:
+			return [NSNull null];
+		case BDCompactTagArray: {
+			if (!BDReadVarint(cursor, end, &length) || length > (uint64_t)(end - *cursor))
+				return nil;
+			NSMutableArray *array = [NSMutableArray arrayWithCapacity:(NSUInteger)length];
+			for (uint64_t i = 0; i < length; i++) {
+				id element = BDCompactDecode(cursor, end);
+				if (element == nil)
+					return nil;
+				[array addObject:element];
 			}
+			return array;
 		}
-		
-		sqlite3_stmt *insertStatement;
-		NSString *sql = @"INSERT INTO LOG_ENTRIES (Z_TIMESTAMP, Z_SEVERITY, Z_MESSAGE, Z_USERINFO) VALUES (?, ?, ?, ?)";
-		rc = sqlite3_prepare_v2(self.connection, [sql UTF8String], (int)[sql length], &insertStatement, NULL);
-		if (rc != SQLITE_OK) {
-			if (error != NULL) {
-				NSString *message = [NSString stringWithFormat:@"Unable to prepare insert statement (rc=%d): %s", rc, sqlite3_errmsg(self.connection)];
-				*error = [NSError errorWithDomain:BD_ERROR_DOMAIN code:rc userInfo:@{ NSLocalizedDescriptionKey : message }];
-				success = NO;
-				return;
+		case BDCompactTagDictionary: {
+			if (!BDReadVarint(cursor, end, &length) || length > (uint64_t)(end - *cursor))
+				return nil;
+			NSMutableDictionary *dictionary = [NSMutableDictionary dictionaryWithCapacity:(NSUInteger)length];
+			for (uint64_t i = 0; i < length; i++) {
+				id key = BDCompactDecode(cursor, end);
+				id value = key == nil ? nil : BDCompactDecode(cursor, end);
+				if (value == nil)
+					return nil;
+				dictionary[key] = value;
 			}
+			return dictionary;
+		}
+		default:
+			return nil;
+	}
+}
+
+@implementation BDCompactUserInfoCodec
+
+-(NSData *)encodeUserInfo:(NSDictionary *)userInfo {
+	NSMutableData *data = [NSMutableData dataWithCapacity:64];
+	uint8_t header[] = { BD_COMPACT_MAGIC, BD_COMPACT_VERSION };
+	[data appendBytes:header length:sizeof(header)];
+	if (!BDCompactEncode(data, userInfo))
+		return [[[BDKeyedArchiverUserInfoCodec alloc] init] encodeUserInfo:userInfo];
+	return data;
+}
+
+-(NSDictionary *)decodeUserInfo:(NSData *)data {
+	const uint8_t *bytes = [data bytes];
+	if ([data length] < 2 || bytes[0] != BD_COMPACT_MAGIC || bytes[1] != BD_COMPACT_VERSION)
+		return [[[BDKeyedArchiverUserInfoCodec alloc] init] decodeUserInfo:data];
+
+	const uint8_t *cursor = bytes + 2;
+	id userInfo = BDCompactDecode(&cursor, bytes + [data length]);
+	return [userInfo isKindOfClass:[NSDictionary class]] ? userInfo : nil;
+}
+
+@end
+
+
+// --------------------------------------------------------------------------------------------------
+// Payload compression
+// --------------------------------------------------------------------------------------------------
+/**
+ * Compressed payloads start with these two bytes, followed by the uncompressed length (4 bytes, little endian)
+ * and then the raw LZ4 data.  Neither userInfo codec's output can start with 0xBC.
+ */
+#define BD_COMPRESSED_MARKER_0 0xBC
+#define BD_COMPRESSED_MARKER_1 0x5A
+#define BD_COMPRESSED_HEADER_BYTES 6
+
+/**
+ * Templated messages (see templateInterning) are stored as a blob starting with 0xBC 0x54, followed by the
+ * template's id (4 bytes, little endian) and then the template's encoded arguments.
+ */
+#define BD_TEMPLATED_MARKER_1 0x54
+#define BD_TEMPLATED_HEADER_BYTES 6
+
+/** Returns the compressed form of some bytes, or nil if compressing them doesn't save anything */
+static NSData *BDCompressBytes(const void *bytes, size_t length, void *scratch) {
+	if (length <= BD_COMPRESSED_HEADER_BYTES || length > UINT32_MAX)
+		return nil;
+	NSMutableData *compressed = [NSMutableData dataWithLength:length];
+	uint8_t *header = [compressed mutableBytes];
+	size_t compressedLength = compression_encode_buffer(header + BD_COMPRESSED_HEADER_BYTES, length - BD_COMPRESSED_HEADER_BYTES, bytes, length, scratch, COMPRESSION_LZ4_RAW);
+	// zero means it didn't fit, ie. it would have ended up bigger
+	if (compressedLength == 0)
+		return nil;
+	header[0] = BD_COMPRESSED_MARKER_0;
+	header[1] = BD_COMPRESSED_MARKER_1;
+	OSWriteLittleInt32(header, 2, (uint32_t)length);
+	[compressed setLength:BD_COMPRESSED_HEADER_BYTES + compressedLength];
+	return compressed;
+}
+
+static BOOL BDIsCompressed(const void *bytes, size_t length) {
+	const uint8_t *header = bytes;
+	return length > BD_COMPRESSED_HEADER_BYTES && header[0] == BD_COMPRESSED_MARKER_0 && header[1] == BD_COMPRESSED_MARKER_1;
+}
+
+static BOOL BDIsTemplated(const void *bytes, size_t length) {
+	const uint8_t *header = bytes;
+	return length >= BD_TEMPLATED_HEADER_BYTES && header[0] == BD_COMPRESSED_MARKER_0 && header[1] == BD_TEMPLATED_MARKER_1;
+}
+
+/** Returns the uncompressed form of something BDCompressBytes() returned, or nil if it is corrupt */
+static NSData *BDDecompressBytes(const void *bytes, size_t length) {
+	uint32_t uncompressedLength = OSReadLittleInt32(bytes, 2);
+	NSMutableData *uncompressed = [NSMutableData dataWithLength:uncompressedLength];
+	size_t decoded = compression_decode_buffer([uncompressed mutableBytes], uncompressedLength, (const uint8_t *)bytes + BD_COMPRESSED_HEADER_BYTES, length - BD_COMPRESSED_HEADER_BYTES, NULL, COMPRESSION_LZ4_RAW);
+	return decoded == uncompressedLength ? uncompressed : nil;
+}
+
+
+// --------------------------------------------------------------------------------------------------
+// Sinks
+// --------------------------------------------------------------------------------------------------
+@implementation BDConsoleLogSink {
+	os_log_t _log;
+}
+
+-(instancetype)init {
+	return [self initWithSubsystem:[[NSBundle mainBundle] bundleIdentifier] ?: @"com.blackdog.bdlogger" category:@"BDLogger"];
+}
+
+-(instancetype)initWithSubsystem:(NSString *)subsystem category:(NSString *)category {
+	self = [super init];
+	if (self != nil) {
+		_log = os_log_create([subsystem UTF8String], [category UTF8String]);
+	}
+	return self;
+}
+
+-(void)writeEntries:(NSArray *)entries {
+	for (BDEntry *entry in entries) {
+		os_log_type_t type;
+		switch (entry.severity) {
+			case BDSeverityEmergency:
+			case BDSeverityAlert:
+			case BDSeverityCritical: type = OS_LOG_TYPE_FAULT;   break;
+			case BDSeverityError:    type = OS_LOG_TYPE_ERROR;   break;
+			case BDSeverityInfo:     type = OS_LOG_TYPE_INFO;    break;
+			case BDSeverityDebug:    type = OS_LOG_TYPE_DEBUG;   break;
+			default:                 type = OS_LOG_TYPE_DEFAULT; break;
+		}
+		os_log_with_type(_log, type, "%{public}@", [entry description]);
+	}
+}
+
+@end
+
+/**
+ * Sits between the logger and one sink.  Entries are buffered (up to bufferLimit, beyond which they are dropped
+ * and counted) and handed to the sink in batches on its own serial queue, so a slow sink only ever holds itself up.
+ */
+@interface BDSinkChannel : NSObject
+
+@property (nonatomic, strong, readonly) id<BDLogSink> sink;
+@property (nonatomic, strong, readonly) dispatch_queue_t queue;
+@property (nonatomic, assign, readonly) NSUInteger bufferLimit;
+@property (nonatomic, assign, readonly) NSUInteger batchMaxEntries;
+@property (nonatomic, assign, readonly) NSTimeInterval batchLingerSecs;
+
+-(instancetype)initWithSink:(id<BDLogSink>)sink bufferLimit:(NSUInteger)bufferLimit batchMaxEntries:(NSUInteger)batchMaxEntries batchLingerSecs:(NSTimeInterval)batchLingerSecs;
+-(void)submitEntry:(BDEntry *)entry;
+-(void)flush;
+
+@end
+
+/** Tags each channel's queue with the channel, so that it can tell when it is being called from the sink */
+static char BDSinkQueueKey;
+
+@implementation BDSinkChannel {
+	/** Guards everything below, which is touched both by the logger's queue and the sink's queue */
+	os_unfair_lock _lock;
+	NSMutableArray *_buffer;
+	BOOL _drainScheduled;
+	NSUInteger _dropped;
+}
+
+-(instancetype)initWithSink:(id<BDLogSink>)sink bufferLimit:(NSUInteger)bufferLimit batchMaxEntries:(NSUInteger)batchMaxEntries batchLingerSecs:(NSTimeInterval)batchLingerSecs {
+	self = [super init];
+	if (self != nil) {
+		_sink = sink;
+		_queue = dispatch_queue_create("com.blackdog.bdlogger.sink", DISPATCH_QUEUE_SERIAL);
+		dispatch_queue_set_specific(_queue, &BDSinkQueueKey, (__bridge void *)self, NULL);
+		_bufferLimit = MAX(bufferLimit, 1);
+		_batchMaxEntries = MAX(batchMaxEntries, 1);
+		_batchLingerSecs = batchLingerSecs;
+		_lock = OS_UNFAIR_LOCK_INIT;
+		_buffer = [NSMutableArray array];
+		_drainScheduled = NO;
+		_dropped = 0;
+	}
+	return self;
+}
+
+-(void)submitEntry:(BDEntry *)entry {
+	os_unfair_lock_lock(&_lock);
+	if ([_buffer count] >= self.bufferLimit) {
+		_dropped++;
+		os_unfair_lock_unlock(&_lock);
+		return;
+	}
+	[_buffer addObject:entry];
+	BOOL full = [_buffer count] == self.batchMaxEntries;
+	BOOL schedule = !full && !_drainScheduled;
+	_drainScheduled = _drainScheduled || schedule;
+	os_unfair_lock_unlock(&_lock);
+
+	if (full) {
+		dispatch_async(self.queue, ^(void) {
+			[self drain];
+		});
+	}
+	else if (schedule) {
+		dispatch_time_t when = dispatch_time(DISPATCH_TIME_NOW, (int64_t)(self.batchLingerSecs * NSEC_PER_SEC));
+		dispatch_after(when, self.queue, ^(void) {
+			[self drain];
+		});
+	}
+}
+
+/** Hands everything buffered so far to the sink. Must be called on the sink's queue. */
+-(void)drain {
+	os_unfair_lock_lock(&_lock);
+	NSArray *entries = _buffer;
+	NSUInteger dropped = _dropped;
+	_buffer = [NSMutableArray array];
+	_drainScheduled = NO;
+	_dropped = 0;
+	os_unfair_lock_unlock(&_lock);
+
+	if (dropped > 0) {
+		BDEntry *warning = [[BDEntry alloc] init];
+		warning.severity = BDSeverityWarning;
+		warning.message = [NSString stringWithFormat:@"Log sink %@ fell behind; %lu entries were dropped", NSStringFromClass([self.sink class]), (unsigned long)dropped];
+		entries = [entries arrayByAddingObject:warning];
+	}
+	for (NSUInteger i = 0; i < [entries count]; i += self.batchMaxEntries) {
+		@autoreleasepool {
+			[self.sink writeEntries:[entries subarrayWithRange:NSMakeRange(i, MIN(self.batchMaxEntries, [entries count] - i))]];
+		}
+	}
+}
+
+-(void)flush {
+	dispatch_block_t flush = ^(void) {
+		[self drain];
+		if ([self.sink respondsToSelector:@selector(flush)])
+			[self.sink flush];
+	};
+	// the sink itself (eg. removing itself from inside -writeEntries:) can't wait on its own queue, and shouldn't be
+	// called back while it's still in the middle of a batch, so it gets flushed as soon as that batch is done instead
+	if (dispatch_get_specific(&BDSinkQueueKey) == (__bridge void *)self)
+		dispatch_async(self.queue, flush);
+	else
+		dispatch_sync(self.queue, flush);
+}
+
+@end
+
+/** A block registered with -addTailObserverWithSeverity:queue:usingBlock:, and where to call it */
+@interface BDTailObserver : NSObject
+
+@property (nonatomic, assign) BDSeverity severity;
+@property (nonatomic, strong) dispatch_queue_t queue;
+@property (nonatomic, copy) void (^block)(NSArray *entries);
+/** Set once the observer has been removed, so that batches already on their way to its queue are dropped */
+@property (atomic, assign) BOOL removed;
+
+@end
+
+@implementation BDTailObserver
+@end
+
+
+// --------------------------------------------------------------------------------------------------
+// Ring buffer front end
+// --------------------------------------------------------------------------------------------------
+#define BD_RING_MESSAGE_BYTES 200
+
+/** A fixed size log record, written by the producing thread directly into its ring buffer */
+typedef struct {
+	double timestamp;
+	uint32_t severity;
+	uint32_t length;
+	char message[BD_RING_MESSAGE_BYTES];
+} BDRingRecord;
+
+/**
+ * A single producer, single consumer ring buffer. The owning thread is the only one that advances head, and
+ * the writer on the dispatchQueue is the only one that advances tail.
+ */
+typedef struct BDRing {
+	_Atomic size_t head;
+	_Atomic size_t tail;
+	size_t capacity;
+	atomic_bool abandoned;
+	struct BDRing *next;
+	BDRingRecord records[];
+} BDRing;
+
+/** pthread key destructor: the thread has gone, so the writer can free the ring once it has been drained */
+static void BDRingThreadExited(void *value) {
+	BDRing *ring = value;
+	atomic_store_explicit(&ring->abandoned, true, memory_order_release);
+}
+
+
+// --------------------------------------------------------------------------------------------------
+// Flight recorder
+// --------------------------------------------------------------------------------------------------
+#define BD_FLIGHT_MAGIC 0x52465442		// "BTFR"
+#define BD_FLIGHT_VERSION 2
+#define BD_FLIGHT_MESSAGE_BYTES 232
+/** Set on a record whose entry was also passed on to be written to the log store */
+#define BD_FLIGHT_QUEUED 0x1
+
+/** Starts the flight recorder file, and is followed by capacity records */
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t capacity;
+	/** Set by -close:, and cleared again by -open:, so the next -open: can tell whether the process died */
+	atomic_uint cleanShutdown;
+	/**
+	 * Set by BDLoggerRecordCrash() (and BDLoggerDumpFlightRecorder()), and cleared again by -open:.  Apps are usually
+	 * ended by a SIGKILL, which looks just the same as a crash to cleanShutdown, so this is how the next -open: knows
+	 * that the entries leading up to the end are worth keeping.
+	 */
+	atomic_uint crashed;
+	/** The sequence number of the most recent record */
+	_Atomic uint64_t next;
+} BDFlightRecorderHeader;
+
+/**
+ * A fixed size slot in the flight recorder.  sequence is zero while the slot is being written and is stored last,
+ * and writers counts the threads writing to it, as a thread that has wrapped all the way round the recorder can
+ * start on a slot before the last one to claim it has finished.  See BDFlightRecorderRead().
+ */
+typedef struct {
+	_Atomic uint64_t sequence;
+	double timestamp;
+	uint16_t severity;
+	_Atomic uint16_t writers;
+	uint16_t length;
+	uint16_t flags;
+	char message[BD_FLIGHT_MESSAGE_BYTES];
+} BDFlightRecord;
+
+/** The flight recorder that BDLoggerDumpFlightRecorder() writes out: whichever was opened most recently */
+static _Atomic(BDFlightRecorderHeader *) BDActiveFlightRecorder = NULL;
+
+static inline BDFlightRecord *BDFlightRecorderSlot(BDFlightRecorderHeader *recorder, uint64_t sequence) {
+	return (BDFlightRecord *)(recorder + 1) + ((sequence - 1) % recorder->capacity);
+}
+
+/**
+ * Claims the next slot and copies the entry into it.  Any number of threads can append at once without locking;
+ * the only shared write is the fetch-and-add that hands out sequence numbers.
+ */
+static void BDFlightRecorderAppend(BDFlightRecorderHeader *recorder, NSTimeInterval timestamp, BDSeverity severity, NSString *message, BOOL queued) {
+	uint64_t sequence = atomic_fetch_add_explicit(&recorder->next, 1, memory_order_relaxed) + 1;
+	BDFlightRecord *record = BDFlightRecorderSlot(recorder, sequence);
+	atomic_fetch_add_explicit(&record->writers, 1, memory_order_relaxed);
+	atomic_store_explicit(&record->sequence, 0, memory_order_relaxed);
+	// neither of the stores above can be seen after any of the writes to the record below
+	atomic_thread_fence(memory_order_release);
+	NSUInteger length = 0;
+	// anything too long is cut short (on a character boundary) rather than left out
+	[message getBytes:record->message maxLength:BD_FLIGHT_MESSAGE_BYTES usedLength:&length encoding:NSUTF8StringEncoding options:0 range:NSMakeRange(0, [message length]) remainingRange:NULL];
+	record->timestamp = timestamp;
+	record->severity = (uint16_t)severity;
+	record->length = (uint16_t)length;
+	record->flags = queued ? BD_FLIGHT_QUEUED : 0;
+	atomic_store_explicit(&record->sequence, sequence, memory_order_release);
+	atomic_fetch_sub_explicit(&record->writers, 1, memory_order_release);
+}
+
+/**
+ * Copies the record with the given sequence number out of its slot.  Returns NO if the slot holds some other
+ * record, or if anyone was writing to it at any point while it was being copied, so a record torn by a writer that
+ * wrapped round the recorder is never used.  Async-signal-safe.
+ */
+static BOOL BDFlightRecorderRead(BDFlightRecorderHeader *recorder, uint64_t sequence, BDFlightRecord *copy) {
+	BDFlightRecord *record = BDFlightRecorderSlot(recorder, sequence);
+	if (atomic_load_explicit(&record->writers, memory_order_acquire) != 0 || atomic_load_explicit(&record->sequence, memory_order_acquire) != sequence)
+		return NO;
+	copy->timestamp = record->timestamp;
+	copy->severity = record->severity;
+	copy->length = MIN(record->length, BD_FLIGHT_MESSAGE_BYTES);
+	copy->flags = record->flags;
+	memcpy(copy->message, record->message, copy->length);
+	// none of the copying above can be done after checking again below
+	atomic_thread_fence(memory_order_acquire);
+	return atomic_load_explicit(&record->writers, memory_order_relaxed) == 0 && atomic_load_explicit(&record->sequence, memory_order_relaxed) == sequence;
+}
+
+void BDLoggerRecordCrash(void) {
+	BDFlightRecorderHeader *recorder = atomic_load(&BDActiveFlightRecorder);
+	if (recorder != NULL)
+		atomic_store(&recorder->crashed, 1);
+}
+
+/** Appends the decimal digits of a number to a buffer, using nothing that is unsafe in a signal handler */
+static size_t BDFormatDecimal(char *buffer, uint64_t value, int minDigits) {
+	char digits[20];
+	int count = 0;
+	do {
+		digits[count++] = '0' + (value % 10);
+		value /= 10;
+	} while (value != 0 || count < minDigits);
+	for (int i = 0; i < count; i++)
+		buffer[i] = digits[count - 1 - i];
+	return count;
+}
+
+void BDLoggerDumpFlightRecorder(int fd) {
+	static const char *severityNames[] = { "Emergency", "Alert", "Critical", "Error", "Warning", "Notice", "Info", "Debug" };
+	BDFlightRecorderHeader *recorder = atomic_load(&BDActiveFlightRecorder);
+	if (recorder == NULL)
+		return;
+	// anyone dumping the flight recorder is almost certainly doing so because the process is crashing
+	atomic_store(&recorder->crashed, 1);
+
+	uint64_t next = atomic_load_explicit(&recorder->next, memory_order_acquire);
+	uint64_t first = next > recorder->capacity ? next - recorder->capacity + 1 : 1;
+	for (uint64_t sequence = first; sequence <= next; sequence++) {
+		BDFlightRecord copy;
+		BDFlightRecord *record = &copy;
+		if (!BDFlightRecorderRead(recorder, sequence, record))
+			continue;
+
+		char line[64];
+		double timestamp = record->timestamp < 0 ? 0 : record->timestamp;
+		size_t used = BDFormatDecimal(line, (uint64_t)timestamp, 1);
+		line[used++] = '.';
+		used += BDFormatDecimal(line + used, (uint64_t)((timestamp - (uint64_t)timestamp) * 1000), 3);
+		line[used++] = ' ';
+		line[used++] = '[';
+		const char *severityName = record->severity > BDSeverityDebug ? "Unknown" : severityNames[record->severity];
+		for (const char *c = severityName; *c != '\0'; c++)
+			line[used++] = *c;
+		line[used++] = ']';
+		line[used++] = ' ';
+		write(fd, line, used);
+		write(fd, record->message, record->length);
+		write(fd, "\n", 1);
+	}
+}
+
+
+// --------------------------------------------------------------------------------------------------
+// Partitions
+// --------------------------------------------------------------------------------------------------
+/**
+ * The most partitions that are queried with a single compound SELECT.  sqlite refuses to prepare a compound with
+ * more than SQLITE_MAX_COMPOUND_SELECT (500 by default) arms, which hourly partitions reach in three weeks.
+ */
+#define BD_MAX_COMPOUND_PARTITIONS 400
+
+/**
+ * One of the tables that log entries are stored in.  The original LOG_ENTRIES table has an empty suffix and
+ * covers all time.  Daily and hourly partitions are named LOG_ENTRIES_D<days since 1970> and
+ * LOG_ENTRIES_H<hours since 1970>, and only hold entries whose timestamp falls in that day or hour.  Any
+ * companion tables or indexes for a partition use the same suffix.
+ */
+@interface BDPartition : NSObject
+
+@property (nonatomic, strong) NSString *suffix;
+@property (nonatomic, assign) NSTimeInterval start;
+@property (nonatomic, assign) NSTimeInterval end;
+/** The base names of the companion tables (see BDCompanionTables) that exist for this partition */
+@property (nonatomic, strong) NSSet *companions;
+
++(instancetype)legacyPartition;
++(instancetype)partitionWithTableName:(NSString *)tableName;
++(NSString *)suffixForTimestamp:(NSTimeInterval)timestamp partitioning:(BDLoggerPartitioning)partitioning;
+-(NSString *)tableNamed:(NSString *)baseName;
+-(BOOL)overlapsStart:(NSTimeInterval)start end:(NSTimeInterval)end;
+-(instancetype)partitionWithCompanions:(NSSet *)companions;
+
+@end
+
+/**
+ * Tables that sit alongside each partition's LOG_ENTRIES table, keyed by the base table name and mapping to the
+ * column that holds the LOG_ENTRIES rowid an entry belongs to.
+ */
+static NSDictionary *BDCompanionTables(void) {
+	return @{ @"LOG_FTS" : @"rowid", @"LOG_FIELDS" : @"Z_ENTRY" };
+}
+
+/**
+ * Binds an indexed userInfo value.  Strings and numbers are bound as their natural sqlite types (so that 42 and
+ * @42 find each other); anything else can't be indexed and NO is returned.
+ */
+static BOOL BDBindFieldValue(sqlite3_stmt *statement, int index, id value) {
+	if ([value isKindOfClass:[NSString class]]) {
+		sqlite3_bind_text(statement, index, [value UTF8String], -1, SQLITE_TRANSIENT);
+		return YES;
+	}
+	if ([value isKindOfClass:[NSNumber class]]) {
+		if (CFNumberIsFloatType((__bridge CFNumberRef)value))
+			sqlite3_bind_double(statement, index, [value doubleValue]);
+		else
+			sqlite3_bind_int64(statement, index, [value longLongValue]);
+		return YES;
+	}
+	return NO;
+}
+
+@implementation BDPartition
+
++(instancetype)legacyPartition {
+	BDPartition *partition = [[BDPartition alloc] init];
+	partition.suffix = @"";
+	partition.start = -DBL_MAX;
+	partition.end = DBL_MAX;
+	partition.companions = [NSSet set];
+	return partition;
+}
+
++(instancetype)partitionWithTableName:(NSString *)tableName {
+	NSString *prefix = @"LOG_ENTRIES_";
+	if (![tableName hasPrefix:prefix] || [tableName length] < [prefix length] + 2)
+		return nil;
+
+	unichar period = [tableName characterAtIndex:[prefix length]];
+	NSTimeInterval length = period == 'D' ? 24 * 60 * 60 : (period == 'H' ? 60 * 60 : 0);
+	NSString *number = [tableName substringFromIndex:[prefix length] + 1];
+	if (length == 0 || [number rangeOfCharacterFromSet:[[NSCharacterSet decimalDigitCharacterSet] invertedSet]].location != NSNotFound)
+		return nil;
+
+	BDPartition *partition = [[BDPartition alloc] init];
+	partition.suffix = [tableName substringFromIndex:[prefix length] - 1];
+	partition.start = [number longLongValue] * length;
+	partition.end = partition.start + length;
+	partition.companions = [NSSet set];
+	return partition;
+}
+
++(NSString *)suffixForTimestamp:(NSTimeInterval)timestamp partitioning:(BDLoggerPartitioning)partitioning {
+	switch (partitioning) {
+		case BDLoggerPartitioningDaily:
+			return [NSString stringWithFormat:@"_D%lld", (long long)floor(timestamp / (24 * 60 * 60))];
+		case BDLoggerPartitioningHourly:
+			return [NSString stringWithFormat:@"_H%lld", (long long)floor(timestamp / (60 * 60))];
+		default:
+			return @"";
+	}
+}
+
+-(NSString *)tableNamed:(NSString *)baseName {
+	return [baseName stringByAppendingString:self.suffix];
+}
+
+-(BOOL)overlapsStart:(NSTimeInterval)start end:(NSTimeInterval)end {
+	return self.start <= end && self.end > start;
+}
+
+-(instancetype)partitionWithCompanions:(NSSet *)companions {
+	BDPartition *partition = [[BDPartition alloc] init];
+	partition.suffix = self.suffix;
+	partition.start = self.start;
+	partition.end = self.end;
+	partition.companions = companions;
+	return partition;
+}
+
+@end
+
+
+// --------------------------------------------------------------------------------------------------
+// Memory mapped segments
+// --------------------------------------------------------------------------------------------------
+#define BD_SEGMENT_MAGIC 0x47535442		// "BTSG"
+#define BD_SEGMENT_VERSION 1
+#define BD_SEGMENT_BLOCK_RECORDS 64
+
+/** Starts every segment file. committed is only advanced once the record bytes before it are in place. */
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	_Atomic uint64_t committed;
+} BDSegmentHeader;
+
+/** A record in a segment, followed by its message bytes and then its userInfo bytes, padded to 8 bytes */
+typedef struct {
+	uint32_t length;
+	uint32_t severity;
+	double timestamp;
+	uint32_t messageLength;
+	uint32_t userInfoLength;
+} BDSegmentRecord;
+
+/** One entry in a segment's sparse index, covering BD_SEGMENT_BLOCK_RECORDS consecutive records */
+typedef struct {
+	uint64_t start;
+	uint64_t end;
+	double minTimestamp;
+	double maxTimestamp;
+} BDSegmentBlock;
+
+/**
+ * A preallocated, memory mapped file that entries are appended to while they wait to be compacted into the log
+ * store.  Appending is only ever done on the dispatchQueue; any queue can read the records that have been committed.
+ */
+@interface BDSegment : NSObject
+
+@property (nonatomic, assign, readonly) sqlite3_int64 number;
+@property (nonatomic, strong, readonly) NSURL *url;
+
+-(instancetype)initWithURL:(NSURL *)url number:(sqlite3_int64)number size:(NSUInteger)size error:(NSError **)error;
+-(BOOL)appendTimestamp:(NSTimeInterval)timestamp severity:(BDSeverity)severity messageBytes:(const char *)messageBytes length:(int)messageLength userInfoData:(NSData *)userInfoData;
+-(void)enumerateRecordsBetweenStart:(NSTimeInterval)start end:(NSTimeInterval)end severity:(BDSeverity)severity usingBlock:(void (^)(const BDSegmentRecord *record))block;
+-(void)enumerateRecordsBetweenStart:(NSTimeInterval)start end:(NSTimeInterval)end severity:(BDSeverity)severity reverse:(BOOL)reverse skippingBlocks:(BOOL (^)(NSTimeInterval minTimestamp, NSTimeInterval maxTimestamp))skip usingBlock:(void (^)(const BDSegmentRecord *record, uint64_t offset))block;
+/** Whether anything has been appended yet */
+-(BOOL)isEmpty;
+
+@end
+
+@implementation BDSegment {
+	void *_mapping;
+	size_t _size;
+	BDSegmentHeader *_header;
+	char *_records;
+	uint64_t _capacity;
+	/** Completed index blocks are published by bumping _blockCount. The open block is only seen by the writer. */
+	BDSegmentBlock *_blocks;
+	size_t _maxBlocks;
+	_Atomic size_t _blockCount;
+	BDSegmentBlock _openBlock;
+	NSUInteger _openBlockRecords;
+}
+
+/**
+ * Reserves the disk space for a new file of the given size.  Just extending the file would leave it sparse, and
+ * running out of disk space would then only show up as a SIGBUS when a record is stored into the mapping.
+ * Returns NO with errno set if the space isn't there.
+ */
+static BOOL BDPreallocateFile(int fd, off_t size) {
+#ifdef F_PREALLOCATE
+	fstore_t store = { F_ALLOCATECONTIG | F_ALLOCATEALL, F_PEOFPOSMODE, 0, size, 0 };
+	if (fcntl(fd, F_PREALLOCATE, &store) == -1) {
+		store.fst_flags = F_ALLOCATEALL;
+		if (fcntl(fd, F_PREALLOCATE, &store) == -1)
+			return NO;
+	}
+#else
+	int rc = posix_fallocate(fd, 0, size);
+	if (rc != 0) {
+		errno = rc;
+		return NO;
+	}
+#endif
+	return ftruncate(fd, size) == 0;
+}
+
+/** Maps the segment file, creating and preallocating it first if it doesn't exist yet */
+-(instancetype)initWithURL:(NSURL *)url number:(sqlite3_int64)number size:(NSUInteger)size error:(NSError **)error {
+	self = [super init];
+	if (self != nil) {
+		_url = url;
+		_number = number;
+
+		const char *path = [[url path] fileSystemRepresentation];
+		int fd = open(path, O_RDWR | O_CREAT, 0644);
+		struct stat info;
+		int mapError = 0;
+		_mapping = MAP_FAILED;
+		if (fd < 0 || fstat(fd, &info) != 0) {
+			mapError = errno;
+		}
+		else if (info.st_size == 0 && !BDPreallocateFile(fd, size)) {
+			mapError = errno;
+			// an empty segment file would only be mistaken for one that this process can still append to
+			unlink(path);
+		}
+		else {
+			if (info.st_size == 0)
+				info.st_size = size;
+			if (info.st_size <= (off_t)sizeof(BDSegmentHeader))
+				mapError = EINVAL;
+			else if ((_mapping = mmap(NULL, info.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED)
+				mapError = errno;
+		}
+		if (fd >= 0)
+			close(fd);
+		if (_mapping == MAP_FAILED) {
+			if (error != NULL) {
+				NSString *message = [NSString stringWithFormat:@"Unable to map log segment %@ (errno=%d): %s", [url path], mapError, strerror(mapError)];
+				*error = [NSError errorWithDomain:BD_ERROR_DOMAIN code:mapError userInfo:@{ NSLocalizedDescriptionKey : message }];
+			}
+			return nil;
+		}
+		_size = info.st_size;
+		_header = _mapping;
+		_records = (char *)_mapping + sizeof(BDSegmentHeader);
+		_capacity = _size - sizeof(BDSegmentHeader);
+		if (_header->magic != BD_SEGMENT_MAGIC) {
+			_header->magic = BD_SEGMENT_MAGIC;
+			_header->version = BD_SEGMENT_VERSION;
+			atomic_store(&_header->committed, 0);
+		}
+		_maxBlocks = _capacity / (sizeof(BDSegmentRecord) * BD_SEGMENT_BLOCK_RECORDS) + 1;
+		_blocks = calloc(_maxBlocks, sizeof(BDSegmentBlock));
+		atomic_init(&_blockCount, 0);
+		_openBlockRecords = 0;
+
+		// rebuild the index for whatever was committed before the segment was last closed
+		uint64_t committed = MIN(atomic_load(&_header->committed), _capacity);
+		for (uint64_t offset = 0; offset + sizeof(BDSegmentRecord) <= committed; ) {
+			const BDSegmentRecord *record = (const BDSegmentRecord *)(_records + offset);
+			if (record->length < sizeof(BDSegmentRecord) || offset + record->length > committed)
+				break;
+			[self indexRecord:record at:offset];
+			offset += record->length;
+		}
+	}
+	return self;
+}
+
+-(void)dealloc {
+	if (_mapping != MAP_FAILED && _mapping != NULL)
+		munmap(_mapping, _size);
+	free(_blocks);
+}
+
+-(void)indexRecord:(const BDSegmentRecord *)record at:(uint64_t)offset {
+	if (_openBlockRecords == 0) {
+		_openBlock.start = offset;
+		_openBlock.minTimestamp = record->timestamp;
+		_openBlock.maxTimestamp = record->timestamp;
+	}
+	_openBlock.end = offset + record->length;
+	_openBlock.minTimestamp = MIN(_openBlock.minTimestamp, record->timestamp);
+	_openBlock.maxTimestamp = MAX(_openBlock.maxTimestamp, record->timestamp);
+	if (++_openBlockRecords == BD_SEGMENT_BLOCK_RECORDS) {
+		size_t count = atomic_load_explicit(&_blockCount, memory_order_relaxed);
+		if (count < _maxBlocks) {
+			_blocks[count] = _openBlock;
+			atomic_store_explicit(&_blockCount, count + 1, memory_order_release);
+		}
+		_openBlockRecords = 0;
+	}
+}
+
+/** Returns NO if the record won't fit in what is left of the segment */
+-(BOOL)appendTimestamp:(NSTimeInterval)timestamp severity:(BDSeverity)severity messageBytes:(const char *)messageBytes length:(int)messageLength userInfoData:(NSData *)userInfoData {
+	uint64_t offset = atomic_load_explicit(&_header->committed, memory_order_relaxed);
+	uint32_t userInfoLength = (uint32_t)[userInfoData length];
+	uint64_t length = (sizeof(BDSegmentRecord) + messageLength + userInfoLength + 7) & ~7ULL;
+	if (offset + length > _capacity)
+		return NO;
+
+	BDSegmentRecord *record = (BDSegmentRecord *)(_records + offset);
+	record->length = (uint32_t)length;
+	record->severity = (uint32_t)severity;
+	record->timestamp = timestamp;
+	record->messageLength = messageLength;
+	record->userInfoLength = userInfoLength;
+	memcpy((char *)(record + 1), messageBytes, messageLength);
+	if (userInfoLength > 0)
+		memcpy((char *)(record + 1) + messageLength, [userInfoData bytes], userInfoLength);
+	atomic_store_explicit(&_header->committed, offset + length, memory_order_release);
+	[self indexRecord:record at:offset];
+	return YES;
+}
+
+-(BOOL)isEmpty {
+	return atomic_load_explicit(&_header->committed, memory_order_acquire) == 0;
+}
+
+/** Hands the block each committed record matching the criteria, in the order they were appended */
+-(void)enumerateRecordsBetweenStart:(NSTimeInterval)start end:(NSTimeInterval)end severity:(BDSeverity)severity usingBlock:(void (^)(const BDSegmentRecord *record))block {
+	[self enumerateRecordsBetweenStart:start end:end severity:severity reverse:NO skippingBlocks:nil usingBlock:^(const BDSegmentRecord *record, uint64_t offset) {
+		block(record);
+	}];
+}
+
+/**
+ * Hands the block each committed record matching the criteria, along with its offset, one index block at a time.
+ * The index blocks are visited in the order they were appended, or most recent first if reverse, but the records
+ * within each one are always in the order they were appended.  skip, if given, is asked about each index block
+ * before its records are read, and can pass over blocks whose timestamps can't be of any use.
+ */
+-(void)enumerateRecordsBetweenStart:(NSTimeInterval)start end:(NSTimeInterval)end severity:(BDSeverity)severity reverse:(BOOL)reverse skippingBlocks:(BOOL (^)(NSTimeInterval minTimestamp, NSTimeInterval maxTimestamp))skip usingBlock:(void (^)(const BDSegmentRecord *record, uint64_t offset))block {
+	// load the block count first, so every block it covers is already committed
+	size_t blockCount = atomic_load_explicit(&_blockCount, memory_order_acquire);
+	uint64_t committed = MIN(atomic_load_explicit(&_header->committed, memory_order_acquire), _capacity);
+	uint64_t tail = blockCount == 0 ? 0 : _blocks[blockCount - 1].end;
+	for (size_t n = 0; n <= blockCount; n++) {
+		// the records after the last complete index block have no entry of their own, and are the most recent
+		size_t i = reverse ? blockCount - n : n;
+		uint64_t from = i < blockCount ? _blocks[i].start : tail;
+		uint64_t to = i < blockCount ? _blocks[i].end : committed;
+		if (i < blockCount) {
+			if (_blocks[i].maxTimestamp < start || _blocks[i].minTimestamp > end)
+				continue;
+			if (skip != nil && skip(_blocks[i].minTimestamp, _blocks[i].maxTimestamp))
+				continue;
+		}
+		for (uint64_t offset = from; offset + sizeof(BDSegmentRecord) <= to; ) {
+			const BDSegmentRecord *record = (const BDSegmentRecord *)(_records + offset);
+			if (record->length < sizeof(BDSegmentRecord))
+				break;
+			if (record->timestamp >= start && record->timestamp <= end && record->severity <= severity)
+				block(record, offset);
+			offset += record->length;
+		}
+	}
+}
+
+@end
+
+typedef struct {
+	double timestamp;
+	/** The segment's position in the cursor's list in the top 24 bits, and the record's offset in the rest */
+	uint64_t sequence;
+	const BDSegmentRecord *record;
+} BDSegmentCursorItem;
+
+static int BDCompareSegmentCursorItems(const void *a, const void *b) {
+	const BDSegmentCursorItem *item1 = a, *item2 = b;
+	if (item1->timestamp != item2->timestamp)
+		return item1->timestamp < item2->timestamp ? -1 : 1;
+	return item1->sequence < item2->sequence ? -1 : (item1->sequence > item2->sequence ? 1 : 0);
+}
+
+/** Whether item1 comes out of a cursor before item2 */
+static inline BOOL BDSegmentCursorItemPrecedes(const BDSegmentCursorItem *item1, const BDSegmentCursorItem *item2, BOOL ascending) {
+	int order = BDCompareSegmentCursorItems(item1, item2);
+	return ascending ? order < 0 : order > 0;
+}
+
+/**
+ * Walks the matching records of a set of segments in timestamp order.  Only the first maxEntries records are kept
+ * (in a heap with the last of them on top), and once the heap is full, any index block whose timestamps can't beat
+ * the top is passed over without being read.  Entries nearly always arrive in timestamp order, so asking for the
+ * most recent few only reads the last index block or two of the newest segment.  The records are read in place, so
+ * the cursor keeps the segments (and therefore their mappings) alive until it is released.
+ */
+@interface BDSegmentCursor : NSObject
+
+-(instancetype)initWithSegments:(NSArray *)segments start:(NSTimeInterval)start end:(NSTimeInterval)end severity:(BDSeverity)severity ascending:(BOOL)ascending maxEntries:(NSUInteger)maxEntries;
+/** Whether there is another record, and it sorts before the given timestamp */
+-(BOOL)hasEntryBefore:(NSTimeInterval)timestamp;
+-(const BDSegmentRecord *)next;
+
+@end
+
+@implementation BDSegmentCursor {
+	NSArray *_segments;
+	BOOL _ascending;
+	NSUInteger _limit;
+	NSMutableData *_items;
+	size_t _count;
+	size_t _position;
+}
+
+-(instancetype)initWithSegments:(NSArray *)segments start:(NSTimeInterval)start end:(NSTimeInterval)end severity:(BDSeverity)severity ascending:(BOOL)ascending maxEntries:(NSUInteger)maxEntries {
+	self = [super init];
+	if (self != nil) {
+		_segments = segments;
+		_ascending = ascending;
+		_limit = maxEntries;
+		_items = [NSMutableData data];
+		_count = 0;
+		_position = 0;
+
+		// the segments and their index blocks are visited in the order the cursor hands them out, so that the heap
+		// fills up with the records that are wanted as soon as possible
+		NSUInteger segmentCount = [segments count];
+		for (NSUInteger n = 0; n < segmentCount && _limit > 0; n++) {
+			NSUInteger index = ascending ? n : segmentCount - 1 - n;
+			[segments[index] enumerateRecordsBetweenStart:start end:end severity:severity reverse:!ascending skippingBlocks:^BOOL(NSTimeInterval minTimestamp, NSTimeInterval maxTimestamp) {
+				const BDSegmentCursorItem *last = [self lastKept];
+				return last != NULL && (ascending ? minTimestamp > last->timestamp : maxTimestamp < last->timestamp);
+			} usingBlock:^(const BDSegmentRecord *record, uint64_t offset) {
+				BDSegmentCursorItem item = { record->timestamp, ((uint64_t)index << 40) | offset, record };
+				[self keepItem:&item];
+			}];
+		}
+		qsort([_items mutableBytes], _count, sizeof(BDSegmentCursorItem), BDCompareSegmentCursorItems);
+	}
+	return self;
+}
+
+/** The last of the records kept so far, or NULL if there is still room for more */
+-(const BDSegmentCursorItem *)lastKept {
+	if (_limit == NSUIntegerMax || _count < _limit)
+		return NULL;
+	return [_items bytes];
+}
+
+/** Keeps a record if it is one of the first maxEntries seen so far, in place of the last of them */
+-(void)keepItem:(const BDSegmentCursorItem *)item {
+	// without a limit, everything is kept and just sorted at the end
+	if (_limit == NSUIntegerMax) {
+		[_items appendBytes:item length:sizeof(*item)];
+		_count++;
+		return;
+	}
+
+	BDSegmentCursorItem *heap;
+	size_t i;
+	if (_count < _limit) {
+		[_items appendBytes:item length:sizeof(*item)];
+		heap = [_items mutableBytes];
+		for (i = _count++; i > 0 && BDSegmentCursorItemPrecedes(&heap[(i - 1) / 2], &heap[i], _ascending); i = (i - 1) / 2) {
+			BDSegmentCursorItem swap = heap[i];
+			heap[i] = heap[(i - 1) / 2];
+			heap[(i - 1) / 2] = swap;
+		}
+		return;
+	}
+
+	heap = [_items mutableBytes];
+	if (!BDSegmentCursorItemPrecedes(item, &heap[0], _ascending))
+		return;
+	heap[0] = *item;
+	for (i = 0; ; ) {
+		size_t later = i;
+		size_t left = i * 2 + 1, right = i * 2 + 2;
+		if (left < _count && BDSegmentCursorItemPrecedes(&heap[later], &heap[left], _ascending))
+			later = left;
+		if (right < _count && BDSegmentCursorItemPrecedes(&heap[later], &heap[right], _ascending))
+			later = right;
+		if (later == i)
+			break;
+		BDSegmentCursorItem swap = heap[i];
+		heap[i] = heap[later];
+		heap[later] = swap;
+		i = later;
+	}
+}
+
+-(const BDSegmentCursorItem *)peek {
+	if (_position >= _count)
+		return NULL;
+	const BDSegmentCursorItem *items = [_items bytes];
+	return &items[_ascending ? _position : _count - 1 - _position];
+}
+
+-(BOOL)hasEntryBefore:(NSTimeInterval)timestamp {
+	const BDSegmentCursorItem *item = [self peek];
+	return item != NULL && (_ascending ? item->timestamp < timestamp : item->timestamp > timestamp);
+}
+
+-(const BDSegmentRecord *)next {
+	const BDSegmentCursorItem *item = [self peek];
+	_position++;
+	return item == NULL ? NULL : item->record;
+}
+
+@end
+
+
+// --------------------------------------------------------------------------------------------------
+// Columnar archives
+// --------------------------------------------------------------------------------------------------
+/**
+ * An archive starts with "BDLA" and a version (4 bytes, little endian), followed by blocks of up to
+ * BD_ARCHIVE_BLOCK_ROWS entries.  Each block is a row count (4 bytes) and then six columns: the timestamps (in
+ * microseconds, zigzag varints, the first absolute and the rest as deltas), the severities (packed two to a byte),
+ * the message lengths (varints), the message bytes, the userInfo lengths (varints, 0 meaning none) and the userInfo
+ * bytes.  Each column is its uncompressed length and its stored length (4 bytes each) followed by the stored
+ * bytes, which are LZ4 compressed whenever the stored length is the smaller of the two.
+ */
+#define BD_ARCHIVE_MAGIC "BDLA"
+#define BD_ARCHIVE_VERSION 1
+#define BD_ARCHIVE_BLOCK_ROWS 4096
+
+static BOOL BDWriteAll(int fd, const void *bytes, size_t length) {
+	while (length > 0) {
+		ssize_t written = write(fd, bytes, length);
+		if (written < 0 && errno == EINTR)
+			continue;
+		if (written <= 0)
+			return NO;
+		bytes = (const uint8_t *)bytes + written;
+		length -= written;
+	}
+	return YES;
+}
+
+static void BDArchiveAppendColumn(NSMutableData *block, NSData *column, void *scratch) {
+	size_t length = [column length];
+	NSMutableData *compressed = [NSMutableData dataWithLength:length];
+	size_t compressedLength = length == 0 ? 0 : compression_encode_buffer([compressed mutableBytes], length, [column bytes], length, scratch, COMPRESSION_LZ4_RAW);
+	// the reader tells a raw column by its stored length matching its length, so compression has to actually save something
+	NSData *stored = compressedLength == 0 || compressedLength >= length ? column : [compressed subdataWithRange:NSMakeRange(0, compressedLength)];
+	uint8_t header[8];
+	OSWriteLittleInt32(header, 0, (uint32_t)length);
+	OSWriteLittleInt32(header, 4, (uint32_t)[stored length]);
+	[block appendBytes:header length:sizeof(header)];
+	[block appendData:stored];
+}
+
+/** Reads one column of a block, decompressing it if need be. Returns nil if the archive is corrupt. */
+static NSData *BDArchiveReadColumn(const uint8_t **cursor, const uint8_t *end) {
+	if (end - *cursor < 8)
+		return nil;
+	uint32_t length = OSReadLittleInt32(*cursor, 0);
+	uint32_t storedLength = OSReadLittleInt32(*cursor, 4);
+	*cursor += 8;
+	if (storedLength > end - *cursor || storedLength > length)
+		return nil;
+	const uint8_t *stored = *cursor;
+	*cursor += storedLength;
+	if (storedLength == length)
+		return [NSData dataWithBytesNoCopy:(void *)stored length:length freeWhenDone:NO];
+
+	NSMutableData *column = [NSMutableData dataWithLength:length];
+	size_t decoded = compression_decode_buffer([column mutableBytes], length, stored, storedLength, NULL, COMPRESSION_LZ4_RAW);
+	return decoded == length ? column : nil;
+}
+
+/** Builds up blocks of entries as columns, writing each one out as it fills */
+@interface BDArchiveWriter : NSObject
+
+-(instancetype)initWithFileDescriptor:(int)fd;
+-(BOOL)appendTimestamp:(NSTimeInterval)timestamp severity:(BDSeverity)severity messageBytes:(const void *)messageBytes length:(size_t)messageLength userInfoBytes:(const void *)userInfoBytes length:(size_t)userInfoLength;
+/** Writes out whatever is left in the current block */
+-(BOOL)finish;
+
+@end
+
+@implementation BDArchiveWriter {
+	int _fd;
+	NSUInteger _rows;
+	int64_t _previousMicros;
+	NSMutableData *_timestamps;
+	NSMutableData *_severities;
+	NSMutableData *_messageLengths;
+	NSMutableData *_messages;
+	NSMutableData *_userInfoLengths;
+	NSMutableData *_userInfos;
+	NSMutableData *_scratch;
+}
+
+-(instancetype)initWithFileDescriptor:(int)fd {
+	self = [super init];
+	if (self != nil) {
+		_fd = fd;
+		_scratch = [NSMutableData dataWithLength:compression_encode_scratch_buffer_size(COMPRESSION_LZ4_RAW)];
+		[self resetBlock];
+	}
+	return self;
+}
+
+-(void)resetBlock {
+	_rows = 0;
+	_previousMicros = 0;
+	_timestamps = [NSMutableData data];
+	_severities = [NSMutableData data];
+	_messageLengths = [NSMutableData data];
+	_messages = [NSMutableData data];
+	_userInfoLengths = [NSMutableData data];
+	_userInfos = [NSMutableData data];
+}
+
+-(BOOL)appendTimestamp:(NSTimeInterval)timestamp severity:(BDSeverity)severity messageBytes:(const void *)messageBytes length:(size_t)messageLength userInfoBytes:(const void *)userInfoBytes length:(size_t)userInfoLength {
+	// consecutive entries are close together in time, so the deltas are usually only a byte or two
+	int64_t micros = (int64_t)llround(timestamp * USEC_PER_SEC);
+	int64_t delta = micros - _previousMicros;
+	BDAppendVarint(_timestamps, ((uint64_t)delta << 1) ^ (uint64_t)(delta >> 63));
+	_previousMicros = micros;
+
+	uint8_t nibble = (uint8_t)MIN(severity, 0x0F);
+	if (_rows % 2 == 0)
+		[_severities appendBytes:&nibble length:1];
+	else
+		((uint8_t *)[_severities mutableBytes])[_rows / 2] |= nibble << 4;
+
+	BDAppendVarint(_messageLengths, messageLength);
+	[_messages appendBytes:messageBytes length:messageLength];
+	BDAppendVarint(_userInfoLengths, userInfoLength);
+	if (userInfoLength > 0)
+		[_userInfos appendBytes:userInfoBytes length:userInfoLength];
+
+	if (++_rows < BD_ARCHIVE_BLOCK_ROWS && [_messages length] + [_userInfos length] < UINT32_MAX / 2)
+		return YES;
+	return [self writeBlock];
+}
+
+-(BOOL)writeBlock {
+	if (_rows == 0)
+		return YES;
+	NSMutableData *block = [NSMutableData dataWithLength:4];
+	OSWriteLittleInt32([block mutableBytes], 0, (uint32_t)_rows);
+	for (NSData *column in @[ _timestamps, _severities, _messageLengths, _messages, _userInfoLengths, _userInfos ]) {
+		BDArchiveAppendColumn(block, column, [_scratch mutableBytes]);
+	}
+	[self resetBlock];
+	return BDWriteAll(_fd, [block bytes], [block length]);
+}
+
+-(BOOL)finish {
+	return [self writeBlock];
+}
+
+@end
+
+/**
+ * Hands each entry in an archive to a block, one block of entries at a time.  The bytes passed to the block are
+ * only valid until it returns.  Returns NO if the archive is corrupt (or the block asks to stop).
+ */
+static BOOL BDArchiveEnumerate(NSData *archive, BOOL (^block)(NSTimeInterval timestamp, BDSeverity severity, const char *messageBytes, int messageLength, const void *userInfoBytes, int userInfoLength)) {
+	const uint8_t *cursor = [archive bytes];
+	const uint8_t *end = cursor + [archive length];
+	if (end - cursor < 8 || memcmp(cursor, BD_ARCHIVE_MAGIC, 4) != 0 || OSReadLittleInt32(cursor, 4) != BD_ARCHIVE_VERSION)
+		return NO;
+	cursor += 8;
+
+	while (cursor < end) {
+		@autoreleasepool {
+			if (end - cursor < 4)
+				return NO;
+			uint32_t rows = OSReadLittleInt32(cursor, 0);
+			cursor += 4;
+			NSData *columns[6];
+			for (NSUInteger i = 0; i < 6; i++) {
+				columns[i] = BDArchiveReadColumn(&cursor, end);
+				if (columns[i] == nil)
+					return NO;
+			}
+			if ([columns[1] length] < (rows + 1) / 2)
+				return NO;
+
+			const uint8_t *timestamps = [columns[0] bytes], *timestampsEnd = timestamps + [columns[0] length];
+			const uint8_t *severities = [columns[1] bytes];
+			const uint8_t *messageLengths = [columns[2] bytes], *messageLengthsEnd = messageLengths + [columns[2] length];
+			const uint8_t *messages = [columns[3] bytes], *messagesEnd = messages + [columns[3] length];
+			const uint8_t *userInfoLengths = [columns[4] bytes], *userInfoLengthsEnd = userInfoLengths + [columns[4] length];
+			const uint8_t *userInfos = [columns[5] bytes], *userInfosEnd = userInfos + [columns[5] length];
+			int64_t micros = 0;
+			for (uint32_t row = 0; row < rows; row++) {
+				uint64_t zigzag, messageLength, userInfoLength;
+				if (!BDReadVarint(&timestamps, timestampsEnd, &zigzag) || !BDReadVarint(&messageLengths, messageLengthsEnd, &messageLength) || !BDReadVarint(&userInfoLengths, userInfoLengthsEnd, &userInfoLength))
+					return NO;
+				if (messageLength > (uint64_t)(messagesEnd - messages) || userInfoLength > (uint64_t)(userInfosEnd - userInfos) || messageLength > INT_MAX || userInfoLength > INT_MAX)
+					return NO;
+				micros += (int64_t)(zigzag >> 1) ^ -(int64_t)(zigzag & 1);
+				BDSeverity severity = (severities[row / 2] >> (row % 2 == 0 ? 0 : 4)) & 0x0F;
+				if (!block((NSTimeInterval)micros / USEC_PER_SEC, severity, (const char *)messages, (int)messageLength, userInfos, (int)userInfoLength))
+					return NO;
+				messages += messageLength;
+				userInfos += userInfoLength;
+			}
+		}
+	}
+	return YES;
+}
+
+
+// --------------------------------------------------------------------------------------------------
+// Metrics
+// --------------------------------------------------------------------------------------------------
+/** The live, atomically updated form of a BDMetricsHistogram */
+typedef struct {
+	atomic_ullong count;
+	atomic_ullong total;
+	atomic_ullong max;
+	atomic_ullong buckets[BD_METRICS_HISTOGRAM_BUCKETS];
+} BDAtomicHistogram;
+
+/**
+ * The live form of BDLoggerMetrics.  Nothing in here needs initialising beyond the zeroing every ivar gets.  Filtered
+ * entries are counted per thread instead (see BDThreadCounter), as that happens on the path that has to be nearly free.
+ */
+typedef struct {
+	atomic_ullong entriesAccepted;
+	atomic_ullong entriesDropped;
+	atomic_ullong entriesWritten;
+	atomic_ullong entriesFailed;
+	BDAtomicHistogram batchSize;
+	BDAtomicHistogram insertMicros;
+	BDAtomicHistogram commitMicros;
+	BDAtomicHistogram pruneMicros;
+	BDAtomicHistogram retrievalMicros;
+} BDAtomicMetrics;
+
+static inline void BDMetricsCount(atomic_ullong *counter, uint64_t amount) {
+	atomic_fetch_add_explicit(counter, amount, memory_order_relaxed);
+}
+
+/**
+ * One thread's count of filtered entries, so that counting them doesn't mean every logging thread fighting over
+ * one cache line.  Only the thread that has claimed it writes to it, and the counts are summed when the metrics are
+ * read.  When the thread goes away the counter is left on the logger's list, count and all, for a new thread to claim.
+ */
+typedef struct BDThreadCounter {
+	atomic_ullong filtered;
+	atomic_bool claimed;
+	struct BDThreadCounter *next;
+} BDThreadCounter;
+
+/** pthread key destructor: the thread has gone, so another one can have its counter */
+static void BDThreadCounterReleased(void *value) {
+	BDThreadCounter *counter = value;
+	atomic_store_explicit(&counter->claimed, false, memory_order_release);
+}
+
+/** A monotonic clock in microseconds, for timing things that go into the metrics */
+static inline uint64_t BDMetricsMicros(void) {
+	return clock_gettime_nsec_np(CLOCK_UPTIME_RAW) / NSEC_PER_USEC;
+}
+
+static void BDHistogramRecord(BDAtomicHistogram *histogram, uint64_t value) {
+	// bucket i holds the values that need exactly i bits
+	NSUInteger bucket = value == 0 ? 0 : MIN(64 - __builtin_clzll(value), BD_METRICS_HISTOGRAM_BUCKETS - 1);
+	atomic_fetch_add_explicit(&histogram->buckets[bucket], 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&histogram->count, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&histogram->total, value, memory_order_relaxed);
+	unsigned long long max = atomic_load_explicit(&histogram->max, memory_order_relaxed);
+	while (value > max && !atomic_compare_exchange_weak_explicit(&histogram->max, &max, value, memory_order_relaxed, memory_order_relaxed))
+		;
+}
+
+static BDMetricsHistogram BDHistogramSnapshot(BDAtomicHistogram *histogram) {
+	BDMetricsHistogram snapshot;
+	snapshot.count = atomic_load_explicit(&histogram->count, memory_order_relaxed);
+	snapshot.total = atomic_load_explicit(&histogram->total, memory_order_relaxed);
+	snapshot.max = atomic_load_explicit(&histogram->max, memory_order_relaxed);
+	for (NSUInteger i = 0; i < BD_METRICS_HISTOGRAM_BUCKETS; i++) {
+		snapshot.buckets[i] = atomic_load_explicit(&histogram->buckets[i], memory_order_relaxed);
+	}
+	return snapshot;
+}
+
+
+// --------------------------------------------------------------------------------------------------
+// Filter state
+// --------------------------------------------------------------------------------------------------
+/** Passed to BDFilterStatePack() for something that wants no entries at all */
+#define BD_FILTER_NONE ((BDSeverity)NSUIntegerMax)
+
+static inline uint32_t BDFilterStateField(BDSeverity severity) {
+	return severity == BD_FILTER_NONE ? 0 : (uint32_t)MIN(severity, 0xFE) + 1;
+}
+
+/** Packs the log store's and the flight recorder's severities into a filter state word, without the prune due flag */
+static inline uint32_t BDFilterStatePack(BDSeverity storeSeverity, BDSeverity recordSeverity) {
+	uint32_t store = BDFilterStateField(storeSeverity);
+	uint32_t record = BDFilterStateField(recordSeverity);
+	return MAX(store, record) | (store << BD_FILTER_STORE_SHIFT) | (record << BD_FILTER_RECORD_SHIFT);
+}
+
+static inline BOOL BDFilterStateStores(uint32_t filterState, BDSeverity severity) {
+	return severity < ((filterState >> BD_FILTER_STORE_SHIFT) & BD_FILTER_ADMIT_MASK);
+}
+
+static inline BOOL BDFilterStateRecords(uint32_t filterState, BDSeverity severity) {
+	return severity < ((filterState >> BD_FILTER_RECORD_SHIFT) & BD_FILTER_ADMIT_MASK);
+}
+
+/** Replaces the severities in a filter state word */
+static void BDFilterStateStore(uint32_t *filterState, uint32_t severities) {
+	uint32_t current = __atomic_load_n(filterState, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(filterState, &current, severities, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		;
+}
+
+
+// --------------------------------------------------------------------------------------------------
+// Row views
+// --------------------------------------------------------------------------------------------------
+/** A chunk of an arena. Allocations are carved off the front until it runs out, and then a bigger chunk is added. */
+typedef struct BDArenaChunk {
+	struct BDArenaChunk *next;
+	size_t capacity;
+	size_t used;
+	uint8_t bytes[];
+} BDArenaChunk;
+
+/**
+ * Scratch memory that is handed out in pieces and then all given back at once.  Resetting an arena that had to grow
+ * replaces its chunks with a single one big enough for all of them, so once it has seen its largest row it just
+ * reuses the same memory over and over.
+ */
+typedef struct {
+	BDArenaChunk *chunk;
+} BDArena;
+
+static void *BDArenaAllocate(BDArena *arena, size_t size) {
+	// everything handed out stays 8 byte aligned
+	size = (size + 7) & ~(size_t)7;
+	BDArenaChunk *chunk = arena->chunk;
+	if (chunk == NULL || chunk->capacity - chunk->used < size) {
+		size_t capacity = MAX(size, chunk == NULL ? 4096 : chunk->capacity * 2);
+		BDArenaChunk *grown = malloc(sizeof(BDArenaChunk) + capacity);
+		if (grown == NULL)
+			return NULL;
+		grown->next = chunk;
+		grown->capacity = capacity;
+		grown->used = 0;
+		arena->chunk = chunk = grown;
+	}
+	void *allocation = chunk->bytes + chunk->used;
+	chunk->used += size;
+	return allocation;
+}
+
+static void BDArenaReset(BDArena *arena) {
+	BDArenaChunk *chunk = arena->chunk;
+	if (chunk == NULL)
+		return;
+	if (chunk->next == NULL) {
+		chunk->used = 0;
+		return;
+	}
+	size_t capacity = 0;
+	while (chunk != NULL) {
+		BDArenaChunk *next = chunk->next;
+		capacity += chunk->capacity;
+		free(chunk);
+		chunk = next;
+	}
+	arena->chunk = NULL;
+	BDArenaAllocate(arena, capacity);
+	if (arena->chunk != NULL)
+		arena->chunk->used = 0;
+}
+
+static void BDArenaFree(BDArena *arena) {
+	BDArenaChunk *chunk = arena->chunk;
+	while (chunk != NULL) {
+		BDArenaChunk *next = chunk->next;
+		free(chunk);
+		chunk = next;
+	}
+	arena->chunk = NULL;
+}
+
+/** Like BDDecompressBytes(), but decompresses into an arena. Returns NULL if the bytes are corrupt. */
+static const void *BDDecompressBytesIntoArena(const void *bytes, size_t length, BDArena *arena, size_t *uncompressedLength) {
+	uint32_t expectedLength = OSReadLittleInt32(bytes, 2);
+	void *uncompressed = BDArenaAllocate(arena, expectedLength);
+	if (uncompressed == NULL)
+		return NULL;
+	size_t decoded = compression_decode_buffer(uncompressed, expectedLength, (const uint8_t *)bytes + BD_COMPRESSED_HEADER_BYTES, length - BD_COMPRESSED_HEADER_BYTES, NULL, COMPRESSION_LZ4_RAW);
+	*uncompressedLength = decoded;
+	return decoded == expectedLength ? uncompressed : NULL;
+}
+
+@interface BDLogRow ()
+
+-(instancetype)initWithLogger:(BDLogger *)logger;
+/** Points the row at the current row of a statement that selects Z_TIMESTAMP, Z_SEVERITY, Z_MESSAGE, Z_USERINFO */
+-(void)loadFromStatement:(sqlite3_stmt *)statement;
+-(void)loadFromSegmentRecord:(const BDSegmentRecord *)record;
+
+@end
+
+
+// --------------------------------------------------------------------------------------------------
+// BDLogger implementation
+// --------------------------------------------------------------------------------------------------
+@interface BDLogCategory ()
+
+-(instancetype)initWithName:(NSString *)name logger:(BDLogger *)logger;
+
+@end
+
+/** How many maintenance ticks in a row can be skipped because the writer is busy */
+#define BD_MAINTENANCE_MAX_DEFERRALS 5
+
+/** Tags a logger's dispatchQueue with the logger, so that it can tell when it is being called from the writer */
+static char BDDispatchQueueKey;
+
+/**
+ * How many call sites each logger keeps for itself (a power of two), how far it looks for a free one, and how many
+ * of them format strings may take, so that they can't crowd out the BDLog macro sites of other loggers
+ */
+#define BD_CALL_SITE_SLOTS 256
+#define BD_CALL_SITE_PROBES 8
+#define BD_CALL_SITE_FORMAT_SLOTS 128
+
+/**
+ * One of the call sites a logger keeps for itself, keyed by the BDLog macro's own site, or for a format string by
+ * its hash with the low bit set (which no site's address has).  Format strings with the same hash can share a key,
+ * and are told apart by the text in site.file.
+ */
+typedef struct {
+	_Atomic(const void *) key;
+	/** Set once site has been filled in by whoever claimed the key */
+	atomic_bool ready;
+	BDCallSite site;
+} BDCallSiteSlot;
+
+static BDCallSite *BDLoggerCallSiteSlot(BDLogger *logger, const void *key, const BDCallSite *macroSite, NSString *format);
+
+/**
+ * The ring records of one severity in the recent entry cache, kept as they were drained rather than as BDEntry
+ * objects, oldest first.  records is a circular buffer of the cache's capacity, allocated when first needed.
+ */
+typedef struct {
+	BDRingRecord *records;
+	NSUInteger first;
+	NSUInteger count;
+} BDRecentRecords;
+
+static inline BDRingRecord *BDRecentRecordAt(BDRecentRecords *recent, NSUInteger capacity, NSUInteger index) {
+	return &recent->records[(recent->first + index) % capacity];
+}
+
+/** Adds a record in timestamp order, pushing out the oldest if the cache is full */
+static void BDRecentRecordsInsert(BDRecentRecords *recent, NSUInteger capacity, const BDRingRecord *record) {
+	if (recent->records == NULL)
+		recent->records = malloc(capacity * sizeof(BDRingRecord));
+	if (recent->count == capacity) {
+		// it would only be pushed straight back out again
+		if (record->timestamp < BDRecentRecordAt(recent, capacity, 0)->timestamp)
+			return;
+		recent->first = (recent->first + 1) % capacity;
+		recent->count--;
+	}
+	// records nearly always arrive in order, so this nearly always moves nothing
+	NSUInteger index = recent->count;
+	while (index > 0 && BDRecentRecordAt(recent, capacity, index - 1)->timestamp > record->timestamp) {
+		*BDRecentRecordAt(recent, capacity, index) = *BDRecentRecordAt(recent, capacity, index - 1);
+		index--;
+	}
+	*BDRecentRecordAt(recent, capacity, index) = *record;
+	recent->count++;
+}
+
+@interface BDLogger () {
+	/** Set while a background checkpoint is waiting to run, so that a burst of commits only schedules one */
+	atomic_flag _checkpointScheduled;
+	/** Guards _retrievalStats, which is updated on the readQueue but can be read from any thread */
+	os_unfair_lock _retrievalStatsLock;
+	BDRetrievalStats _retrievalStats;
+	/** Per-thread counters of filtered entries, keyed off _counterKey, and linked together so -metrics can sum them */
+	pthread_key_t _counterKey;
+	_Atomic(BDThreadCounter *) _threadCounters;
+	/** Per-thread ring buffers, keyed off _ringKey, and linked together so the writer can find them */
+	pthread_key_t _ringKey;
+	_Atomic(BDRing *) _rings;
+	/** Set while a ring buffer drain is waiting to run on the dispatchQueue */
+	atomic_flag _ringDrainScheduled;
+	/** Entries thrown away because a ring buffer was full and the overflow policy said to drop them */
+	atomic_ulong _ringDropped;
+	/** Entries handed to the dispatchQueue (or the bounded queue) and not yet picked up by the writer */
+	atomic_ulong _queueDepth;
+	/**
+	 * With maxQueuedEntries set, the entries waiting for the writer, oldest first for each severity, and the
+	 * sequence that orders them across severities.  Guarded by _queueLock.
+	 */
+	NSMutableArray *_queuedEntries[BDSeverityDebug + 1];
+	uint64_t _queueSequence;
+	/** Set while a drain of the bounded queue is waiting to run on the dispatchQueue */
+	atomic_flag _queueDrainScheduled;
+	atomic_ulong _queueHighWaterMark;
+	atomic_ulong _queueDropped;
+	/** Entries dropped since the last warning about them, and whether that warning has been scheduled */
+	atomic_ulong _queueDroppedUnreported;
+	atomic_flag _queueDropWarningScheduled;
+	/** Threads waiting for the queue to make room, under BDQueueOverflowBlock */
+	atomic_ulong _queueWaiters;
+	dispatch_semaphore_t _queueSpace;
+	/** Guards _queuedEntries, lastQueuedEntry, lastQueuedMessage and the queued entries' coalescedCount */
+	os_unfair_lock _queueLock;
+	/** Counters and histograms for -metrics, updated from any thread */
+	BDAtomicMetrics _metrics;
+	/** Guards categories */
+	os_unfair_lock _categoriesLock;
+	/** How many maintenance ticks in a row have been put off because entries were waiting to be written */
+	atomic_uint _maintenanceDeferrals;
+	/** Set while a maintenance pass is waiting on the dispatchQueue, so that a slow one doesn't pile up more */
+	atomic_flag _maintenanceScheduled;
+	/** With sharedStore, the flock()ed files saying this process is alive, and that it is the one merging. -1 when not held. */
+	int _producerLockFD;
+	int _writerLockFD;
+	/** Set while a staging tick is waiting on the dispatchQueue */
+	atomic_flag _stagingTickScheduled;
+	/**
+	 * The recent entry cache, most recent last for each severity, up to _recentCapacity of each.  Entries written
+	 * from ring records are cached as the raw records, and deferred messages aren't rendered, until the cache is
+	 * read.  Guarded by _recentLock.
+	 */
+	os_unfair_lock _recentLock;
+	NSMutableArray *_recentEntries[BDSeverityDebug + 1];
+	BDRecentRecords _recentRecords[BDSeverityDebug + 1];
+	NSUInteger _recentCapacity;
+	/** The rate limiting properties, converted for BDLoggerAdmitCallSite(). An interval of 0 means no rate limit. */
+	int64_t _callSiteInterval;
+	int64_t _callSiteTolerance;
+	uint32_t _callSiteSampleThreshold;
+	/** Every call site that has ever had an entry turned away, linked through their next pointers */
+	_Atomic(BDCallSite *) _suppressedSites;
+	atomic_flag _suppressionSummaryScheduled;
+	/** Identifies this logger as the owner of a BDCallSite. Unique for the life of the process, unlike the logger's address. */
+	uint64_t _callSiteOwner;
+	/** The call sites this logger keeps for itself: those owned by another logger, and format strings (see BDLoggerCallSiteSlot) */
+	BDCallSiteSlot *_callSiteSlots;
+	atomic_uint _callSiteFormatSlots;
+	/** The mapped flight recorder, or NULL. Once mapped it stays mapped until dealloc, as any thread may be appending. */
+	_Atomic(BDFlightRecorderHeader *) _flightRecorder;
+	size_t _flightRecorderSize;
+	/** Guards _segments, which the writer replaces as segments are started and compacted, and readers merge into retrievals */
+	os_unfair_lock _segmentsLock;
+	NSArray *_segments;
+	/** Guards _partitions, which the writer replaces as partitions are created and dropped, and readers use to build queries */
+	os_unfair_lock _partitionsLock;
+	NSArray *_partitions;
+}
+
+/** The location of the log store */
+@property (nonatomic, strong) NSURL *logStoreURL;
+
+/** The underlying sqlite connection object */
+@property (nonatomic, assign) sqlite3 *connection;
+
+/** The pre-prepared insert statement to insert new records (into the current partition, when partitioning) */
+@property (nonatomic, assign) sqlite3_stmt *insertStatement;
+
+/** Inserts into the full text index of the partition that insertStatement inserts into. Prepared on first use. */
+@property (nonatomic, assign) sqlite3_stmt *ftsInsertStatement;
+
+/** Inserts into the userInfo field index of the partition that insertStatement inserts into. Prepared on first use. */
+@property (nonatomic, assign) sqlite3_stmt *fieldsInsertStatement;
+
+/** The channels that each logged entry is fanned out to. Only replaced (never mutated), on the dispatchQueue. */
+@property (nonatomic, strong) NSArray *sinkChannels;
+
+/** The tail observers. Only replaced (never mutated), on the dispatchQueue. */
+@property (nonatomic, strong) NSArray *tailObservers;
+/** Entries written in the current transaction, which are only handed to tail observers once it commits. Only used on the dispatchQueue. */
+@property (nonatomic, strong) NSMutableArray *uncommittedTailEntries;
+/** The same as uncommittedTailEntries, for ring records only going into the recent entry cache: BDRingRecords back to back */
+@property (nonatomic, strong) NSMutableData *uncommittedRecentRecords;
+/** Entries waiting to be handed to the tail observers, and whether that has been scheduled. Only used on the dispatchQueue. */
+@property (nonatomic, strong) NSMutableArray *pendingTailEntries;
+@property (nonatomic, assign) BOOL tailDeliveryScheduled;
+
+/** The number to give the next segment that is started */
+@property (nonatomic, assign) sqlite3_int64 nextSegmentNumber;
+
+/** Set while a segment compaction is waiting to run on the dispatchQueue */
+@property (nonatomic, assign) BOOL compactionScheduled;
+
+/** Template ids keyed by format string, as known to the writer. Only used on the dispatchQueue. */
+@property (nonatomic, strong) NSMutableDictionary *templateIDs;
+
+/** Format strings keyed by template id, as known to readers. Only used on the readQueue. */
+@property (nonatomic, strong) NSMutableDictionary *readTemplates;
+
+/** Set once LOG_ROLLUP exists, so that partitions created from then on get a rollup trigger. Only used on the dispatchQueue. */
+@property (nonatomic, assign) BOOL rollupPrepared;
+
+/** The most recently queued entry (and its message, unless it is deferred), for BDQueueOverflowCoalesce. Guarded by queueLock. */
+@property (nonatomic, strong) BDEntry *lastQueuedEntry;
+@property (nonatomic, copy) NSString *lastQueuedMessage;
+
+/** Scratch space for compression_encode_buffer(), so the writer doesn't allocate it for every entry */
+@property (nonatomic, strong) NSMutableData *compressionScratch;
+
+/** The sink that shouldNSLog adds and removes */
+@property (nonatomic, strong) BDConsoleLogSink *consoleSink;
+
+/** The suffix of the partition that insertStatement inserts into */
+@property (nonatomic, strong) NSString *insertPartitionSuffix;
+
+/** Partitions created inside the current batch's transaction, which readers can't be told about until it commits */
+@property (nonatomic, strong) NSMutableArray *uncommittedPartitions;
+
+/** Set while -importArchiveFromURL:error: is inserting, so that partitions it creates leave their timestamp index until the end */
+@property (nonatomic, assign) BOOL deferTimestampIndexes;
+
+/** The GCD background queue that all logging inserts get executed on */
+@property (nonatomic, strong) dispatch_queue_t dispatchQueue;
+
+/** When was the log store was last checked to see if needed pruning.  Does not persist over instiations of this class. */
+@property (nonatomic, strong) NSDate *lastCheckForPruning;
+
+/** Set while a prune is working its way through the store a chunk at a time. Only accessed on the dispatchQueue. */
+@property (nonatomic, assign) BOOL pruneInProgress;
+/** Whether the store really is in auto_vacuum=INCREMENTAL mode, which incrementalVacuum can only ask for */
+@property (nonatomic, assign) BOOL incrementalVacuumAvailable;
+/** The free list's size before the last incremental vacuum step, so that vacuuming stops once it stops shrinking */
+@property (nonatomic, assign) NSInteger vacuumFreePages;
+/** Fires every maintenanceIntervalSecs while the log store is open */
+@property (nonatomic, strong) dispatch_source_t maintenanceTimer;
+/** When PRAGMA optimize last ran */
+@property (nonatomic, strong) NSDate *lastOptimize;
+/** With sharedStore, names this process's staging directory. A new one is made each time the store is opened. */
+@property (nonatomic, strong) NSString *producerID;
+/** With sharedStore, set while this process is the one merging staged entries into the log store. Only used on the dispatchQueue. */
+@property (nonatomic, assign) BOOL sharedWriter;
+/** Fires every sharedMergeIntervalSecs while a shared store is open */
+@property (nonatomic, strong) dispatch_source_t stagingTimer;
+/** When the busy handler started waiting for the current lock, from BDMetricsMicros(). Only used on the dispatchQueue. */
+@property (nonatomic, assign) uint64_t busyStartMicros;
+/** The categories handed out by -categoryNamed:, by name. Guarded by categoriesLock. */
+@property (nonatomic, strong) NSMutableDictionary *categories;
+/** When the prune in progress started, from BDMetricsMicros() */
+@property (nonatomic, assign) uint64_t pruneStartMicros;
+/** Entries inserted in the current transaction, which only count as written once it commits */
+@property (nonatomic, assign) NSUInteger uncommittedWrites;
+
+/** Entries older than this are being deleted by the prune in progress */
+@property (nonatomic, assign) NSTimeInterval pruneCutoffTime;
+
+/** How many entries the prune in progress has deleted so far */
+@property (nonatomic, assign) NSInteger prunedEntryCount;
+
+/** The partitions that the prune in progress still has to delete old entries from */
+@property (nonatomic, strong) NSMutableArray *prunePartitions;
+
+/** Entries waiting to be written as part of the next group commit. Only accessed on the dispatchQueue. */
+@property (nonatomic, strong) NSMutableArray *pendingEntries;
+
+/** Incremented every time a batch is flushed so that stale linger timers can tell they are no longer needed */
+@property (nonatomic, assign) NSUInteger batchGeneration;
+
+/** A read-only sqlite connection used for retrievals. Only accessed on the readQueue. */
+@property (nonatomic, assign) sqlite3 *readConnection;
+
+/** The GCD background queue that retrievals get executed on, so that they don't queue up behind pending inserts */
+@property (nonatomic, strong) dispatch_queue_t readQueue;
+
+/** Prepared retrieval statements on the readConnection, keyed by their SQL. Only accessed on the readQueue. */
+@property (nonatomic, strong) NSMutableDictionary *readStatements;
+
+/** The GCD background queue that write-ahead log checkpoints get executed on */
+@property (nonatomic, strong) dispatch_queue_t checkpointQueue;
+
+/** A separate sqlite connection used only for checkpointing. Only accessed on the checkpointQueue. */
+@property (nonatomic, assign) sqlite3 *checkpointConnection;
+
+-(void)scheduleCheckpoint;
+-(BOOL)admitFormat:(NSString *)messageFormat;
+-(void)log:(BDSeverity)severity message:(NSString *)message filterState:(uint32_t)filterState;
+-(void)log:(BDSeverity)severity format:(NSString *)messageFormat arguments:(va_list)arguments filterState:(uint32_t)filterState;
+-(void)log:(BDEntry *)entry filterState:(uint32_t)filterState;
+-(void)updateFilterState;
+-(NSString *)messageFromTemplatedBytes:(const void *)bytes length:(NSUInteger)length;
+-(int)waitForBusyStore:(int)attempts;
+-(BDThreadCounter *)claimThreadCounter;
+
+@end
+
+/** Invoked by sqlite after each commit in WAL mode. Kicks off a background checkpoint once the log has grown large enough. */
+static int BDLoggerWALHook(void *context, sqlite3 *connection, const char *databaseName, int pages) {
+	BDLogger *logger = (__bridge BDLogger *)context;
+	if (pages >= [logger.walAutocheckpointPages intValue])
+		[logger scheduleCheckpoint];
+	return SQLITE_OK;
+}
+
+/**
+ * Invoked by sqlite when another connection (with sharedStore, most likely another process) has the log store locked.
+ * Returning non-zero asks sqlite to try again.
+ */
+static int BDLoggerBusyHandler(void *context, int attempts) {
+	BDLogger *logger = (__bridge BDLogger *)context;
+	return [logger waitForBusyStore:attempts];
+}
+
+@implementation BDLogger
+
+/** Counts a filtered entry against the calling thread's own counter */
+static inline void BDLoggerCountFiltered(BDLogger *logger) {
+	BDThreadCounter *counter = pthread_getspecific(logger->_counterKey);
+	if (counter == NULL)
+		counter = [logger claimThreadCounter];
+	// nobody else writes to it, so it doesn't need an atomic read-modify-write, just a store that readers won't see torn
+	atomic_store_explicit(&counter->filtered, atomic_load_explicit(&counter->filtered, memory_order_relaxed) + 1, memory_order_relaxed);
+}
+
+-(id)initWithURL:(NSURL *)logStoreURL {
+	self = [super init];
+	if (self != nil) {
+		_logStoreURL = logStoreURL;
+		_connection = NULL;
+		_insertStatement = NULL;
+		_ftsInsertStatement = NULL;
+		_fieldsInsertStatement = NULL;
+		_fullTextIndexing = NO;
+		_rollupEnabled = NO;
+		_insertPartitionSuffix = @"";
+		_uncommittedPartitions = [NSMutableArray array];
+		_segmentsLock = OS_UNFAIR_LOCK_INIT;
+		_segments = @[];
+		_memoryMappedSegments = NO;
+		_segmentSizeBytes = @(4 * 1024 * 1024);
+		_nextSegmentNumber = 1;
+		_sharedStore = NO;
+		_sharedMergeIntervalSecs = @(1);
+		_busyTimeoutSecs = @(5);
+		_producerLockFD = -1;
+		_writerLockFD = -1;
+		atomic_flag_clear(&_stagingTickScheduled);
+		_compactionScheduled = NO;
+		_partitionsLock = OS_UNFAIR_LOCK_INIT;
+		_partitions = @[ [BDPartition legacyPartition] ];
+		_partitioning = BDLoggerPartitioningNone;
+		_dispatchQueue = dispatch_queue_create("com.blackdog.bdlogger.queue", DISPATCH_QUEUE_SERIAL);
+		dispatch_queue_set_specific(_dispatchQueue, &BDDispatchQueueKey, (__bridge void *)self, NULL);
+		_maxQueuedEntries = nil;
+		_queueOverflowPolicy = BDQueueOverflowDropLowest;
+		atomic_init(&_queueDepth, 0);
+		for (NSUInteger i = 0; i <= BDSeverityDebug; i++) {
+			_queuedEntries[i] = [NSMutableArray array];
+		}
+		_queueSequence = 0;
+		atomic_flag_clear(&_queueDrainScheduled);
+		atomic_init(&_queueHighWaterMark, 0);
+		atomic_init(&_queueDropped, 0);
+		atomic_init(&_queueDroppedUnreported, 0);
+		atomic_flag_clear(&_queueDropWarningScheduled);
+		atomic_init(&_queueWaiters, 0);
+		_queueSpace = dispatch_semaphore_create(0);
+		_queueLock = OS_UNFAIR_LOCK_INIT;
+		_lastCheckForPruning = [NSDate dateWithTimeIntervalSince1970:0];
+		_filterSeverity = BDSeverityWarning;
+		_filterState = BDFilterStatePack(BDSeverityWarning, BD_FILTER_NONE);
+		_categoriesLock = OS_UNFAIR_LOCK_INIT;
+		_categories = [NSMutableDictionary dictionary];
+		_maintenanceIntervalSecs = @(60);
+		_optimizeFrequencySecs = @(86400);
+		_lastOptimize = [NSDate date];
+		atomic_init(&_maintenanceDeferrals, 0);
+		atomic_flag_clear(&_maintenanceScheduled);
+		_pruneLimitDays = @(7);
+		_pruneFrequencySecs = @(3600);
+		_pruneChunkSize = @(1000);
+		_pruneInProgress = NO;
+		_incrementalVacuum = NO;
+		_incrementalVacuumAvailable = NO;
+		_vacuumChunkPages = @(256);
+		_groupCommit = NO;
+		_batchMaxEntries = @(500);
+		_batchLingerSecs = @(0.25);
+		_pendingEntries = [NSMutableArray array];
+		_batchGeneration = 0;
+		_readConnection = NULL;
+		_readQueue = dispatch_queue_create("com.blackdog.bdlogger.read", DISPATCH_QUEUE_SERIAL);
+		_readStatements = [NSMutableDictionary dictionary];
+		_retrievalStatsLock = OS_UNFAIR_LOCK_INIT;
+		_retrievalStats = (BDRetrievalStats){ 0 };
+		_checkpointQueue = dispatch_queue_create("com.blackdog.bdlogger.checkpoint", DISPATCH_QUEUE_SERIAL);
+		_checkpointConnection = NULL;
+		atomic_flag_clear(&_checkpointScheduled);
+		pthread_key_create(&_ringKey, BDRingThreadExited);
+		pthread_key_create(&_counterKey, BDThreadCounterReleased);
+		atomic_init(&_rings, NULL);
+		atomic_flag_clear(&_ringDrainScheduled);
+		atomic_init(&_ringDropped, 0);
+		atomic_init(&_flightRecorder, NULL);
+		_flightRecorderSize = 0;
+		_flightRecorderEnabled = NO;
+		_flightRecorderSeverity = BDSeverityDebug;
+		_flightRecorderCapacity = @(1024);
+		_compression = NO;
+		_compressionMinimumBytes = @(128);
+		_compressionScratch = nil;
+		_templateInterning = NO;
+		_callSiteRateLimit = nil;
+		_callSiteBurst = @(10);
+		_callSiteSampleRate = nil;
+		_callSiteSummarySecs = @(60);
+		_callSiteInterval = 0;
+		_callSiteTolerance = 0;
+		_callSiteSampleThreshold = UINT32_MAX;
+		atomic_init(&_suppressedSites, NULL);
+		atomic_flag_clear(&_suppressionSummaryScheduled);
+		static _Atomic uint64_t lastCallSiteOwner = 0;
+		_callSiteOwner = atomic_fetch_add(&lastCallSiteOwner, 1) + 1;
+		_callSiteSlots = calloc(BD_CALL_SITE_SLOTS, sizeof(BDCallSiteSlot));
+		_templateIDs = [NSMutableDictionary dictionary];
+		_readTemplates = [NSMutableDictionary dictionary];
+		_ringBufferEnabled = NO;
+		_deferredFormatting = NO;
+		_userInfoCodec = [[BDCompactUserInfoCodec alloc] init];
+		_ringBufferCapacity = @(256);
+		_ringBufferOverflowPolicy = BDRingBufferOverflowSpill;
+		_durability = BDLoggerDurabilityStrict;
+		_walAutocheckpointPages = @(1000);
+		_backgroundCheckpoint = YES;
+#if TARGET_IPHONE_SIMULATOR
+		_shouldNSLog = YES;
+#else
+		_shouldNSLog = NO;
+#endif
+		_consoleSink = [[BDConsoleLogSink alloc] init];
+		_tailObservers = @[];
+		_uncommittedTailEntries = [NSMutableArray array];
+		_uncommittedRecentRecords = [NSMutableData data];
+		_pendingTailEntries = [NSMutableArray array];
+		_tailDeliveryScheduled = NO;
+		_recentLock = OS_UNFAIR_LOCK_INIT;
+		_recentCapacity = 0;
+		_recentEntryCacheSize = nil;
+		_sinkChannels = _shouldNSLog ? @[ [[BDSinkChannel alloc] initWithSink:_consoleSink bufferLimit:10000 batchMaxEntries:100 batchLingerSecs:0] ] : @[];
+	}
+	return self;
+}
+
+#
+#pragma mark - Setup and teardown
+#
+-(BOOL)open:(NSError **)error {
+	__block BOOL success = YES;
+	dispatch_sync(self.dispatchQueue, ^(void) {
+		sqlite3 *connection;
+		
+		NSUInteger rc = sqlite3_open([[self.logStoreURL absoluteString] UTF8String], &connection);
+		if (rc != SQLITE_OK) {
+			if (error != NULL) {
+				NSString *message = [NSString stringWithFormat:@"Unable to open connection to %@ (rc=%d): %s", [self.logStoreURL absoluteString], rc, sqlite3_errmsg(connection)];
+				*error = [NSError errorWithDomain:BD_ERROR_DOMAIN code:rc userInfo:@{ NSLocalizedDescriptionKey : message }];
+				success = NO;
+				return;
+			}
+		}
+		self.connection = connection;
+		if (self.sharedStore)
+			sqlite3_busy_handler(connection, BDLoggerBusyHandler, (__bridge void *)self);
+
+		// this only takes effect for a brand new store, and only before anything (including switching to a WAL) has
+		// written the database header; an existing one keeps whatever auto_vacuum mode it was created with
+		if (self.incrementalVacuum) {
+			sqlite3_exec(self.connection, "PRAGMA auto_vacuum=INCREMENTAL", NULL, NULL, NULL);
+		}
+
+		if (![self applyDurability:error]) {
+			success = NO;
+			return;
+		}
+
+		if (![self createEntriesTableForPartition:[BDPartition legacyPartition] error:error]) {
+			success = NO;
+			return;
+		}
+
+		// PRAGMA incremental_vacuum does nothing at all in any other mode
+		self.incrementalVacuumAvailable = self.incrementalVacuum && [self integerForPragma:"PRAGMA auto_vacuum"] == 2;
+
+		if (![self loadPartitions:error]) {
+			success = NO;
+			return;
+		}
+
+		// field tables made before they had an index on Z_ENTRY get one now, or every prune would scan them
+		for (BDPartition *partition in [self partitions]) {
+			if ([partition.companions containsObject:@"LOG_FIELDS"] && ![self createFieldEntryIndexForPartition:partition error:error]) {
+				success = NO;
+				return;
+			}
+		}
+
+		if (self.templateInterning && ![self prepareTemplates:error]) {
+			success = NO;
+			return;
+		}
+
+		if (![self prepareRollup:error]) {
+			success = NO;
+			return;
+		}
+
+		sqlite3_stmt *insertStatement;
+		NSString *sql = [self insertSQLForPartition:[BDPartition legacyPartition]];
+		rc = sqlite3_prepare_v2(self.connection, [sql UTF8String], (int)[sql length], &insertStatement, NULL);
+		if (rc != SQLITE_OK) {
+			if (error != NULL) {
+				NSString *message = [NSString stringWithFormat:@"Unable to prepare insert statement (rc=%d): %s", rc, sqlite3_errmsg(self.connection)];
+				*error = [NSError errorWithDomain:BD_ERROR_DOMAIN code:rc userInfo:@{ NSLocalizedDescriptionKey : message }];
+				success = NO;
+				return;
+			}
+		}
+		self.insertStatement = insertStatement;
+
+		if (self.sharedStore) {
+			if (![self openStaging:error]) {
+				success = NO;
+				return;
+			}
+		}
+		else if (self.memoryMappedSegments && ![self openSegments:error]) {
+			success = NO;
+			return;
+		}
+
+		// every process would be writing over the one flight recorder file
+		if (self.flightRecorderEnabled && !self.sharedStore && ![self openFlightRecorder:error]) {
+			success = NO;
+			return;
+		}
+
+		os_unfair_lock_lock(&self->_recentLock);
+		self->_recentCapacity = self.sharedStore ? 0 : [self.recentEntryCacheSize unsignedIntegerValue];
+		for (NSUInteger i = 0; i <= BDSeverityDebug; i++) {
+			self->_recentEntries[i] = self->_recentCapacity == 0 ? nil : [NSMutableArray arrayWithCapacity:self->_recentCapacity];
+			// the capacity may have changed since the last open
+			free(self->_recentRecords[i].records);
+			self->_recentRecords[i] = (BDRecentRecords){ NULL, 0, 0 };
+		}
+		os_unfair_lock_unlock(&self->_recentLock);
+	});
+	if (!success)
+		return NO;
+
+	// the read connection can only be opened once the writer has made sure the table exists
+	dispatch_sync(self.readQueue, ^(void) {
+		sqlite3 *connection;
+		NSUInteger rc = sqlite3_open_v2([[self.logStoreURL absoluteString] UTF8String], &connection, SQLITE_OPEN_READONLY, NULL);
+		if (rc != SQLITE_OK) {
+			if (error != NULL) {
+				NSString *message = [NSString stringWithFormat:@"Unable to open read connection to %@ (rc=%d): %s", [self.logStoreURL absoluteString], rc, sqlite3_errmsg(connection)];
+				*error = [NSError errorWithDomain:BD_ERROR_DOMAIN code:rc userInfo:@{ NSLocalizedDescriptionKey : message }];
+			}
+			sqlite3_close(connection);
+			success = NO;
+			return;
+		}
+		// with a rollback journal, readers still have to wait for a commit to finish
+		sqlite3_busy_timeout(connection, 5000);
+		self.readConnection = connection;
+	});
+	if (!success) {
+		// the writer is completely open by now, so undo all of it rather than leave the write connection behind
+		[self close:NULL];
+		return NO;
+	}
+
+	[self startMaintenanceTimer];
+	if (self.sharedStore)
+		[self startStagingTimer];
+	return YES;
+}
+
+/** Creates the entries table (and its timestamp index) for a partition if it doesn't already exist. Must be called on the dispatchQueue. */
+-(BOOL)createEntriesTableForPartition:(BDPartition *)partition error:(NSError **)error {
+	NSString *tableName = [partition tableNamed:@"LOG_ENTRIES"];
+	NSString *createTableSQL = [NSString stringWithFormat:@"CREATE TABLE IF NOT EXISTS %@ (Z_TIMESTAMP REAL, Z_SEVERITY INTEGER, Z_MESSAGE TEXT, Z_USERINFO BLOB)", tableName];
+	NSUInteger rc = sqlite3_exec(self.connection, [createTableSQL UTF8String], NULL, NULL, NULL);
+	if (rc != SQLITE_OK) {
+		if (error != NULL) {
+			NSString *message = [NSString stringWithFormat:@"Unable to create %@ table (rc=%d): %s", tableName, rc, sqlite3_errmsg(self.connection)];
+			*error = [NSError errorWithDomain:BD_ERROR_DOMAIN code:rc userInfo:@{ NSLocalizedDescriptionKey : message }];
+		}
+		return NO;
+	}
+
+	if (!self.deferTimestampIndexes && ![self createTimestampIndexForPartition:partition error:error])
+		return NO;
+
+	if (self.templateInterning && ![self addTemplateColumnToPartition:partition error:error])
+		return NO;
+
+	if (self.rollupPrepared && ![self addRollupTriggerToPartition:partition error:error])
+		return NO;
+
+	if (self.fullTextIndexing) {
+		// searches only need the rowids and ranks, as the entries themselves are joined in from LOG_ENTRIES, so the
+		// index doesn't keep a second copy of every message.  Deleting from a contentless index needs sqlite 3.43,
+		// so older versions fall back to an index that stores its own copy.
+		NSString *ftsName = [partition tableNamed:@"LOG_FTS"];
+		NSString *createFTSSQL = [NSString stringWithFormat:@"CREATE VIRTUAL TABLE IF NOT EXISTS %@ USING fts5(Z_MESSAGE, content='', contentless_delete=1)", ftsName];
+		rc = sqlite3_exec(self.connection, [createFTSSQL UTF8String], NULL, NULL, NULL);
+		if (rc != SQLITE_OK) {
+			createFTSSQL = [NSString stringWithFormat:@"CREATE VIRTUAL TABLE IF NOT EXISTS %@ USING fts5(Z_MESSAGE)", ftsName];
+			rc = sqlite3_exec(self.connection, [createFTSSQL UTF8String], NULL, NULL, NULL);
+		}
+		if (rc != SQLITE_OK) {
+			if (error != NULL) {
+				NSString *message = [NSString stringWithFormat:@"Unable to create %@ full text index (rc=%d): %s", ftsName, rc, sqlite3_errmsg(self.connection)];
+				*error = [NSError errorWithDomain:BD_ERROR_DOMAIN code:rc userInfo:@{ NSLocalizedDescriptionKey : message }];
+			}
+			return NO;
+		}
+	}
+
+	if ([self.indexedUserInfoKeys count] > 0) {
+		NSString *fieldsName = [partition tableNamed:@"LOG_FIELDS"];
+		NSString *createFieldsSQL = [NSString stringWithFormat:@"CREATE TABLE IF NOT EXISTS %@ (Z_KEY TEXT NOT NULL, Z_VALUE, Z_ENTRY INTEGER NOT NULL);"
+		                             "CREATE INDEX IF NOT EXISTS %@ ON %@ (Z_KEY, Z_VALUE, Z_ENTRY)", fieldsName, [partition tableNamed:@"LOG_FIELDS_I"], fieldsName];
+		rc = sqlite3_exec(self.connection, [createFieldsSQL UTF8String], NULL, NULL, NULL);
+		if (rc != SQLITE_OK) {
+			if (error != NULL) {
+				NSString *message = [NSString stringWithFormat:@"Unable to create %@ field index (rc=%d): %s", fieldsName, rc, sqlite3_errmsg(self.connection)];
+				*error = [NSError errorWithDomain:BD_ERROR_DOMAIN code:rc userInfo:@{ NSLocalizedDescriptionKey : message }];
+			}
+			return NO;
+		}
+		if (![self createFieldEntryIndexForPartition:partition error:error])
+			return NO;
+	}
+	return YES;
+}
+
+/**
+ * Creates the index that lets pruning find a chunk of entries' field rows by Z_ENTRY, rather than scanning the
+ * whole field table for every chunk.  Must be called on the dispatchQueue.
+ */
+-(BOOL)createFieldEntryIndexForPartition:(BDPartition *)partition error:(NSError **)error {
+	NSString *indexName = [partition tableNamed:@"LOG_FIELDS_E"];
+	NSString *createIndexSQL = [NSString stringWithFormat:@"CREATE INDEX IF NOT EXISTS %@ ON %@ (Z_ENTRY)", indexName, [partition tableNamed:@"LOG_FIELDS"]];
+	NSUInteger rc = sqlite3_exec(self.connection, [createIndexSQL UTF8String], NULL, NULL, NULL);
+	if (rc != SQLITE_OK) {
+		if (error != NULL) {
+			NSString *message = [NSString stringWithFormat:@"Unable to create %@ index (rc=%d): %s", indexName, rc, sqlite3_errmsg(self.connection)];
+			*error = [NSError errorWithDomain:BD_ERROR_DOMAIN code:rc userInfo:@{ NSLocalizedDescriptionKey : message }];
+		}
+		return NO;
+	}
+	return YES;
+}
+
+/** Creates the index that every retrieval uses, if it isn't already there. Must be called on the dispatchQueue. */
+-(BOOL)createTimestampIndexForPartition:(BDPartition *)partition error:(NSError **)error {
+	NSString *indexName = [partition tableNamed:@"LOG_TSTAMP_I"];
+	NSString *createIndexSQL = [NSString stringWithFormat:@"CREATE INDEX IF NOT EXISTS %@ ON %@ (Z_TIMESTAMP DESC, Z_SEVERITY DESC)", indexName, [partition tableNamed:@"LOG_ENTRIES"]];
+	NSUInteger rc = sqlite3_exec(self.connection, [createIndexSQL UTF8String], NULL, NULL, NULL);
+	if (rc != SQLITE_OK) {
+		if (error != NULL) {
+			NSString *message = [NSString stringWithFormat:@"Unable to create %@ index (rc=%d): %s", indexName, rc, sqlite3_errmsg(self.connection)];
+			*error = [NSError errorWithDomain:BD_ERROR_DOMAIN code:rc userInfo:@{ NSLocalizedDescriptionKey : message }];
+		}
+		return NO;
+	}
+	return YES;
+}
+
+-(NSString *)insertSQLForPartition:(BDPartition *)partition {
+	if (self.templateInterning)
+		return [NSString stringWithFormat:@"INSERT INTO %@ (Z_TIMESTAMP, Z_SEVERITY, Z_MESSAGE, Z_USERINFO, Z_TEMPLATE) VALUES (?, ?, ?, ?, ?)", [partition tableNamed:@"LOG_ENTRIES"]];
+	return [NSString stringWithFormat:@"INSERT INTO %@ (Z_TIMESTAMP, Z_SEVERITY, Z_MESSAGE, Z_USERINFO) VALUES (?, ?, ?, ?)", [partition tableNamed:@"LOG_ENTRIES"]];
+}
+
+/**
+ * Creates the templates table, and brings every existing partition up to date with a Z_TEMPLATE column (the
+ * templated message itself lives in Z_MESSAGE, so the column is only there to be indexed).  Must be called on the dispatchQueue.
+ */
+-(BOOL)prepareTemplates:(NSError **)error {
+	NSUInteger rc = sqlite3_exec(self.connection, "CREATE TABLE IF NOT EXISTS LOG_TEMPLATES (Z_ID INTEGER PRIMARY KEY, Z_FORMAT TEXT NOT NULL UNIQUE)", NULL, NULL, NULL);
+	if (rc != SQLITE_OK) {
+		if (error != NULL) {
+			NSString *message = [NSString stringWithFormat:@"Unable to create LOG_TEMPLATES table (rc=%d): %s", rc, sqlite3_errmsg(self.connection)];
+			*error = [NSError errorWithDomain:BD_ERROR_DOMAIN code:rc userInfo:@{ NSLocalizedDescriptionKey : message }];
+		}
+		return NO;
+	}
+	for (BDPartition *partition in [self partitions]) {
+		if (![self addTemplateColumnToPartition:partition error:error])
+			return NO;
+	}
+	return YES;
+}
+
+/**
+ * Creates the LOG_ROLLUP table and a trigger on every partition to keep it up to date, filling it from the existing
+ * entries if it is new.  If rollupEnabled is off, any rollup left by an earlier open is removed instead, as it
+ * would otherwise go stale.  With sharedStore, though, another process may still want it (and have triggers that
+ * insert into it), so it is kept, and kept up to date, just as if rollupEnabled were on.  Must be called on the
+ * dispatchQueue.
+ */
+-(BOOL)prepareRollup:(NSError **)error {
+	BOOL exists = [self tableExists:@"LOG_ROLLUP"];
+	BOOL wanted = self.rollupEnabled || (self.sharedStore && exists);
+	if (!wanted && !exists)
+		return YES;
+
+	NSMutableString *sql = nil;
+	if (!wanted) {
+		sql = [NSMutableString stringWithString:@"BEGIN;"];
+		for (BDPartition *partition in [self partitions]) {
+			[sql appendFormat:@"DROP TRIGGER IF EXISTS %@;", [partition tableNamed:@"LOG_ROLLUP_T"]];
+		}
+		[sql appendString:@"DROP TABLE LOG_ROLLUP;"];
+	}
+	else if (!exists) {
+		sql = [NSMutableString stringWithString:@"BEGIN;"];
+		[sql appendString:@"CREATE TABLE LOG_ROLLUP (Z_BUCKET INTEGER, Z_SEVERITY INTEGER, Z_COUNT INTEGER NOT NULL, Z_FIRST REAL NOT NULL, Z_LAST REAL NOT NULL, "
+		                   "PRIMARY KEY (Z_BUCKET, Z_SEVERITY)) WITHOUT ROWID;"];
+		// a legacy partition can hold the same minutes as a newer one, hence the upsert
+		for (BDPartition *partition in [self partitions]) {
+			[sql appendFormat:@"INSERT INTO LOG_ROLLUP (Z_BUCKET, Z_SEVERITY, Z_COUNT, Z_FIRST, Z_LAST) "
+			                  "SELECT CAST(Z_TIMESTAMP / 60 AS INTEGER), Z_SEVERITY, COUNT(*), MIN(Z_TIMESTAMP), MAX(Z_TIMESTAMP) FROM %@ WHERE 1 GROUP BY 1, 2 "
+			                  "ON CONFLICT (Z_BUCKET, Z_SEVERITY) DO UPDATE SET Z_COUNT = Z_COUNT + excluded.Z_COUNT, "
+			                  "Z_FIRST = MIN(Z_FIRST, excluded.Z_FIRST), Z_LAST = MAX(Z_LAST, excluded.Z_LAST);", [partition tableNamed:@"LOG_ENTRIES"]];
+		}
+	}
+	[sql appendString:@"COMMIT"];
+
+	NSUInteger rc = sql == nil ? SQLITE_OK : sqlite3_exec(self.connection, [sql UTF8String], NULL, NULL, NULL);
+	if (rc != SQLITE_OK) {
+		if (error != NULL) {
+			NSString *message = [NSString stringWithFormat:@"Unable to %@ LOG_ROLLUP table (rc=%d): %s", wanted ? @"create" : @"remove", rc, sqlite3_errmsg(self.connection)];
+			*error = [NSError errorWithDomain:BD_ERROR_DOMAIN code:rc userInfo:@{ NSLocalizedDescriptionKey : message }];
+		}
+		sqlite3_exec(self.connection, "ROLLBACK", NULL, NULL, NULL);
+		return NO;
+	}
+	if (!wanted)
+		return YES;
+
+	for (BDPartition *partition in [self partitions]) {
+		if (![self addRollupTriggerToPartition:partition error:error])
+			return NO;
+	}
+	self.rollupPrepared = YES;
+	return YES;
+}
+
+-(BOOL)addRollupTriggerToPartition:(BDPartition *)partition error:(NSError **)error {
+	NSString *triggerName = [partition tableNamed:@"LOG_ROLLUP_T"];
+	NSString *createTriggerSQL = [NSString stringWithFormat:@"CREATE TRIGGER IF NOT EXISTS %@ AFTER INSERT ON %@ BEGIN "
+	                              "INSERT INTO LOG_ROLLUP (Z_BUCKET, Z_SEVERITY, Z_COUNT, Z_FIRST, Z_LAST) VALUES (CAST(NEW.Z_TIMESTAMP / 60 AS INTEGER), NEW.Z_SEVERITY, 1, NEW.Z_TIMESTAMP, NEW.Z_TIMESTAMP) "
+	                              "ON CONFLICT (Z_BUCKET, Z_SEVERITY) DO UPDATE SET Z_COUNT = Z_COUNT + 1, Z_FIRST = MIN(Z_FIRST, excluded.Z_FIRST), Z_LAST = MAX(Z_LAST, excluded.Z_LAST); "
+	                              "END", triggerName, [partition tableNamed:@"LOG_ENTRIES"]];
+	NSUInteger rc = sqlite3_exec(self.connection, [createTriggerSQL UTF8String], NULL, NULL, NULL);
+	if (rc != SQLITE_OK) {
+		if (error != NULL) {
+			NSString *message = [NSString stringWithFormat:@"Unable to create %@ trigger (rc=%d): %s", triggerName, rc, sqlite3_errmsg(self.connection)];
+			*error = [NSError errorWithDomain:BD_ERROR_DOMAIN code:rc userInfo:@{ NSLocalizedDescriptionKey : message }];
+		}
+		return NO;
+	}
+	return YES;
+}
+
+-(BOOL)addTemplateColumnToPartition:(BDPartition *)partition error:(NSError **)error {
+	NSString *tableName = [partition tableNamed:@"LOG_ENTRIES"];
+	BOOL exists = NO;
+	sqlite3_stmt *statement;
+	NSString *sql = [NSString stringWithFormat:@"PRAGMA table_info(%@)", tableName];
+	if (sqlite3_prepare_v2(self.connection, [sql UTF8String], -1, &statement, NULL) == SQLITE_OK) {
+		while (!exists && sqlite3_step(statement) == SQLITE_ROW) {
+			exists = strcmp((const char *)sqlite3_column_text(statement, 1), "Z_TEMPLATE") == 0;
+		}
+		sqlite3_finalize(statement);
+	}
+
+	NSString *migrateSQL = [NSString stringWithFormat:@"%@CREATE INDEX IF NOT EXISTS %@ ON %@ (Z_TEMPLATE, Z_TIMESTAMP) WHERE Z_TEMPLATE IS NOT NULL",
+	                        exists ? @"" : [NSString stringWithFormat:@"ALTER TABLE %@ ADD COLUMN Z_TEMPLATE INTEGER;", tableName], [partition tableNamed:@"LOG_TEMPLATE_I"], tableName];
+	NSUInteger rc = sqlite3_exec(self.connection, [migrateSQL UTF8String], NULL, NULL, NULL);
+	if (rc != SQLITE_OK) {
+		if (error != NULL) {
+			NSString *message = [NSString stringWithFormat:@"Unable to add templates to %@ (rc=%d): %s", tableName, rc, sqlite3_errmsg(self.connection)];
+			*error = [NSError errorWithDomain:BD_ERROR_DOMAIN code:rc userInfo:@{ NSLocalizedDescriptionKey : message }];
+		}
+		return NO;
+	}
+	return YES;
+}
+
+/** Returns the id of a format string's template, adding it if it is new, or 0 on failure. Must be called on the dispatchQueue. */
+-(sqlite3_int64)templateIDForFormat:(NSString *)format {
+	NSNumber *templateID = self.templateIDs[format];
+	if (templateID != nil)
+		return [templateID longLongValue];
+
+	sqlite3_int64 result = 0;
+	sqlite3_stmt *statement;
+	if (sqlite3_prepare_v2(self.connection, "INSERT OR IGNORE INTO LOG_TEMPLATES (Z_FORMAT) VALUES (?)", -1, &statement, NULL) == SQLITE_OK) {
+		sqlite3_bind_text(statement, 1, [format UTF8String], -1, SQLITE_TRANSIENT);
+		sqlite3_step(statement);
+		sqlite3_finalize(statement);
+	}
+	if (sqlite3_prepare_v2(self.connection, "SELECT Z_ID FROM LOG_TEMPLATES WHERE Z_FORMAT = ?", -1, &statement, NULL) == SQLITE_OK) {
+		sqlite3_bind_text(statement, 1, [format UTF8String], -1, SQLITE_TRANSIENT);
+		if (sqlite3_step(statement) == SQLITE_ROW)
+			result = sqlite3_column_int64(statement, 0);
+		sqlite3_finalize(statement);
+	}
+	// a format string that is a one-off (eg. the caller built it with stringWithFormat:) would be cached forever
+	if (result != 0 && [self.templateIDs count] < 4096)
+		self.templateIDs[format] = @(result);
+	return result;
+}
+
+/** Works out which companion tables exist for a partition. Must be called on the dispatchQueue. */
+-(NSSet *)companionsForPartition:(BDPartition *)partition {
+	NSMutableSet *companions = [NSMutableSet set];
+	for (NSString *baseName in BDCompanionTables()) {
+		if ([self tableExists:[partition tableNamed:baseName]])
+			[companions addObject:baseName];
+	}
+	return companions;
+}
+
+-(BOOL)tableExists:(NSString *)tableName {
+	BOOL exists = NO;
+	sqlite3_stmt *statement;
+	if (sqlite3_prepare_v2(self.connection, "SELECT 1 FROM sqlite_master WHERE type = 'table' AND name = ?", -1, &statement, NULL) == SQLITE_OK) {
+		sqlite3_bind_text(statement, 1, [tableName UTF8String], -1, SQLITE_TRANSIENT);
+		exists = sqlite3_step(statement) == SQLITE_ROW;
+		sqlite3_finalize(statement);
+	}
+	return exists;
+}
+
+/**
+ * Finds every partition table already in the store.  Existing partitions are always read from (and pruned),
+ * whatever the partitioning property is currently set to; the property only decides where new entries go.
+ */
+-(BOOL)loadPartitions:(NSError **)error {
+	NSMutableArray *partitions = [NSMutableArray arrayWithObject:[BDPartition legacyPartition]];
+	sqlite3_stmt *statement;
+	NSUInteger rc = sqlite3_prepare_v2(self.connection, "SELECT name FROM sqlite_master WHERE type = 'table' AND name GLOB 'LOG_ENTRIES_[DH]*'", -1, &statement, NULL);
+	if (rc != SQLITE_OK) {
+		if (error != NULL) {
+			NSString *message = [NSString stringWithFormat:@"Unable to list partitions (rc=%d): %s", rc, sqlite3_errmsg(self.connection)];
+			*error = [NSError errorWithDomain:BD_ERROR_DOMAIN code:rc userInfo:@{ NSLocalizedDescriptionKey : message }];
+		}
+		return NO;
+	}
+	while (sqlite3_step(statement) == SQLITE_ROW) {
+		BDPartition *partition = [BDPartition partitionWithTableName:@((const char *)sqlite3_column_text(statement, 0))];
+		if (partition != nil)
+			[partitions addObject:partition];
+	}
+	sqlite3_finalize(statement);
+
+	for (NSUInteger i = 0; i < [partitions count]; i++) {
+		partitions[i] = [partitions[i] partitionWithCompanions:[self companionsForPartition:partitions[i]]];
+	}
+	[self setPartitions:partitions];
+	return YES;
+}
+
+/** Returns the current partitions, sorted by start time. Can be called from any queue. */
+-(NSArray *)partitions {
+	os_unfair_lock_lock(&_partitionsLock);
+	NSArray *partitions = _partitions;
+	os_unfair_lock_unlock(&_partitionsLock);
+	return partitions;
+}
+
+-(void)setPartitions:(NSArray *)partitions {
+	NSArray *sorted = [partitions sortedArrayUsingComparator:^NSComparisonResult(BDPartition *p1, BDPartition *p2) {
+		return p1.start < p2.start ? NSOrderedAscending : (p1.start > p2.start ? NSOrderedDescending : NSOrderedSame);
+	}];
+	os_unfair_lock_lock(&_partitionsLock);
+	_partitions = sorted;
+	os_unfair_lock_unlock(&_partitionsLock);
+}
+
+/**
+ * Maps the flight recorder file that sits alongside the log store.  If the process died last time, whatever the
+ * flight recorder caught that didn't make it into the log store is written there now.  Must be called on the dispatchQueue.
+ */
+-(BOOL)openFlightRecorder:(NSError **)error {
+	BDFlightRecorderHeader *recorder = atomic_load(&_flightRecorder);
+	if (recorder == NULL) {
+		NSString *path = [[self.logStoreURL path] stringByAppendingString:@"-flightrecorder"];
+		uint32_t capacity = (uint32_t)MAX([self.flightRecorderCapacity unsignedIntegerValue], 1);
+		size_t size = sizeof(BDFlightRecorderHeader) + capacity * sizeof(BDFlightRecord);
+		int fd = open([path fileSystemRepresentation], O_RDWR | O_CREAT, 0644);
+		struct stat info;
+		BOOL reusable = fd >= 0 && fstat(fd, &info) == 0 && info.st_size == (off_t)size;
+		void *mapping = MAP_FAILED;
+		if (fd >= 0 && (reusable || ftruncate(fd, 0) == 0) && (reusable || ftruncate(fd, size) == 0))
+			mapping = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		int mapError = errno;
+		if (fd >= 0)
+			close(fd);
+		if (mapping == MAP_FAILED) {
+			if (error != NULL) {
+				NSString *message = [NSString stringWithFormat:@"Unable to map flight recorder %@ (errno=%d): %s", path, mapError, strerror(mapError)];
+				*error = [NSError errorWithDomain:BD_ERROR_DOMAIN code:mapError userInfo:@{ NSLocalizedDescriptionKey : message }];
+			}
+			return NO;
+		}
+		recorder = mapping;
+		// a file of a different size (or a brand new one) has just been zeroed, so there is nothing in it to recover
+		if (!reusable || recorder->magic != BD_FLIGHT_MAGIC || recorder->version != BD_FLIGHT_VERSION || recorder->capacity != capacity) {
+			memset(recorder, 0, size);
+			recorder->magic = BD_FLIGHT_MAGIC;
+			recorder->version = BD_FLIGHT_VERSION;
+			recorder->capacity = capacity;
+			atomic_store(&recorder->cleanShutdown, 1);
+		}
+		_flightRecorderSize = size;
+	}
+
+	if (!atomic_load(&recorder->cleanShutdown))
+		[self recoverFlightRecorder:recorder];
+	for (uint32_t i = 0; i < recorder->capacity; i++) {
+		atomic_store(&((BDFlightRecord *)(recorder + 1))[i].sequence, 0);
+	}
+	atomic_store(&recorder->next, 0);
+	atomic_store(&recorder->cleanShutdown, 0);
+	atomic_store(&recorder->crashed, 0);
+
+	atomic_store(&_flightRecorder, recorder);
+	atomic_store(&BDActiveFlightRecorder, recorder);
+	[self updateFilterState];
+	return YES;
+}
+
+/**
+ * Writes the records left behind by a process that died into the log store.  Records that were passed on to the
+ * log store are written if they're newer than anything already stored, as they were lost in the backlog.  Those
+ * that never were (because they were below filterSeverity) are only written if the process is known to have
+ * crashed (see BDLoggerRecordCrash()), rather than just been killed, which is how most apps end.  Must be called on
+ * the dispatchQueue.
+ */
+-(void)recoverFlightRecorder:(BDFlightRecorderHeader *)recorder {
+	NSTimeInterval latestStored = -DBL_MAX;
+	for (BDPartition *partition in [self partitions]) {
+		sqlite3_stmt *statement;
+		NSString *sql = [NSString stringWithFormat:@"SELECT MAX(Z_TIMESTAMP) FROM %@", [partition tableNamed:@"LOG_ENTRIES"]];
+		if (sqlite3_prepare_v2(self.connection, [sql UTF8String], -1, &statement, NULL) == SQLITE_OK) {
+			if (sqlite3_step(statement) == SQLITE_ROW && sqlite3_column_type(statement, 0) != SQLITE_NULL)
+				latestStored = MAX(latestStored, sqlite3_column_double(statement, 0));
+			sqlite3_finalize(statement);
+		}
+	}
+	__block NSTimeInterval latestSegment = latestStored;
+	for (BDSegment *segment in [self segments]) {
+		[segment enumerateRecordsBetweenStart:-DBL_MAX end:DBL_MAX severity:(BDSeverity)UINT32_MAX usingBlock:^(const BDSegmentRecord *record) {
+			latestSegment = MAX(latestSegment, record->timestamp);
+		}];
+	}
+	latestStored = latestSegment;
+
+	BOOL crashed = atomic_load(&recorder->crashed) != 0;
+	uint64_t next = atomic_load(&recorder->next);
+	uint64_t first = next > recorder->capacity ? next - recorder->capacity + 1 : 1;
+	NSUInteger recovered = 0;
+	BOOL useTransaction = [self beginBatch];
+	for (uint64_t sequence = first; sequence <= next; sequence++) {
+		BDFlightRecord copy;
+		BDFlightRecord *record = &copy;
+		if (!BDFlightRecorderRead(recorder, sequence, record))
+			continue;
+		if ((record->flags & BD_FLIGHT_QUEUED) ? record->timestamp <= latestStored : !crashed)
+			continue;
+		// the entries the logger writes itself count as submitted, so that the metrics still add up
+		BDMetricsCount(&_metrics.entriesAccepted, 1);
+		if ([self insertTimestamp:record->timestamp severity:record->severity messageBytes:record->message length:record->length userInfoData:nil userInfo:nil])
+			recovered++;
+	}
+	if (recovered > 0) {
+		NSString *message = [NSString stringWithFormat:@"Recovered %lu log entries from the flight recorder after %@", (unsigned long)recovered, crashed ? @"a crash" : @"an unclean shutdown"];
+		const char *messageBytes = [message UTF8String];
+		BDMetricsCount(&_metrics.entriesAccepted, 1);
+		[self insertTimestamp:[[NSDate date] timeIntervalSince1970] severity:BDSeverityWarning messageBytes:messageBytes length:(int)strlen(messageBytes) userInfoData:nil userInfo:nil];
+	}
+	if (useTransaction)
+		[self commitBatch];
+}
+
+/** The directory that segment files are kept in, alongside the log store. With sharedStore, this process's staging directory. */
+-(NSURL *)segmentsDirectoryURL {
+	if (self.sharedStore)
+		return [[self stagingDirectoryURL] URLByAppendingPathComponent:self.producerID isDirectory:YES];
+	return [NSURL fileURLWithPath:[[self.logStoreURL path] stringByAppendingString:@"-segments"]];
+}
+
+/**
+ * Maps any segments left over from last time (throwing away those that were already compacted), queues them up
+ * for compaction, and starts a fresh segment for new entries.  Must be called on the dispatchQueue.
+ */
+-(BOOL)openSegments:(NSError **)error {
+	// compacting a segment records its number here in the same transaction, so a crash can never import it twice
+	NSUInteger rc = sqlite3_exec(self.connection, "CREATE TABLE IF NOT EXISTS LOG_SEGMENTS (Z_SEGMENT INTEGER PRIMARY KEY)", NULL, NULL, NULL);
+	if (rc != SQLITE_OK) {
+		if (error != NULL) {
+			NSString *message = [NSString stringWithFormat:@"Unable to create LOG_SEGMENTS table (rc=%d): %s", rc, sqlite3_errmsg(self.connection)];
+			*error = [NSError errorWithDomain:BD_ERROR_DOMAIN code:rc userInfo:@{ NSLocalizedDescriptionKey : message }];
+		}
+		return NO;
+	}
+	sqlite3_int64 lastCompacted = 0;
+	sqlite3_stmt *statement;
+	if (sqlite3_prepare_v2(self.connection, "SELECT MAX(Z_SEGMENT) FROM LOG_SEGMENTS", -1, &statement, NULL) == SQLITE_OK) {
+		if (sqlite3_step(statement) == SQLITE_ROW)
+			lastCompacted = sqlite3_column_int64(statement, 0);
+		sqlite3_finalize(statement);
+	}
+	// segments are compacted in order, so only the most recent number is ever needed
+	sqlite3_exec(self.connection, "DELETE FROM LOG_SEGMENTS WHERE Z_SEGMENT < (SELECT MAX(Z_SEGMENT) FROM LOG_SEGMENTS)", NULL, NULL, NULL);
+
+	NSURL *directoryURL = [self segmentsDirectoryURL];
+	if (![[NSFileManager defaultManager] createDirectoryAtURL:directoryURL withIntermediateDirectories:YES attributes:nil error:error])
+		return NO;
+
+	NSMutableArray *segments = [NSMutableArray array];
+	sqlite3_int64 lastNumber = lastCompacted;
+	NSArray *names = [[[NSFileManager defaultManager] contentsOfDirectoryAtPath:[directoryURL path] error:NULL] sortedArrayUsingSelector:@selector(compare:)];
+	for (NSString *name in names) {
+		if (![[name pathExtension] isEqualToString:@"bdseg"])
+			continue;
+		NSURL *url = [directoryURL URLByAppendingPathComponent:name];
+		sqlite3_int64 number = [[name stringByDeletingPathExtension] longLongValue];
+		if (number <= lastCompacted) {
+			[[NSFileManager defaultManager] removeItemAtURL:url error:NULL];
+			continue;
+		}
+		BDSegment *segment = [[BDSegment alloc] initWithURL:url number:number size:[self.segmentSizeBytes unsignedIntegerValue] error:NULL];
+		if (segment == nil) {
+			NSLog(@"Discarding unreadable log segment %@", [url path]);
+			[[NSFileManager defaultManager] removeItemAtURL:url error:NULL];
+			continue;
+		}
+		[segments addObject:segment];
+		lastNumber = MAX(lastNumber, number);
+	}
+	self.nextSegmentNumber = lastNumber + 1;
+	[self setSegments:segments];
+
+	if (![self startSegment:error])
+		return NO;
+	[self scheduleCompaction];
+	return YES;
+}
+
+/** Starts a new segment, which all new entries then go into. Must be called on the dispatchQueue. */
+-(BOOL)startSegment:(NSError **)error {
+	// zero padded so that the directory listing sorts in segment order
+	NSString *name = [NSString stringWithFormat:@"%016lld.bdseg", self.nextSegmentNumber];
+	BDSegment *segment = [[BDSegment alloc] initWithURL:[[self segmentsDirectoryURL] URLByAppendingPathComponent:name] number:self.nextSegmentNumber size:[self.segmentSizeBytes unsignedIntegerValue] error:error];
+	if (segment == nil)
+		return NO;
+	self.nextSegmentNumber++;
+	[self setSegments:[[self segments] arrayByAddingObject:segment]];
+	return YES;
+}
+
+/** Returns the live segments, oldest first. The last one is the one being appended to. Can be called from any queue. */
+-(NSArray *)segments {
+	os_unfair_lock_lock(&_segmentsLock);
+	NSArray *segments = _segments;
+	os_unfair_lock_unlock(&_segmentsLock);
+	return segments;
+}
+
+-(void)setSegments:(NSArray *)segments {
+	os_unfair_lock_lock(&_segmentsLock);
+	_segments = segments;
+	os_unfair_lock_unlock(&_segmentsLock);
+}
+
+/** Sets the journal mode, sync level and checkpointing policy that correspond to the durability property */
+-(BOOL)applyDurability:(NSError **)error {
+	// rollback journals make readers and writers in different processes lock each other out
+	BOOL useWAL = self.durability != BDLoggerDurabilityStrict || self.sharedStore;
+	NSString *synchronous = self.durability == BDLoggerDurabilityStrict ? @"FULL" : (self.durability == BDLoggerDurabilityNormal ? @"NORMAL" : @"OFF");
+	NSMutableArray *pragmas = [NSMutableArray array];
+	[pragmas addObject:[NSString stringWithFormat:@"PRAGMA journal_mode=%@", useWAL ? @"WAL" : @"DELETE"]];
+	[pragmas addObject:[NSString stringWithFormat:@"PRAGMA synchronous=%@", synchronous]];
+	if (useWAL && !self.backgroundCheckpoint)
+		[pragmas addObject:[NSString stringWithFormat:@"PRAGMA wal_autocheckpoint=%d", [self.walAutocheckpointPages intValue]]];
+
+	for (NSString *pragma in pragmas) {
+		NSUInteger rc = sqlite3_exec(self.connection, [pragma UTF8String], NULL, NULL, NULL);
+		if (rc != SQLITE_OK) {
+			if (error != NULL) {
+				NSString *message = [NSString stringWithFormat:@"Unable to execute %@ (rc=%d): %s", pragma, rc, sqlite3_errmsg(self.connection)];
+				*error = [NSError errorWithDomain:BD_ERROR_DOMAIN code:rc userInfo:@{ NSLocalizedDescriptionKey : message }];
+			}
+			return NO;
+		}
+	}
+
+	// installing our own hook replaces sqlite's automatic checkpointing, so the writer never has to wait for one
+	if (useWAL && self.backgroundCheckpoint)
+		sqlite3_wal_hook(self.connection, BDLoggerWALHook, (__bridge void *)self);
+	return YES;
+}
+
+-(BOOL)close:(NSError **)error {
+	[self stopMaintenanceTimer];
+	[self stopStagingTimer];
+
+	__block BOOL success = YES;
+	dispatch_sync(self.readQueue, ^(void) {
+		for (NSValue *value in [self.readStatements allValues]) {
+			sqlite3_finalize([value pointerValue]);
+		}
+		[self.readStatements removeAllObjects];
+
+		if (self.readConnection != NULL) {
+			NSUInteger rc = sqlite3_close(self.readConnection);
+			if (rc != SQLITE_OK) {
+				if (error != NULL) {
+					NSString *message = [NSString stringWithFormat:@"Unable to close read connection (rc=%d): %s", rc, sqlite3_errmsg(self.readConnection)];
+					*error = [NSError errorWithDomain:BD_ERROR_DOMAIN code:rc userInfo:@{ NSLocalizedDescriptionKey : message }];
+				}
+				success = NO;
+				return;
+			}
+			self.readConnection = NULL;
+		}
+	});
+	if (!success)
+		return NO;
+
+	dispatch_sync(self.dispatchQueue, ^(void) {
+		// anything still lingering in the queue or a group commit batch needs to go out before we finalize
+		[self drainQueuedEntries];
+		[self flushPendingEntries];
+		[self closeCheckpointConnection];
+		if (self.sharedStore)
+			[self closeStaging];
+		[self forgetRecentEntriesBefore:DBL_MAX];
+		// anything still in a segment is compacted next time the store is opened
+		[self setSegments:@[]];
+		BDFlightRecorderHeader *recorder = atomic_load(&self->_flightRecorder);
+		if (recorder != NULL)
+			atomic_store(&recorder->cleanShutdown, 1);
+
+		sqlite3_finalize(self.ftsInsertStatement);
+		self.ftsInsertStatement = NULL;
+		sqlite3_finalize(self.fieldsInsertStatement);
+		self.fieldsInsertStatement = NULL;
+
+		if (self.insertStatement != NULL) {
+			NSUInteger rc = sqlite3_finalize(self.insertStatement);
+			if (rc != SQLITE_OK) {
+				if (error != NULL) {
+					NSString *message = [NSString stringWithFormat:@"Unable to finalize insert statement (rc=%d): %s", rc, sqlite3_errmsg(self.connection)];
+					*error = [NSError errorWithDomain:BD_ERROR_DOMAIN code:rc userInfo:@{ NSLocalizedDescriptionKey : message }];
+				}
+				success = NO;
+				return;
+			}
+			self.insertStatement = NULL;
+		}
+			
+		if (self.connection != NULL) {
+			NSUInteger rc = sqlite3_close(self.connection);
+			if (rc != SQLITE_OK) {
+				if (error != NULL) {
+					NSString *message = [NSString stringWithFormat:@"Unable to close connection (rc=%d): %s", rc, sqlite3_errmsg(self.connection)];
+					*error = [NSError errorWithDomain:BD_ERROR_DOMAIN code:rc userInfo:@{ NSLocalizedDescriptionKey : message }];
+				}
+				success = NO;
+				return;
+			}
+			self.connection = NULL;
+		}
+	});
+	return success;
+}
+
+#
+#pragma mark - Checkpointing
+#
+-(void)scheduleCheckpoint {
+	if (atomic_flag_test_and_set(&_checkpointScheduled))
+		return;
+
+	dispatch_async(self.checkpointQueue, ^(void) {
+		atomic_flag_clear(&self->_checkpointScheduled);
+
+		if (self.checkpointConnection == NULL) {
+			sqlite3 *connection;
+			NSUInteger rc = sqlite3_open([[self.logStoreURL absoluteString] UTF8String], &connection);
+			if (rc != SQLITE_OK) {
+				NSLog(@"Unable to open checkpoint connection to %@ (rc=%d): %s", [self.logStoreURL absoluteString], rc, sqlite3_errmsg(connection));
+				sqlite3_close(connection);
+				return;
+			}
+			self.checkpointConnection = connection;
+		}
+
+		// a passive checkpoint never blocks the writer; anything it can't copy back this time gets picked up next time
+		NSUInteger rc = sqlite3_wal_checkpoint_v2(self.checkpointConnection, NULL, SQLITE_CHECKPOINT_PASSIVE, NULL, NULL);
+		if (rc != SQLITE_OK && rc != SQLITE_BUSY) {
+			NSLog(@"Unable to checkpoint log store (rc=%d): %s", rc, sqlite3_errmsg(self.checkpointConnection));
+		}
+	});
+}
+
+-(void)closeCheckpointConnection {
+	dispatch_sync(self.checkpointQueue, ^(void) {
+		if (self.checkpointConnection != NULL) {
+			sqlite3_close(self.checkpointConnection);
+			self.checkpointConnection = NULL;
+		}
+	});
+}
+
+#
+#pragma mark - Logging entries
+#
+-(void)log:(BDSeverity)severity message:(NSString *)message {
+	[self log:severity message:message filterState:__atomic_load_n(&_filterState, __ATOMIC_RELAXED)];
+}
+
+-(void)log:(BDSeverity)severity messageWithFormat:(NSString *)messageFormat, ... {
+	uint32_t filterState = __atomic_load_n(&_filterState, __ATOMIC_RELAXED);
+	// no point proceeding further if neither the log store nor the flight recorder wants it
+	if (!BDFilterStateAdmits(filterState, severity)) {
+		BDLoggerCountFiltered(self);
+		return;
+	}
+	if (![self admitFormat:messageFormat])
+		return;
+
+	va_list args;
+	va_start(args, messageFormat);
+	[self log:severity format:messageFormat arguments:args filterState:filterState];
+	va_end(args);
+}
+
+-(void)log:(BDSeverity)severity callSite:(BDCallSite *)callSite messageWithFormat:(NSString *)messageFormat, ... {
+	// the BDLog macros have already checked both the severity and the call site
+	va_list args;
+	va_start(args, messageFormat);
+	[self log:severity format:messageFormat arguments:args filterState:__atomic_load_n(&_filterState, __ATOMIC_RELAXED)];
+	va_end(args);
+}
+
+-(void)log:(BDEntry *)entry {
+	[self log:entry filterState:__atomic_load_n(&_filterState, __ATOMIC_RELAXED)];
+}
+
+/**
+ * The log: methods proper, shared by the logger and its categories.  Each is passed the filter state that applies,
+ * loaded once by the caller, so that all of the decisions for an entry are made against the same settings.
+ */
+-(void)log:(BDSeverity)severity message:(NSString *)message filterState:(uint32_t)filterState {
+	// no point proceeding further if neither the log store nor the flight recorder wants it
+	if (!BDFilterStateAdmits(filterState, severity)) {
+		BDLoggerCountFiltered(self);
+		return;
+	}
+	BOOL logging = BDFilterStateStores(filterState, severity);
+	if (BDFilterStateRecords(filterState, severity))
+		[self recordInFlightRecorder:severity timestamp:CFAbsoluteTimeGetCurrent() + kCFAbsoluteTimeIntervalSince1970 message:message queued:logging];
+	if (!logging) {
+		BDLoggerCountFiltered(self);
+		return;
+	}
+
+	// if the ring buffer can take it, we don't need to allocate anything at all
+	if (self.ringBufferEnabled && [self submitToRingBuffer:severity message:message]) {
+		BDMetricsCount(&_metrics.entriesAccepted, 1);
+		return;
+	}
+	
+	BDEntry *entry = [[BDEntry alloc] init];
+	entry.message = message;
+	entry.severity = severity;
+	[self enqueueEntry:entry];
+}
+
+-(void)log:(BDSeverity)severity format:(NSString *)messageFormat arguments:(va_list)arguments filterState:(uint32_t)filterState {
+	if (!BDFilterStateAdmits(filterState, severity)) {
+		BDLoggerCountFiltered(self);
+		return;
+	}
+
+	// the flight recorder needs the message straight away, so formatting can only be deferred when it isn't interested
+	if (self.deferredFormatting && BDFilterStateStores(filterState, severity) && !BDFilterStateRecords(filterState, severity)) {
+		va_list args;
+		va_copy(args, arguments);
+		BDDeferredFormat *deferredFormat = [BDDeferredFormat captureFormat:messageFormat arguments:args];
+		va_end(args);
+		if (deferredFormat != nil) {
+			BDEntry *entry = [[BDEntry alloc] init];
+			entry.severity = severity;
+			entry.deferredFormat = deferredFormat;
+			[self enqueueEntry:entry];
+			return;
+		}
+	}
+
+	va_list args;
+	va_copy(args, arguments);
+	NSString *message = [[NSString alloc] initWithFormat:messageFormat arguments:args];
+	va_end(args);
+	[self log:severity message:message filterState:filterState];
+}
+
+-(void)log:(BDEntry *)entry filterState:(uint32_t)filterState {
+	// OK, so do we really even need to log this entry?
+	if (!BDFilterStateAdmits(filterState, entry.severity)) {
+		BDLoggerCountFiltered(self);
+		return;
+	}
+	BOOL logging = BDFilterStateStores(filterState, entry.severity);
+	if (BDFilterStateRecords(filterState, entry.severity))
+		[self recordInFlightRecorder:entry.severity timestamp:[entry.timestamp timeIntervalSince1970] message:entry.message queued:logging];
+	if (!logging) {
+		BDLoggerCountFiltered(self);
+		return;
+	}
+	[self enqueueEntry:entry];
+}
+
+/** Whether a call that didn't come through the BDLog macros gets past the rate limit for its format string */
+-(BOOL)admitFormat:(NSString *)messageFormat {
+	if (_callSiteInterval == 0 && _callSiteSampleThreshold == UINT32_MAX)
+		return YES;
+	// keyed by the text rather than the address, which a format built at run time doesn't keep from one call to the next
+	const void *key = (const void *)(((uintptr_t)[messageFormat hash] << 1) | 1);
+	BDCallSite *site = BDLoggerCallSiteSlot(self, key, NULL, messageFormat);
+	return site == NULL || BDLoggerAdmitCallSite(self, site);
+}
+
+#
+#pragma mark - Rate limiting
+#
+/**
+ * Decides whether a call site gets to log.  Sampling is decided first, then the rate limit, which is a GCRA (the
+ * single-variable form of a token bucket): the site's nextAllowed time moves on by one interval for every entry
+ * admitted, and an entry is only turned away if that time has run more than a burst ahead of now.
+ */
+BOOL BDLoggerAdmitCallSite(BDLogger *logger, BDCallSite *site) {
+	if (logger == nil || (logger->_callSiteInterval == 0 && logger->_callSiteSampleThreshold == UINT32_MAX))
+		return YES;
+
+	// the site's own state belongs to whichever logger got to it first; any other keeps a copy of its own
+	uint64_t owner = __atomic_load_n(&site->owner, __ATOMIC_RELAXED);
+	if (owner == 0 && __atomic_compare_exchange_n(&site->owner, &owner, logger->_callSiteOwner, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		owner = logger->_callSiteOwner;
+	if (owner != logger->_callSiteOwner) {
+		site = BDLoggerCallSiteSlot(logger, site, site, nil);
+		if (site == NULL)
+			return YES;
+	}
+
+	BOOL admitted = logger->_callSiteSampleThreshold == UINT32_MAX || arc4random() < logger->_callSiteSampleThreshold;
+	if (admitted && logger->_callSiteInterval != 0) {
+		int64_t interval = logger->_callSiteInterval;
+		int64_t tolerance = logger->_callSiteTolerance;
+		int64_t now = (int64_t)clock_gettime_nsec_np(CLOCK_UPTIME_RAW);
+		int64_t nextAllowed = __atomic_load_n(&site->nextAllowed, __ATOMIC_RELAXED);
+		for (;;) {
+			int64_t base = MAX(nextAllowed, now);
+			if (base - now > tolerance) {
+				admitted = NO;
+				break;
+			}
+			if (__atomic_compare_exchange_n(&site->nextAllowed, &nextAllowed, base + interval, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		}
+	}
+	if (!admitted)
+		[logger suppressedCallSite:site];
+	return admitted;
+}
+
+/** Counts an entry turned away from a call site, making sure it'll appear in the next summary */
+-(void)suppressedCallSite:(BDCallSite *)site {
+	BDLoggerCountFiltered(self);
+	__atomic_fetch_add(&site->suppressed, 1, __ATOMIC_RELAXED);
+	int32_t unregistered = 0;
+	if (__atomic_compare_exchange_n(&site->registered, &unregistered, 1, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+		// sites are never unregistered, so pushing onto the front is all that's needed
+		BDCallSite *head = atomic_load(&_suppressedSites);
+		do {
+			site->next = head;
+		} while (!atomic_compare_exchange_weak(&_suppressedSites, &head, site));
+	}
+
+	if (!atomic_flag_test_and_set(&_suppressionSummaryScheduled)) {
+		dispatch_time_t when = dispatch_time(DISPATCH_TIME_NOW, (int64_t)([self.callSiteSummarySecs doubleValue] * NSEC_PER_SEC));
+		dispatch_after(when, self.dispatchQueue, ^(void) {
+			atomic_flag_clear(&self->_suppressionSummaryScheduled);
+			[self writeSuppressionSummary];
+		});
+	}
+}
+
+/** Logs an entry for each call site that has had entries turned away since the last summary. Must be called on the dispatchQueue. */
+-(void)writeSuppressionSummary {
+	for (BDCallSite *site = atomic_load(&_suppressedSites); site != NULL; site = site->next) {
+		int64_t suppressed = __atomic_exchange_n(&site->suppressed, 0, __ATOMIC_RELAXED);
+		if (suppressed == 0)
+			continue;
+		BDEntry *entry = [[BDEntry alloc] init];
+		entry.severity = BDSeverityWarning;
+		if (site->line == 0)
+			entry.message = [NSString stringWithFormat:@"Suppressed %lld log entries with format \"%s\"", suppressed, site->file];
+		else
+			entry.message = [NSString stringWithFormat:@"Suppressed %lld log entries from %s:%u", suppressed, site->file, site->line];
+		entry.userInfo = @{ @"suppressed" : @(suppressed) };
+		[self log:entry];
+	}
+}
+
+/**
+ * Returns this logger's call site for the given key, claiming a free slot for it the first time it is seen: either
+ * a BDLog macro's site that belongs to another logger (copying its file and line), or a format string (whose text is
+ * copied in place of the file).  Lock free, and doesn't allocate except to copy a format string once.  Returns NULL
+ * if there's no room, or if another thread has claimed the slot but not yet filled it in, in which case the entry
+ * isn't limited.  Slots are never given back, so once a logger has seen BD_CALL_SITE_FORMAT_SLOTS different format
+ * strings, any others are never limited, and once the table is full the same goes for other loggers' macro sites.
+ */
+static BDCallSite *BDLoggerCallSiteSlot(BDLogger *logger, const void *key, const BDCallSite *macroSite, NSString *format) {
+	BDCallSiteSlot *slots = logger->_callSiteSlots;
+	uintptr_t hash = ((uintptr_t)key >> 1) * 0x9E3779B97F4A7C15ULL;
+	const char *text = macroSite == NULL ? [format UTF8String] : NULL;
+	for (NSUInteger probe = 0; probe < BD_CALL_SITE_PROBES; probe++) {
+		BDCallSiteSlot *slot = &slots[(hash + probe) & (BD_CALL_SITE_SLOTS - 1)];
+		const void *existing = atomic_load_explicit(&slot->key, memory_order_acquire);
+		if (existing == NULL) {
+			if (text != NULL && atomic_fetch_add(&logger->_callSiteFormatSlots, 1) >= BD_CALL_SITE_FORMAT_SLOTS) {
+				atomic_fetch_sub(&logger->_callSiteFormatSlots, 1);
+				return NULL;
+			}
+			if (atomic_compare_exchange_strong_explicit(&slot->key, &existing, key, memory_order_acq_rel, memory_order_acquire)) {
+				slot->site.file = macroSite != NULL ? macroSite->file : strdup(text);
+				slot->site.line = macroSite != NULL ? macroSite->line : 0;
+				slot->site.owner = logger->_callSiteOwner;
+				atomic_store_explicit(&slot->ready, true, memory_order_release);
+				return &slot->site;
+			}
+			if (text != NULL)
+				atomic_fetch_sub(&logger->_callSiteFormatSlots, 1);
+		}
+		if (existing == key) {
+			if (!atomic_load_explicit(&slot->ready, memory_order_acquire))
+				return NULL;
+			// a format string whose hash matches another's carries on looking
+			if (text == NULL || strcmp(slot->site.file, text) == 0)
+				return &slot->site;
+		}
+	}
+	return NULL;
+}
+
+-(void)setCallSiteRateLimit:(NSNumber *)callSiteRateLimit {
+	_callSiteRateLimit = callSiteRateLimit;
+	[self updateCallSiteLimits];
+}
+
+-(void)setCallSiteBurst:(NSNumber *)callSiteBurst {
+	_callSiteBurst = callSiteBurst;
+	[self updateCallSiteLimits];
+}
+
+-(void)setCallSiteSampleRate:(NSNumber *)callSiteSampleRate {
+	_callSiteSampleRate = callSiteSampleRate;
+	[self updateCallSiteLimits];
+}
+
+/** Converts the rate limiting properties into the form that BDLoggerAdmitCallSite() can check without a message send */
+-(void)updateCallSiteLimits {
+	double rate = [self.callSiteRateLimit doubleValue];
+	_callSiteInterval = rate > 0 ? (int64_t)(NSEC_PER_SEC / rate) : 0;
+	_callSiteTolerance = _callSiteInterval * MAX([self.callSiteBurst longLongValue] - 1, 0);
+	double sampleRate = self.callSiteSampleRate == nil ? 1.0 : [self.callSiteSampleRate doubleValue];
+	_callSiteSampleThreshold = sampleRate >= 1.0 ? UINT32_MAX : (uint32_t)(MAX(sampleRate, 0.0) * UINT32_MAX);
+}
+
+/** Copies an entry into the flight recorder, once the filter state has said that it wants it */
+-(void)recordInFlightRecorder:(BDSeverity)severity timestamp:(NSTimeInterval)timestamp message:(NSString *)message queued:(BOOL)queued {
+	BDFlightRecorderHeader *recorder = atomic_load_explicit(&_flightRecorder, memory_order_acquire);
+	if (recorder != NULL)
+		BDFlightRecorderAppend(recorder, timestamp, severity, message, queued);
+}
+
+/** Passes an entry that has already been filtered on to be written to the log store (and the sinks) */
+-(void)enqueueEntry:(BDEntry *)entry {
+	BDMetricsCount(&_metrics.entriesAccepted, 1);
+	// a bounded queue is held here rather than as blocks on the dispatchQueue, so that making room really frees the entry
+	if ([self.maxQueuedEntries unsignedLongValue] > 0) {
+		if ([self admitToBoundedQueue:entry])
+			[self scheduleQueueDrain];
+		return;
+	}
+
+	[self countOntoQueue];
+	dispatch_async(self.dispatchQueue, ^(void) {
+		[self countOffQueue];
+		[self writeQueuedEntry:entry];
+	});
+}
+
+/** Renders an entry if need be, and passes it on to the sinks and the log store. Must be called on the dispatchQueue. */
+-(void)writeQueuedEntry:(BDEntry *)entry {
+	// a message that is going to be stored as a template only needs rendering if something else wants the text
+	if (!self.templateInterning || [self.sinkChannels count] > 0 || self.fullTextIndexing || [[self segments] count] > 0)
+		[entry renderDeferredMessage];
+	for (BDSinkChannel *channel in self.sinkChannels) {
+		[channel submitEntry:entry];
+	}
+
+	if (!self.groupCommit) {
+		[self writeEntries:@[ entry ]];
+		return;
+	}
+
+	[self.pendingEntries addObject:entry];
+	if ([self.pendingEntries count] >= [self.batchMaxEntries unsignedIntegerValue]) {
+		[self flushPendingEntries];
+	}
+	else if ([self.pendingEntries count] == 1) {
+		// first entry of a new batch, so make sure it doesn't linger for longer than we've been asked
+		NSUInteger generation = self.batchGeneration;
+		dispatch_time_t when = dispatch_time(DISPATCH_TIME_NOW, (int64_t)([self.batchLingerSecs doubleValue] * NSEC_PER_SEC));
+		dispatch_after(when, self.dispatchQueue, ^(void) {
+			if (self.batchGeneration == generation)
+				[self flushPendingEntries];
+		});
+	}
+}
+
+#
+#pragma mark - Queue depth
+#
+-(void)countOntoQueue {
+	unsigned long depth = atomic_fetch_add_explicit(&_queueDepth, 1, memory_order_relaxed) + 1;
+	unsigned long highWaterMark = atomic_load_explicit(&_queueHighWaterMark, memory_order_relaxed);
+	while (depth > highWaterMark && !atomic_compare_exchange_weak(&_queueHighWaterMark, &highWaterMark, depth))
+		;
+}
+
+-(void)countOffQueue {
+	atomic_fetch_sub_explicit(&_queueDepth, 1, memory_order_relaxed);
+	if (atomic_load_explicit(&_queueWaiters, memory_order_relaxed) > 0)
+		dispatch_semaphore_signal(_queueSpace);
+}
+
+/**
+ * Adds an entry to the bounded queue, first making room for it if maxQueuedEntries has been reached.  Returns NO
+ * if the entry has been dropped or folded into an earlier one.
+ */
+-(BOOL)admitToBoundedQueue:(BDEntry *)entry {
+	NSUInteger slot = MIN(entry.severity, BDSeverityDebug);
+	unsigned long limit = [self.maxQueuedEntries unsignedLongValue];
+	BDQueueOverflowPolicy policy = self.queueOverflowPolicy;
+	// the writer logs entries of its own, and must never wait on itself
+	BOOL onWriter = dispatch_get_specific(&BDDispatchQueueKey) == (__bridge void *)self;
+	if (policy == BDQueueOverflowBlock && !onWriter)
+		[self waitForQueueBelow:limit];
+
+	BDEntry *evicted = nil;
+	os_unfair_lock_lock(&_queueLock);
+	if (!onWriter && atomic_load_explicit(&_queueDepth, memory_order_relaxed) >= limit) {
+		switch (policy) {
+			case BDQueueOverflowDropLowest:
+				evicted = [self evictQueuedEntryBelowSeverity:slot];
+				if (evicted == nil) {
+					os_unfair_lock_unlock(&_queueLock);
+					[self droppedQueuedEntry];
+					return NO;
+				}
+				break;
+			case BDQueueOverflowCoalesce: {
+				BOOL coalesced = [self coalesceQueuedEntry:entry];
+				os_unfair_lock_unlock(&_queueLock);
+				if (!coalesced)
+					[self droppedQueuedEntry];
+				return NO;
+			}
+			case BDQueueOverflowBlock:
+				// someone else got in while we were waiting; going over by one beats waiting again
+				break;
+		}
+	}
+
+	entry.queueSequence = ++_queueSequence;
+	[_queuedEntries[slot] addObject:entry];
+	self.lastQueuedEntry = entry;
+	self.lastQueuedMessage = entry.deferredFormat == nil ? entry.message : nil;
+	[self countOntoQueue];
+	os_unfair_lock_unlock(&_queueLock);
+
+	// the evicted entry is only released once we're out of the lock
+	if (evicted != nil)
+		[self droppedQueuedEntry];
+	return YES;
+}
+
+/**
+ * Takes the oldest of the queued entries less severe than the given one out of the bounded queue, and returns it.
+ * Returns nil if there are none (so the new entry should go instead).  Must be called with queueLock held.
+ */
+-(BDEntry *)evictQueuedEntryBelowSeverity:(NSUInteger)severity {
+	for (NSUInteger slot = BDSeverityDebug; slot > severity; slot--) {
+		if ([_queuedEntries[slot] count] == 0)
+			continue;
+		BDEntry *evicted = _queuedEntries[slot][0];
+		[_queuedEntries[slot] removeObjectAtIndex:0];
+		if (self.lastQueuedEntry == evicted)
+			self.lastQueuedEntry = nil;
+		[self countOffQueue];
+		return evicted;
+	}
+	return nil;
+}
+
+/**
+ * Folds an entry into the most recently queued one if they're the same: either the same message, or (without
+ * formatting either of them) the same format and arguments.  Returns NO if they aren't.  Must be called with
+ * queueLock held.
+ */
+-(BOOL)coalesceQueuedEntry:(BDEntry *)entry {
+	BDEntry *lastEntry = self.lastQueuedEntry;
+	if (lastEntry == nil || lastEntry.severity != entry.severity)
+		return NO;
+
+	BOOL coalesced;
+	if (entry.deferredFormat != nil || lastEntry.deferredFormat != nil)
+		coalesced = entry.deferredFormat != nil && lastEntry.deferredFormat != nil && [entry.deferredFormat isEqualToDeferredFormat:lastEntry.deferredFormat];
+	else
+		coalesced = [self.lastQueuedMessage isEqualToString:entry.message];
+	if (coalesced)
+		lastEntry.coalescedCount++;
+	return coalesced;
+}
+
+static void BDLoggerDrainQueue(void *context) {
+	BDLogger *logger = (__bridge_transfer BDLogger *)context;
+	[logger drainQueuedEntries];
+}
+
+/** Only one drain of the bounded queue is ever outstanding */
+-(void)scheduleQueueDrain {
+	if (atomic_flag_test_and_set(&_queueDrainScheduled))
+		return;
+	dispatch_async_f(self.dispatchQueue, (__bridge_retained void *)self, BDLoggerDrainQueue);
+}
+
+/**
+ * Writes the entries in the bounded queue, oldest first.  Only takes those that were there when it started, so that
+ * a busy queue can't keep everything else on the dispatchQueue waiting.  Must be called on the dispatchQueue.
+ */
+-(void)drainQueuedEntries {
+	// clear the flag first so that anything queued while we're draining schedules another drain
+	atomic_flag_clear(&_queueDrainScheduled);
+	unsigned long remaining = atomic_load_explicit(&_queueDepth, memory_order_relaxed);
+	for (; remaining > 0; remaining--) {
+		os_unfair_lock_lock(&_queueLock);
+		NSUInteger oldestSlot = NSNotFound;
+		for (NSUInteger slot = 0; slot <= BDSeverityDebug; slot++) {
+			if ([_queuedEntries[slot] count] > 0 && (oldestSlot == NSNotFound || ((BDEntry *)_queuedEntries[slot][0]).queueSequence < ((BDEntry *)_queuedEntries[oldestSlot][0]).queueSequence))
+				oldestSlot = slot;
+		}
+		if (oldestSlot == NSNotFound) {
+			os_unfair_lock_unlock(&_queueLock);
+			return;
+		}
+		BDEntry *entry = _queuedEntries[oldestSlot][0];
+		[_queuedEntries[oldestSlot] removeObjectAtIndex:0];
+		if (self.lastQueuedEntry == entry) {
+			self.lastQueuedEntry = nil;
+			self.lastQueuedMessage = nil;
+		}
+		NSUInteger repeats = entry.coalescedCount;
+		[self countOffQueue];
+		os_unfair_lock_unlock(&_queueLock);
+
+		if (repeats > 0) {
+			[entry renderDeferredMessage];
+			// the repeat count is part of the text now, so it can't be stored as a template
+			entry.message = [NSString stringWithFormat:@"%@ (repeated %lu more times)", entry.message, (unsigned long)repeats];
+			entry.deferredFormat = nil;
+		}
+		[self writeQueuedEntry:entry];
+	}
+
+	os_unfair_lock_lock(&_queueLock);
+	BOOL more = NO;
+	for (NSUInteger slot = 0; slot <= BDSeverityDebug; slot++) {
+		more = more || [_queuedEntries[slot] count] > 0;
+	}
+	os_unfair_lock_unlock(&_queueLock);
+	if (more)
+		[self scheduleQueueDrain];
+}
+
+/** Blocks the calling thread until the queue depth drops below the limit */
+-(void)waitForQueueBelow:(unsigned long)limit {
+	atomic_fetch_add_explicit(&_queueWaiters, 1, memory_order_relaxed);
+	while (atomic_load_explicit(&_queueDepth, memory_order_relaxed) >= limit) {
+		// the timeout covers a signal that went to another waiter, or that arrived before we started waiting
+		dispatch_semaphore_wait(_queueSpace, dispatch_time(DISPATCH_TIME_NOW, 10 * NSEC_PER_MSEC));
+	}
+	atomic_fetch_sub_explicit(&_queueWaiters, 1, memory_order_relaxed);
+}
+
+/** Counts a dropped entry, and makes sure a warning about it gets written once the writer catches up */
+-(void)droppedQueuedEntry {
+	BDMetricsCount(&_metrics.entriesDropped, 1);
+	atomic_fetch_add_explicit(&_queueDropped, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&_queueDroppedUnreported, 1, memory_order_relaxed);
+	if (!atomic_flag_test_and_set(&_queueDropWarningScheduled)) {
+		dispatch_async(self.dispatchQueue, ^(void) {
+			atomic_flag_clear(&self->_queueDropWarningScheduled);
+			unsigned long dropped = atomic_exchange(&self->_queueDroppedUnreported, 0);
+			if (dropped == 0)
+				return;
+			BDEntry *warning = [[BDEntry alloc] init];
+			warning.severity = BDSeverityWarning;
+			warning.message = [NSString stringWithFormat:@"Log queue was full; %lu entries were dropped", dropped];
+			// like any other entry, so that the sinks hear about it too
+			[self log:warning];
+		});
+	}
+}
+
+-(NSUInteger)queueDepth {
+	return atomic_load_explicit(&_queueDepth, memory_order_relaxed);
+}
+
+-(NSUInteger)queueHighWaterMark {
+	return atomic_load_explicit(&_queueHighWaterMark, memory_order_relaxed);
+}
+
+-(NSUInteger)queueDroppedEntries {
+	return atomic_load_explicit(&_queueDropped, memory_order_relaxed);
+}
+
+-(void)resetQueueHighWaterMark {
+	atomic_store_explicit(&_queueHighWaterMark, atomic_load_explicit(&_queueDepth, memory_order_relaxed), memory_order_relaxed);
+}
+
+/** Writes out whatever is sitting in the pending batch. Must be called on the dispatchQueue. */
+-(void)flushPendingEntries {
+	[self drainRingBuffers];
+
+	self.batchGeneration++;
+	if ([self.pendingEntries count] == 0)
+		return;
+
+	NSArray *entries = self.pendingEntries;
+	self.pendingEntries = [NSMutableArray array];
+	[self writeEntries:entries];
+}
+
+/**
+ * Inserts the entries using the pre-prepared insert statement.  Multiple entries get wrapped in a single
+ * transaction so that we only pay for one journal write (and fsync) per batch.  Must be called on the dispatchQueue.
+ */
+-(void)writeEntries:(NSArray *)entries {
+	if (self.insertStatement == NULL)
+		return;
+
+	BDHistogramRecord(&_metrics.batchSize, [entries count]);
+	BOOL useTransaction = [entries count] > 1 && [self beginBatch];
+	for (BDEntry *entry in entries) {
+		[self insertEntry:entry];
+	}
+
+	if (useTransaction && ![self commitBatch]) {
+		// the whole batch is gone, so dump it all out via NSLog rather than lose it completely
+		for (BDEntry *entry in entries) {
+			NSLog(@"%@", [entry description]);
+		}
+	}
+}
+
+/**
+ * Makes sure that insertStatement inserts into the partition the timestamp belongs in, creating the partition if
+ * need be.  The vast majority of the time this is just a string comparison.  Must be called on the dispatchQueue.
+ */
+-(BOOL)prepareInsertForTimestamp:(NSTimeInterval)timestamp {
+	NSString *suffix = [BDPartition suffixForTimestamp:timestamp partitioning:self.partitioning];
+	if ([suffix isEqualToString:self.insertPartitionSuffix])
+		return YES;
+
+	BDPartition *partition = [suffix length] == 0 ? [BDPartition legacyPartition] : [BDPartition partitionWithTableName:[@"LOG_ENTRIES" stringByAppendingString:suffix]];
+	NSError *error = nil;
+	if (![self createEntriesTableForPartition:partition error:&error]) {
+		NSLog(@"%@", [error localizedDescription]);
+		return NO;
+	}
+
+	sqlite3_stmt *insertStatement;
+	NSString *sql = [self insertSQLForPartition:partition];
+	NSUInteger rc = sqlite3_prepare_v2(self.connection, [sql UTF8String], -1, &insertStatement, NULL);
+	if (rc != SQLITE_OK) {
+		NSLog(@"Unable to prepare insert statement (rc=%d): %s", rc, sqlite3_errmsg(self.connection));
+		return NO;
+	}
+	sqlite3_finalize(self.insertStatement);
+	self.insertStatement = insertStatement;
+	self.insertPartitionSuffix = suffix;
+	sqlite3_finalize(self.ftsInsertStatement);
+	self.ftsInsertStatement = NULL;
+	sqlite3_finalize(self.fieldsInsertStatement);
+	self.fieldsInsertStatement = NULL;
+
+	partition = [partition partitionWithCompanions:[self companionsForPartition:partition]];
+	BOOL known = NO;
+	for (BDPartition *existing in [self partitions]) {
+		known = known || ([existing.suffix isEqualToString:suffix] && [existing.companions isEqualToSet:partition.companions]);
+	}
+	if (!known) {
+		// readers can't see the new table until it has been committed
+		[self.uncommittedPartitions addObject:partition];
+		if (sqlite3_get_autocommit(self.connection))
+			[self publishUncommittedPartitions];
+	}
+	return YES;
+}
+
+/** Adds (or replaces, if their companions have changed) the partitions created since the last commit */
+-(void)publishUncommittedPartitions {
+	if ([self.uncommittedPartitions count] == 0)
+		return;
+	NSMutableArray *partitions = [NSMutableArray array];
+	NSSet *replaced = [NSSet setWithArray:[self.uncommittedPartitions valueForKey:@"suffix"]];
+	for (BDPartition *partition in [self partitions]) {
+		if (![replaced containsObject:partition.suffix])
+			[partitions addObject:partition];
+	}
+	[partitions addObjectsFromArray:self.uncommittedPartitions];
+	[self setPartitions:partitions];
+	[self.uncommittedPartitions removeAllObjects];
+}
+
+/** Starts a transaction for a batch of inserts. If it fails, the inserts just fall back to autocommit. */
+-(BOOL)beginBatch {
+	NSUInteger rc = sqlite3_exec(self.connection, "BEGIN", NULL, NULL, NULL);
+	if (rc != SQLITE_OK) {
+		NSLog(@"Unable to begin log entry batch (rc=%d): %s", rc, sqlite3_errmsg(self.connection));
+		return NO;
+	}
+	return YES;
+}
+
+/** Commits a batch of inserts, rolling it back if the commit fails */
+-(BOOL)commitBatch {
+	uint64_t startMicros = BDMetricsMicros();
+	NSUInteger rc = sqlite3_exec(self.connection, "COMMIT", NULL, NULL, NULL);
+	BDHistogramRecord(&_metrics.commitMicros, BDMetricsMicros() - startMicros);
+	if (rc != SQLITE_OK) {
+		NSLog(@"Failed to commit log entry batch (rc=%d): %s", rc, sqlite3_errmsg(self.connection));
+		[self rollbackBatch];
+		return NO;
+	}
+	BDMetricsCount(&_metrics.entriesWritten, self.uncommittedWrites);
+	self.uncommittedWrites = 0;
+	[self publishUncommittedPartitions];
+	if ([self.uncommittedTailEntries count] > 0) {
+		[self publishWrittenEntries:self.uncommittedTailEntries];
+		self.uncommittedTailEntries = [NSMutableArray array];
+	}
+	if ([self.uncommittedRecentRecords length] > 0) {
+		[self cacheRecentRecords:[self.uncommittedRecentRecords bytes] count:[self.uncommittedRecentRecords length] / sizeof(BDRingRecord)];
+		[self.uncommittedRecentRecords setLength:0];
+	}
+	return YES;
+}
+
+-(void)rollbackBatch {
+	sqlite3_exec(self.connection, "ROLLBACK", NULL, NULL, NULL);
+	BDMetricsCount(&_metrics.entriesFailed, self.uncommittedWrites);
+	self.uncommittedWrites = 0;
+	[self.uncommittedTailEntries removeAllObjects];
+	[self.uncommittedRecentRecords setLength:0];
+	// any template added in this batch has gone too
+	[self.templateIDs removeAllObjects];
+	if ([self.uncommittedPartitions count] > 0) {
+		// any partition created in this batch has just been rolled away, so the next insert has to create it again
+		[self.uncommittedPartitions removeAllObjects];
+		self.insertPartitionSuffix = nil;
+	}
+}
+
+-(void)insertEntry:(BDEntry *)entry {
+	NSData *userInfoData = entry.userInfo == nil ? nil : [self.userInfoCodec encodeUserInfo:entry.userInfo];
+
+	// segments only hold plain messages, so templates are only used for entries going straight into the store
+	if (self.templateInterning && entry.deferredFormat != nil && [[self segments] count] == 0) {
+		sqlite3_int64 templateID = [self templateIDForFormat:entry.deferredFormat.format];
+		NSData *arguments = [entry.deferredFormat encodedArguments];
+		if (templateID != 0 && [arguments length] < INT32_MAX) {
+			const char *messageBytes = entry.messageRendered ? [entry.message UTF8String] : NULL;
+			if ([self storeTimestamp:[entry.timestamp timeIntervalSince1970] severity:entry.severity messageBytes:messageBytes length:messageBytes == NULL ? 0 : (int)strlen(messageBytes) userInfoData:userInfoData userInfo:entry.userInfo templateID:templateID templateArguments:arguments]) {
+				// left unrendered: -publishWrittenEntries: renders it if a tail observer wants it, and the cache when read
+				if ([self isTailing])
+					[self entryWritten:entry];
+				return;
+			}
+		}
+	}
+
+	[entry renderDeferredMessage];
+	const char *messageBytes = [entry.message UTF8String];
+	if (![self insertTimestamp:[entry.timestamp timeIntervalSince1970] severity:entry.severity messageBytes:messageBytes length:(int)strlen(messageBytes) userInfoData:userInfoData userInfo:entry.userInfo]) {
+		NSLog(@"%@", [entry description]);
+	}
+	else if ([self isTailing]) {
+		[self entryWritten:entry];
+	}
+}
+
+/**
+ * The lowest level insert, shared by the BDEntry and ring buffer paths.  With memoryMappedSegments, the entry is
+ * appended to the current segment instead of going into the log store.  Must be called on the dispatchQueue.
+ */
+-(BOOL)insertTimestamp:(NSTimeInterval)timestamp severity:(BDSeverity)severity messageBytes:(const char *)messageBytes length:(int)messageLength userInfoData:(NSData *)userInfoData userInfo:(NSDictionary *)userInfo {
+	BDSegment *segment = [[self segments] lastObject];
+	if (segment != nil) {
+		if ([segment appendTimestamp:timestamp severity:severity messageBytes:messageBytes length:messageLength userInfoData:userInfoData]) {
+			BDMetricsCount(&_metrics.entriesWritten, 1);
+			return YES;
+		}
+
+		// the current segment is full, so leave it for compaction and move on to a new one
+		NSError *error = nil;
+		if ([self startSegment:&error]) {
+			[self scheduleCompaction];
+			if ([[[self segments] lastObject] appendTimestamp:timestamp severity:severity messageBytes:messageBytes length:messageLength userInfoData:userInfoData]) {
+				BDMetricsCount(&_metrics.entriesWritten, 1);
+				return YES;
+			}
+		}
+		else {
+			NSLog(@"%@", [error localizedDescription]);
+		}
+		// no room even in an empty segment, so it may as well go straight into the log store
+	}
+	return [self storeTimestamp:timestamp severity:severity messageBytes:messageBytes length:messageLength userInfoData:userInfoData userInfo:userInfo templateID:0 templateArguments:nil];
+}
+
+/**
+ * Inserts an entry into the log store itself.  If a template id is given, the entry's template arguments are
+ * stored instead of the message; messageBytes is then only used for the full text index, and can be NULL if
+ * that is off.  Must be called on the dispatchQueue.
+ */
+-(BOOL)storeTimestamp:(NSTimeInterval)timestamp severity:(BDSeverity)severity messageBytes:(const char *)messageBytes length:(int)messageLength userInfoData:(NSData *)userInfoData userInfo:(NSDictionary *)userInfo templateID:(sqlite3_int64)templateID templateArguments:(NSData *)templateArguments {
+	if (![self prepareInsertForTimestamp:timestamp])
+		return NO;
+
+	// outside of a batch, an entry and its full text and field index rows would otherwise each be committed on
+	// their own, so they are given a transaction of their own
+	BOOL companions = (self.fullTextIndexing && messageBytes != NULL) || (userInfo != nil && [self.indexedUserInfoKeys count] > 0);
+	BOOL ownTransaction = companions && sqlite3_get_autocommit(self.connection);
+	if (ownTransaction && ![self beginBatch]) {
+		BDMetricsCount(&_metrics.entriesFailed, 1);
+		return NO;
+	}
+
+	// compressed and templated messages are stored as blobs, which is how the retrieval side knows to decode them
+	NSData *compressedMessage = nil;
+	if (templateID != 0) {
+		NSMutableData *templated = [NSMutableData dataWithLength:BD_TEMPLATED_HEADER_BYTES];
+		uint8_t *header = [templated mutableBytes];
+		header[0] = BD_COMPRESSED_MARKER_0;
+		header[1] = BD_TEMPLATED_MARKER_1;
+		OSWriteLittleInt32(header, 2, (uint32_t)templateID);
+		[templated appendData:templateArguments];
+		compressedMessage = templated;
+	}
+	else {
+		compressedMessage = [self compressedPayload:messageBytes length:messageLength];
+	}
+	if ([userInfoData length] > 0) {
+		NSData *compressedUserInfo = [self compressedPayload:[userInfoData bytes] length:[userInfoData length]];
+		userInfoData = compressedUserInfo ?: userInfoData;
+	}
+
+	sqlite3_reset(self.insertStatement);
+	sqlite3_bind_double(self.insertStatement, 1, timestamp);
+	sqlite3_bind_int(self.insertStatement, 2, severity);
+	if (compressedMessage != nil)
+		sqlite3_bind_blob(self.insertStatement, 3, [compressedMessage bytes], (int)[compressedMessage length], NULL);
+	else
+		sqlite3_bind_text(self.insertStatement, 3, messageBytes, messageLength, NULL);
+	if (userInfoData == nil)
+		sqlite3_bind_blob(self.insertStatement, 4, NULL, 0, NULL);
+	else
+		sqlite3_bind_blob(self.insertStatement, 4, [userInfoData bytes], (int)[userInfoData length], NULL);
+	if (self.templateInterning) {
+		if (templateID != 0)
+			sqlite3_bind_int64(self.insertStatement, 5, templateID);
+		else
+			sqlite3_bind_null(self.insertStatement, 5);
+	}
+
+	uint64_t startMicros = BDMetricsMicros();
+	NSUInteger rc = sqlite3_step(self.insertStatement);
+	BDHistogramRecord(&_metrics.insertMicros, BDMetricsMicros() - startMicros);
+	if (rc != SQLITE_DONE) {
+		// hmm... if, for some reason, we can't save it into the log store, let the caller at least dump it
+		// out via NSLog along with an error
+		NSLog(@"Failed to save log entry (rc=%d): %s", rc, sqlite3_errmsg(self.connection));
+		BDMetricsCount(&_metrics.entriesFailed, 1);
+		if (ownTransaction)
+			sqlite3_exec(self.connection, "ROLLBACK", NULL, NULL, NULL);
+		return NO;
+	}
+	// outside of a transaction the entry is already safely in the store
+	if (sqlite3_get_autocommit(self.connection))
+		BDMetricsCount(&_metrics.entriesWritten, 1);
+	else
+		self.uncommittedWrites++;
+
+	sqlite3_int64 rowid = sqlite3_last_insert_rowid(self.connection);
+	if (self.fullTextIndexing && messageBytes != NULL)
+		[self indexMessageBytes:messageBytes length:messageLength rowid:rowid];
+	if (userInfo != nil && [self.indexedUserInfoKeys count] > 0)
+		[self indexUserInfo:userInfo rowid:rowid];
+	return ownTransaction ? [self commitBatch] : YES;
+}
+
+/** Adds the indexed userInfo keys of the entry just inserted to its partition's field index. Must be called on the dispatchQueue. */
+-(void)indexUserInfo:(NSDictionary *)userInfo rowid:(sqlite3_int64)rowid {
+	for (NSString *key in self.indexedUserInfoKeys) {
+		id value = userInfo[key];
+		if (value == nil)
+			continue;
+
+		if (self.fieldsInsertStatement == NULL) {
+			sqlite3_stmt *statement;
+			NSString *sql = [NSString stringWithFormat:@"INSERT INTO LOG_FIELDS%@ (Z_KEY, Z_VALUE, Z_ENTRY) VALUES (?, ?, ?)", self.insertPartitionSuffix];
+			NSUInteger rc = sqlite3_prepare_v2(self.connection, [sql UTF8String], -1, &statement, NULL);
+			if (rc != SQLITE_OK) {
+				NSLog(@"Unable to prepare field index insert statement (rc=%d): %s", rc, sqlite3_errmsg(self.connection));
+				return;
+			}
+			self.fieldsInsertStatement = statement;
+		}
+
+		sqlite3_reset(self.fieldsInsertStatement);
+		sqlite3_bind_text(self.fieldsInsertStatement, 1, [key UTF8String], -1, SQLITE_TRANSIENT);
+		if (!BDBindFieldValue(self.fieldsInsertStatement, 2, value))
+			continue;
+		sqlite3_bind_int64(self.fieldsInsertStatement, 3, rowid);
+		NSUInteger rc = sqlite3_step(self.fieldsInsertStatement);
+		if (rc != SQLITE_DONE) {
+			NSLog(@"Failed to index log entry field %@ (rc=%d): %s", key, rc, sqlite3_errmsg(self.connection));
+		}
+	}
+}
+
+/** Returns the compressed form of an entry's message or userInfo, or nil if it should be stored as it is. Must be called on the dispatchQueue. */
+-(NSData *)compressedPayload:(const void *)bytes length:(NSUInteger)length {
+	// short payloads barely compress, and would cost a decompression on every retrieval for nothing
+	if (!self.compression || length < [self.compressionMinimumBytes unsignedIntegerValue])
+		return nil;
+	if (self.compressionScratch == nil)
+		self.compressionScratch = [NSMutableData dataWithLength:compression_encode_scratch_buffer_size(COMPRESSION_LZ4_RAW)];
+	return BDCompressBytes(bytes, length, [self.compressionScratch mutableBytes]);
+}
+
+/** Adds the entry just inserted to its partition's full text index, as part of the same batch. Must be called on the dispatchQueue. */
+-(void)indexMessageBytes:(const char *)messageBytes length:(int)messageLength rowid:(sqlite3_int64)rowid {
+	if (self.ftsInsertStatement == NULL) {
+		sqlite3_stmt *statement;
+		NSString *sql = [NSString stringWithFormat:@"INSERT INTO LOG_FTS%@ (rowid, Z_MESSAGE) VALUES (?, ?)", self.insertPartitionSuffix];
+		NSUInteger rc = sqlite3_prepare_v2(self.connection, [sql UTF8String], -1, &statement, NULL);
+		if (rc != SQLITE_OK) {
+			NSLog(@"Unable to prepare full text insert statement (rc=%d): %s", rc, sqlite3_errmsg(self.connection));
+			return;
+		}
+		self.ftsInsertStatement = statement;
+	}
+
+	sqlite3_reset(self.ftsInsertStatement);
+	sqlite3_bind_int64(self.ftsInsertStatement, 1, rowid);
+	sqlite3_bind_text(self.ftsInsertStatement, 2, messageBytes, messageLength, NULL);
+	NSUInteger rc = sqlite3_step(self.ftsInsertStatement);
+	if (rc != SQLITE_DONE) {
+		NSLog(@"Failed to index log entry (rc=%d): %s", rc, sqlite3_errmsg(self.connection));
+	}
+}
+
+#
+#pragma mark - Segment compaction
+#
+-(void)scheduleCompaction {
+	// a shared store's segments are merged by whichever process holds the writer lock
+	if (self.sharedStore || self.compactionScheduled || [[self segments] count] < 2)
+		return;
+	self.compactionScheduled = YES;
+	// one segment per turn of the queue, so new entries never wait behind more than one compaction
+	dispatch_async(self.dispatchQueue, ^(void) {
+		self.compactionScheduled = NO;
+		[self compactOldestSegment];
+		[self scheduleCompaction];
+	});
+}
+
+/** Moves the entries in the oldest segment (which is never the one being appended to) into the log store. Must be called on the dispatchQueue. */
+-(void)compactOldestSegment {
+	NSArray *segments = [self segments];
+	if (self.connection == NULL || [segments count] < 2)
+		return;
+	BDSegment *segment = segments[0];
+	NSString *sql = [NSString stringWithFormat:@"INSERT OR REPLACE INTO LOG_SEGMENTS (Z_SEGMENT) VALUES (%lld)", segment.number];
+	if (![self moveSegmentIntoStore:segment recording:sql])
+		return;
+
+	// readers that already have hold of the segment keep it mapped until they're done with it
+	NSMutableArray *remaining = [[self segments] mutableCopy];
+	[remaining removeObject:segment];
+	[self setSegments:remaining];
+	[[NSFileManager defaultManager] removeItemAtURL:segment.url error:NULL];
+}
+
+/**
+ * Copies every entry in a segment into the log store in one transaction, along with the SQL that records the
+ * segment as done, so a crash can never leave it half moved or move it twice.  Must be called on the dispatchQueue.
+ */
+-(BOOL)moveSegmentIntoStore:(BDSegment *)segment recording:(NSString *)sql {
+	if (![self beginBatch])
+		return NO;
+
+	BOOL decodeUserInfo = [self.indexedUserInfoKeys count] > 0;
+	[segment enumerateRecordsBetweenStart:-DBL_MAX end:DBL_MAX severity:(BDSeverity)UINT32_MAX usingBlock:^(const BDSegmentRecord *record) {
+		@autoreleasepool {
+			const char *messageBytes = (const char *)(record + 1);
+			NSData *userInfoData = record->userInfoLength == 0 ? nil : [NSData dataWithBytesNoCopy:(void *)(messageBytes + record->messageLength) length:record->userInfoLength freeWhenDone:NO];
+			NSDictionary *userInfo = decodeUserInfo && userInfoData != nil ? [self.userInfoCodec decodeUserInfo:userInfoData] : nil;
+			[self storeTimestamp:record->timestamp severity:record->severity messageBytes:messageBytes length:record->messageLength userInfoData:userInfoData userInfo:userInfo templateID:0 templateArguments:nil];
+		}
+	}];
+	// these were counted as written when they went into the segment, and stay there if the move fails
+	self.uncommittedWrites = 0;
+	NSUInteger rc = sqlite3_exec(self.connection, [sql UTF8String], NULL, NULL, NULL);
+	if (rc != SQLITE_OK) {
+		NSLog(@"Unable to record compaction of log segment %@ (rc=%d): %s", [segment.url path], rc, sqlite3_errmsg(self.connection));
+		[self rollbackBatch];
+		return NO;
+	}
+	return [self commitBatch];
+}
+
+-(void)flush {
+	__block NSArray *channels;
+	dispatch_sync(self.dispatchQueue, ^(void) {
+		[self drainQueuedEntries];
+		[self flushPendingEntries];
+		channels = self.sinkChannels;
+	});
+	for (BDSinkChannel *channel in channels) {
+		[channel flush];
+	}
+}
+
+#
+#pragma mark - Live tail
+#
+-(id)addTailObserverWithSeverity:(BDSeverity)severity queue:(dispatch_queue_t)queue usingBlock:(void (^)(NSArray *entries))block {
+	BDTailObserver *observer = [[BDTailObserver alloc] init];
+	observer.severity = severity;
+	observer.queue = queue;
+	observer.block = block;
+	[self performOnDispatchQueue:^(void) {
+		self.tailObservers = [self.tailObservers arrayByAddingObject:observer];
+	}];
+	return observer;
+}
+
+-(void)removeTailObserver:(id)observer {
+	[self performOnDispatchQueue:^(void) {
+		NSMutableArray *observers = [self.tailObservers mutableCopy];
+		[observers removeObjectIdenticalTo:observer];
+		self.tailObservers = observers;
+	}];
+	((BDTailObserver *)observer).removed = YES;
+}
+
+/**
+ * Runs a block on the dispatchQueue and waits for it, running it straight away if we're already on it (eg. from a
+ * sink or a tail observer whose queue is the dispatchQueue) rather than deadlocking.
+ */
+-(void)performOnDispatchQueue:(dispatch_block_t)block {
+	if (dispatch_get_specific(&BDDispatchQueueKey) == (__bridge void *)self)
+		block();
+	else
+		dispatch_sync(self.dispatchQueue, block);
+}
+
+/** Whether anyone wants to know about entries as they are written. Must be called on the dispatchQueue. */
+-(BOOL)isTailing {
+	return [self.tailObservers count] > 0 || _recentCapacity > 0;
+}
+
+/** Hands on an entry that has just been written, or holds on to it until its transaction commits. Must be called on the dispatchQueue. */
+-(void)entryWritten:(BDEntry *)entry {
+	if (sqlite3_get_autocommit(self.connection))
+		[self publishWrittenEntries:@[ entry ]];
+	else
+		[self.uncommittedTailEntries addObject:entry];
+}
+
+/** The same as -entryWritten:, for a ring record that only the recent entry cache wants. Must be called on the dispatchQueue. */
+-(void)recordWritten:(const BDRingRecord *)record {
+	if (sqlite3_get_autocommit(self.connection))
+		[self cacheRecentRecords:record count:1];
+	else
+		[self.uncommittedRecentRecords appendBytes:record length:sizeof(BDRingRecord)];
+}
+
+/**
+ * Adds entries that are now in the log store to the recent entry cache, and queues them up for the tail observers.
+ * They are handed over once the writer gets back round to it, so everything written in the meantime goes in the
+ * same batch.  Must be called on the dispatchQueue.
+ */
+-(void)publishWrittenEntries:(NSArray *)entries {
+	[self cacheRecentEntries:entries];
+	if ([self.tailObservers count] == 0)
+		return;
+
+	// under the cache's lock, as -cachedRecent:severity: may be rendering the same entries
+	os_unfair_lock_lock(&_recentLock);
+	for (BDEntry *entry in entries) {
+		[entry renderDeferredMessage];
+	}
+	os_unfair_lock_unlock(&_recentLock);
+
+	[self.pendingTailEntries addObjectsFromArray:entries];
+	if (self.tailDeliveryScheduled)
+		return;
+	self.tailDeliveryScheduled = YES;
+	dispatch_async(self.dispatchQueue, ^(void) {
+		self.tailDeliveryScheduled = NO;
+		NSArray *pending = self.pendingTailEntries;
+		self.pendingTailEntries = [NSMutableArray array];
+		for (BDTailObserver *observer in self.tailObservers) {
+			NSIndexSet *matching = [pending indexesOfObjectsPassingTest:^BOOL(BDEntry *entry, NSUInteger index, BOOL *stop) {
+				return entry.severity <= observer.severity;
+			}];
+			if ([matching count] == 0)
+				continue;
+			NSArray *batch = [matching count] == [pending count] ? pending : [pending objectsAtIndexes:matching];
+			dispatch_async(observer.queue, ^(void) {
+				if (!observer.removed)
+					observer.block(batch);
+			});
+		}
+	});
+}
+
+/** Adds entries to the recent entry cache, keeping each severity's entries in timestamp order. Must be called on the dispatchQueue. */
+-(void)cacheRecentEntries:(NSArray *)entries {
+	os_unfair_lock_lock(&_recentLock);
+	if (_recentCapacity > 0) {
+		for (BDEntry *entry in entries) {
+			if (entry.severity > BDSeverityDebug)
+				continue;
+			NSMutableArray *recent = _recentEntries[entry.severity];
+			// entries nearly always arrive in order, so this is nearly always an append
+			NSUInteger index = [recent count];
+			while (index > 0 && [((BDEntry *)recent[index - 1]).timestamp compare:entry.timestamp] == NSOrderedDescending)
+				index--;
+			[recent insertObject:entry atIndex:index];
+			if ([recent count] > _recentCapacity)
+				[recent removeObjectAtIndex:0];
+		}
+	}
+	os_unfair_lock_unlock(&_recentLock);
+}
+
+/** Adds ring records to the recent entry cache, the same as -cacheRecentEntries:. Must be called on the dispatchQueue. */
+-(void)cacheRecentRecords:(const BDRingRecord *)records count:(NSUInteger)count {
+	os_unfair_lock_lock(&_recentLock);
+	for (NSUInteger i = 0; i < count && _recentCapacity > 0; i++) {
+		if (records[i].severity <= BDSeverityDebug)
+			BDRecentRecordsInsert(&_recentRecords[records[i].severity], _recentCapacity, &records[i]);
+	}
+	os_unfair_lock_unlock(&_recentLock);
+}
+
+/** Drops cached entries older than a given time, eg. when they are about to be pruned from the store */
+-(void)forgetRecentEntriesBefore:(NSTimeInterval)cutoff {
+	os_unfair_lock_lock(&_recentLock);
+	for (NSUInteger i = 0; i <= BDSeverityDebug && _recentCapacity > 0; i++) {
+		NSMutableArray *recent = _recentEntries[i];
+		NSUInteger expired = 0;
+		while (expired < [recent count] && [((BDEntry *)recent[expired]).timestamp timeIntervalSince1970] < cutoff)
+			expired++;
+		[recent removeObjectsInRange:NSMakeRange(0, expired)];
+
+		BDRecentRecords *records = &_recentRecords[i];
+		while (records->count > 0 && BDRecentRecordAt(records, _recentCapacity, 0)->timestamp < cutoff) {
+			records->first = (records->first + 1) % _recentCapacity;
+			records->count--;
+		}
+	}
+	os_unfair_lock_unlock(&_recentLock);
+}
+
+/**
+ * Answers -retrieveRecent:severity:error: from the recent entry cache, or returns nil if it can't.  The cache holds
+ * every entry written since the store was opened, apart from those pushed out of a full severity; those are older
+ * than that severity's cached entries, so as long as no more entries are asked for than the cache holds of each
+ * severity, none of them can be among the most recent.  The same goes for the cached ring records, which are kept
+ * apart from the entries.  Only the entries returned are built or rendered.  Can be called from any thread.
+ */
+-(NSArray *)cachedRecent:(NSUInteger)entryCount severity:(BDSeverity)severity {
+	os_unfair_lock_lock(&_recentLock);
+	if (_recentCapacity == 0 || entryCount > _recentCapacity) {
+		os_unfair_lock_unlock(&_recentLock);
+		return nil;
+	}
+	NSUInteger severities = MIN(severity, BDSeverityDebug) + 1;
+	NSUInteger remaining[BDSeverityDebug + 1];
+	NSUInteger remainingRecords[BDSeverityDebug + 1];
+	for (NSUInteger i = 0; i < severities; i++) {
+		remaining[i] = [_recentEntries[i] count];
+		remainingRecords[i] = _recentRecords[i].count;
+	}
+	// merge the severities (and the entries and records of each), most recent first
+	NSMutableArray *entries = [NSMutableArray arrayWithCapacity:entryCount];
+	while ([entries count] < entryCount) {
+		NSTimeInterval newestTimestamp = 0;
+		NSUInteger newestSeverity = NSNotFound;
+		BOOL newestIsRecord = NO;
+		for (NSUInteger i = 0; i < severities; i++) {
+			if (remaining[i] > 0) {
+				NSTimeInterval timestamp = [((BDEntry *)_recentEntries[i][remaining[i] - 1]).timestamp timeIntervalSince1970];
+				if (newestSeverity == NSNotFound || timestamp > newestTimestamp) {
+					newestTimestamp = timestamp;
+					newestSeverity = i;
+					newestIsRecord = NO;
+				}
+			}
+			if (remainingRecords[i] > 0) {
+				NSTimeInterval timestamp = BDRecentRecordAt(&_recentRecords[i], _recentCapacity, remainingRecords[i] - 1)->timestamp;
+				if (newestSeverity == NSNotFound || timestamp > newestTimestamp) {
+					newestTimestamp = timestamp;
+					newestSeverity = i;
+					newestIsRecord = YES;
+				}
+			}
+		}
+		if (newestSeverity == NSNotFound)
+			break;
+		if (newestIsRecord) {
+			[entries addObject:[self entryFromRingRecord:BDRecentRecordAt(&_recentRecords[newestSeverity], _recentCapacity, --remainingRecords[newestSeverity])]];
+		}
+		else {
+			BDEntry *entry = _recentEntries[newestSeverity][--remaining[newestSeverity]];
+			[entry renderDeferredMessage];
+			[entries addObject:entry];
+		}
+	}
+	os_unfair_lock_unlock(&_recentLock);
+	// too few entries have been written since the store was opened, so the rest are only in the store
+	return [entries count] == entryCount ? entries : nil;
+}
+
+#
+#pragma mark - Shared store
+#
+/** The directory that every process sharing the log store keeps its staging directory in */
+-(NSURL *)stagingDirectoryURL {
+	return [NSURL fileURLWithPath:[[self.logStoreURL path] stringByAppendingString:@"-staging"] isDirectory:YES];
+}
+
+/**
+ * Sets this process up to stage its entries: a fresh staging directory, locked for as long as the store is open so
+ * that the merging process can tell this one is still alive, and a first segment.  Also stands for election as the
+ * merging process.  Must be called on the dispatchQueue.
+ */
+-(BOOL)openStaging:(NSError **)error {
+	NSUInteger rc = sqlite3_exec(self.connection, "CREATE TABLE IF NOT EXISTS LOG_STAGING (Z_PRODUCER TEXT PRIMARY KEY, Z_SEGMENT INTEGER NOT NULL)", NULL, NULL, NULL);
+	if (rc != SQLITE_OK) {
+		if (error != NULL) {
+			NSString *message = [NSString stringWithFormat:@"Unable to create LOG_STAGING table (rc=%d): %s", rc, sqlite3_errmsg(self.connection)];
+			*error = [NSError errorWithDomain:BD_ERROR_DOMAIN code:rc userInfo:@{ NSLocalizedDescriptionKey : message }];
+		}
+		return NO;
+	}
+
+	self.producerID = [[NSUUID UUID] UUIDString];
+	NSURL *directoryURL = [self segmentsDirectoryURL];
+	// the directory is put together under a name that the merging process ignores, and only renamed into place once
+	// its lock is held, so the merger can never come across it unlocked and decide that its producer has gone away
+	NSURL *temporaryURL = [[self stagingDirectoryURL] URLByAppendingPathComponent:[@"." stringByAppendingString:self.producerID] isDirectory:YES];
+	if (![[NSFileManager defaultManager] createDirectoryAtURL:temporaryURL withIntermediateDirectories:YES attributes:nil error:error])
+		return NO;
+	_producerLockFD = [self lockFileAtURL:[temporaryURL URLByAppendingPathComponent:@"producer.lock"] create:YES];
+	if (_producerLockFD < 0 || rename([[temporaryURL path] fileSystemRepresentation], [[directoryURL path] fileSystemRepresentation]) != 0) {
+		int lockError = errno;
+		if (error != NULL) {
+			NSString *message = [NSString stringWithFormat:@"Unable to lock staging directory %@ (errno=%d): %s", [directoryURL path], lockError, strerror(lockError)];
+			*error = [NSError errorWithDomain:BD_ERROR_DOMAIN code:lockError userInfo:@{ NSLocalizedDescriptionKey : message }];
+		}
+		if (_producerLockFD >= 0) {
+			close(_producerLockFD);
+			_producerLockFD = -1;
+		}
+		[[NSFileManager defaultManager] removeItemAtURL:temporaryURL error:NULL];
+		return NO;
+	}
+
+	self.nextSegmentNumber = 1;
+	[self setSegments:@[]];
+	if (![self startSegment:error])
+		return NO;
+	[self standForWriter];
+	return YES;
+}
+
+/**
+ * Opens (creating it if asked to) and exclusively flock()s a file, without waiting.  Returns the descriptor, or -1
+ * with errno set if the file can't be opened or someone else holds it.
+ */
+-(int)lockFileAtURL:(NSURL *)url create:(BOOL)create {
+	int fd = open([[url path] fileSystemRepresentation], O_RDWR | O_CLOEXEC | (create ? O_CREAT : 0), 0644);
+	if (fd < 0)
+		return -1;
+	if (flock(fd, LOCK_EX | LOCK_NB) != 0) {
+		int lockError = errno;
+		close(fd);
+		errno = lockError;
+		return -1;
+	}
+	return fd;
+}
+
+/**
+ * Takes the writer lock if no other process holds it.  The lock is released by the kernel if the process dies, so
+ * a crashed writer can't leave the store without one for long.  Must be called on the dispatchQueue.
+ */
+-(void)standForWriter {
+	if (self.sharedWriter)
+		return;
+	_writerLockFD = [self lockFileAtURL:[[self stagingDirectoryURL] URLByAppendingPathComponent:@"writer.lock"] create:YES];
+	if (_writerLockFD < 0)
+		return;
+	self.sharedWriter = YES;
+	// the previous writer may have added partitions that this process hasn't seen
+	[self loadPartitions:NULL];
+}
+
+-(void)startStagingTimer {
+	NSTimeInterval interval = MAX([self.sharedMergeIntervalSecs doubleValue], 0.1);
+	dispatch_source_t timer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, dispatch_get_global_queue(QOS_CLASS_UTILITY, 0));
+	dispatch_source_set_timer(timer, dispatch_time(DISPATCH_TIME_NOW, (int64_t)(interval * NSEC_PER_SEC)), (uint64_t)(interval * NSEC_PER_SEC), (uint64_t)(interval * NSEC_PER_SEC / 4));
+	__weak BDLogger *weakSelf = self;
+	dispatch_source_set_event_handler(timer, ^(void) {
+		[weakSelf stagingTimerFired];
+	});
+	self.stagingTimer = timer;
+	dispatch_resume(timer);
+}
+
+-(void)stopStagingTimer {
+	if (self.stagingTimer == nil)
+		return;
+	dispatch_source_cancel(self.stagingTimer);
+	self.stagingTimer = nil;
+}
+
+-(void)stagingTimerFired {
+	if (atomic_flag_test_and_set(&_stagingTickScheduled))
+		return;
+	dispatch_block_t block = dispatch_block_create_with_qos_class(DISPATCH_BLOCK_ENFORCE_QOS_CLASS, QOS_CLASS_UTILITY, 0, ^(void) {
+		atomic_flag_clear(&self->_stagingTickScheduled);
+		[self runStagingTick];
+	});
+	dispatch_async(self.dispatchQueue, block);
+}
+
+/**
+ * Hands this process's staged entries over by moving on to a new segment (the merging process never touches a
+ * producer's newest segment while the producer is alive), merges everyone's staged entries if this process is
+ * the writer, and lets go of segments that have been merged.  Must be called on the dispatchQueue.
+ */
+-(void)runStagingTick {
+	if (self.connection == NULL)
+		return;
+
+	BDSegment *current = [[self segments] lastObject];
+	if (current != nil && ![current isEmpty]) {
+		NSError *error = nil;
+		if (![self startSegment:&error])
+			NSLog(@"%@", [error localizedDescription]);
+	}
+
+	[self standForWriter];
+	if (self.sharedWriter)
+		[self mergeStagedSegments];
+	else
+		[self loadPartitions:NULL];
+	[self forgetMergedSegments];
+}
+
+/** Returns the number of the last segment merged for a producer, or 0 if none have been. Must be called on the dispatchQueue. */
+-(sqlite3_int64)lastMergedSegmentForProducer:(NSString *)producerID {
+	sqlite3_int64 lastMerged = 0;
+	sqlite3_stmt *statement;
+	if (sqlite3_prepare_v2(self.connection, "SELECT Z_SEGMENT FROM LOG_STAGING WHERE Z_PRODUCER = ?", -1, &statement, NULL) == SQLITE_OK) {
+		sqlite3_bind_text(statement, 1, [producerID UTF8String], -1, SQLITE_TRANSIENT);
+		if (sqlite3_step(statement) == SQLITE_ROW)
+			lastMerged = sqlite3_column_int64(statement, 0);
+		sqlite3_finalize(statement);
+	}
+	return lastMerged;
+}
+
+/**
+ * Merges the staged segments of every producer into the log store, one transaction per segment, oldest first.
+ * A live producer's newest segment is left alone, as it may still be appending to it; a producer that has gone
+ * away (its staging directory is no longer locked) has all of its segments merged and its directory removed.  A
+ * segment that fails to merge or can't be opened is kept for the next tick, along with everything after it.  Must
+ * be called on the dispatchQueue.
+ */
+-(void)mergeStagedSegments {
+	NSFileManager *fileManager = [NSFileManager defaultManager];
+	NSURL *stagingURL = [self stagingDirectoryURL];
+	for (NSString *producerID in [fileManager contentsOfDirectoryAtPath:[stagingURL path] error:NULL]) {
+		// a producer that died before renaming its directory into place never staged anything
+		if ([producerID hasPrefix:@"."] && [[NSUUID alloc] initWithUUIDString:[producerID substringFromIndex:1]] != nil) {
+			NSURL *temporaryURL = [stagingURL URLByAppendingPathComponent:producerID isDirectory:YES];
+			int abandonedLockFD = [self lockFileAtURL:[temporaryURL URLByAppendingPathComponent:@"producer.lock"] create:NO];
+			if (abandonedLockFD >= 0 || errno == ENOENT)
+				[fileManager removeItemAtURL:temporaryURL error:NULL];
+			if (abandonedLockFD >= 0)
+				close(abandonedLockFD);
+			continue;
+		}
+		// the IDs end up in SQL, so only directories with the names we make are considered
+		if ([[NSUUID alloc] initWithUUIDString:producerID] == nil)
+			continue;
+		NSURL *directoryURL = [stagingURL URLByAppendingPathComponent:producerID isDirectory:YES];
+		BOOL own = [producerID isEqualToString:self.producerID];
+		// a directory is only ever renamed into place with its lock file already held, so one without a lock file at
+		// all is left over from a producer that has long gone
+		int deadLockFD = own ? -1 : [self lockFileAtURL:[directoryURL URLByAppendingPathComponent:@"producer.lock"] create:NO];
+		BOOL alive = own || (deadLockFD < 0 && errno != ENOENT);
+
+		NSMutableArray *names = [NSMutableArray array];
+		for (NSString *name in [fileManager contentsOfDirectoryAtPath:[directoryURL path] error:NULL]) {
+			if ([[name pathExtension] isEqualToString:@"bdseg"])
+				[names addObject:name];
+		}
+		// zero padded, so this is segment order
+		[names sortUsingSelector:@selector(compare:)];
+		if (alive && [names count] > 0)
+			[names removeLastObject];
+
+		sqlite3_int64 lastMerged = [self lastMergedSegmentForProducer:producerID];
+		BOOL merged = YES;
+		for (NSString *name in names) {
+			NSURL *url = [directoryURL URLByAppendingPathComponent:name];
+			sqlite3_int64 number = [[name stringByDeletingPathExtension] longLongValue];
+			if (number > lastMerged) {
+				BDSegment *segment = nil;
+				if (own) {
+					for (BDSegment *candidate in [self segments]) {
+						if (candidate.number == number)
+							segment = candidate;
+					}
+				}
+				NSError *segmentError = nil;
+				if (segment == nil)
+					segment = [[BDSegment alloc] initWithURL:url number:number size:[self.segmentSizeBytes unsignedIntegerValue] error:&segmentError];
+				if (segment == nil) {
+					NSLog(@"Unable to open staged segment %@: %@", [url path], [segmentError localizedDescription]);
+					merged = NO;
+					break;
+				}
+				NSString *sql = [NSString stringWithFormat:@"INSERT INTO LOG_STAGING (Z_PRODUCER, Z_SEGMENT) VALUES ('%@', %lld) "
+				                 "ON CONFLICT (Z_PRODUCER) DO UPDATE SET Z_SEGMENT = excluded.Z_SEGMENT", producerID, number];
+				if (![self moveSegmentIntoStore:segment recording:sql]) {
+					merged = NO;
+					break;
+				}
+				lastMerged = number;
+			}
+			[fileManager removeItemAtURL:url error:NULL];
+		}
+
+		if (!alive) {
+			if (merged) {
+				NSString *sql = [NSString stringWithFormat:@"DELETE FROM LOG_STAGING WHERE Z_PRODUCER = '%@'", producerID];
+				sqlite3_exec(self.connection, [sql UTF8String], NULL, NULL, NULL);
+				[fileManager removeItemAtURL:directoryURL error:NULL];
+			}
+			if (deadLockFD >= 0)
+				close(deadLockFD);
+		}
+	}
+}
+
+/** Drops this process's segments that the writer (whichever process that is) has merged. Must be called on the dispatchQueue. */
+-(void)forgetMergedSegments {
+	NSArray *segments = [self segments];
+	sqlite3_int64 lastMerged = [self lastMergedSegmentForProducer:self.producerID];
+	NSMutableArray *remaining = [NSMutableArray array];
+	for (BDSegment *segment in segments) {
+		if (segment.number > lastMerged || segment == [segments lastObject])
+			[remaining addObject:segment];
+	}
+	if ([remaining count] != [segments count])
+		[self setSegments:remaining];
+}
+
+/**
+ * Gives up the locks.  Unlocking the staging directory marks this process as gone, so whatever it still has staged
+ * is merged by the writer; if that's this process, it does so on the way out.  Must be called on the dispatchQueue.
+ */
+-(void)closeStaging {
+	if (_producerLockFD >= 0) {
+		close(_producerLockFD);
+		_producerLockFD = -1;
+	}
+	if (self.sharedWriter) {
+		[self setSegments:@[]];
+		self.producerID = nil;
+		[self mergeStagedSegments];
+		close(_writerLockFD);
+		_writerLockFD = -1;
+		self.sharedWriter = NO;
+	}
+}
+
+/**
+ * Waits a little before sqlite tries the lock again: 1ms, doubling each attempt up to 64ms, with some jitter so
+ * that processes that collided once don't keep on colliding.  Gives up once busyTimeoutSecs have gone by.
+ */
+-(int)waitForBusyStore:(int)attempts {
+	uint64_t now = BDMetricsMicros();
+	if (attempts == 0)
+		self.busyStartMicros = now;
+	if (now - self.busyStartMicros >= (uint64_t)([self.busyTimeoutSecs doubleValue] * USEC_PER_SEC))
+		return 0;
+	uint32_t delay = 1000u << MIN(attempts, 6);
+	usleep(delay / 2 + arc4random_uniform(delay / 2 + 1));
+	return 1;
+}
+
+#
+#pragma mark - Sinks
+#
+-(void)addSink:(id<BDLogSink>)sink {
+	[self addSink:sink bufferLimit:10000 batchMaxEntries:100 batchLingerSecs:0.25];
+}
+
+-(void)addSink:(id<BDLogSink>)sink bufferLimit:(NSUInteger)bufferLimit batchMaxEntries:(NSUInteger)batchMaxEntries batchLingerSecs:(NSTimeInterval)batchLingerSecs {
+	BDSinkChannel *channel = [[BDSinkChannel alloc] initWithSink:sink bufferLimit:bufferLimit batchMaxEntries:batchMaxEntries batchLingerSecs:batchLingerSecs];
+	[self performOnDispatchQueue:^(void) {
+		self.sinkChannels = [self.sinkChannels arrayByAddingObject:channel];
+	}];
+}
+
+-(void)removeSink:(id<BDLogSink>)sink {
+	__block BDSinkChannel *removed = nil;
+	[self performOnDispatchQueue:^(void) {
+		NSMutableArray *channels = [NSMutableArray array];
+		for (BDSinkChannel *channel in self.sinkChannels) {
+			if (channel.sink == sink)
+				removed = channel;
+			else
+				[channels addObject:channel];
+		}
+		self.sinkChannels = channels;
+	}];
+	// anything it had already been handed still gets delivered
+	[removed flush];
+}
+
+-(void)setShouldNSLog:(BOOL)shouldNSLog {
+	if (shouldNSLog == _shouldNSLog)
+		return;
+	_shouldNSLog = shouldNSLog;
+	if (shouldNSLog)
+		[self addSink:self.consoleSink bufferLimit:10000 batchMaxEntries:100 batchLingerSecs:0];
+	else
+		[self removeSink:self.consoleSink];
+}
+
+-(void)setFilterSeverity:(BDSeverity)filterSeverity {
+	_filterSeverity = filterSeverity;
+	[self updateFilterState];
+}
+
+-(void)setFlightRecorderEnabled:(BOOL)flightRecorderEnabled {
+	_flightRecorderEnabled = flightRecorderEnabled;
+	[self updateFilterState];
+}
+
+-(void)setFlightRecorderSeverity:(BDSeverity)flightRecorderSeverity {
+	_flightRecorderSeverity = flightRecorderSeverity;
+	[self updateFilterState];
+}
+
+/**
+ * Repacks the filter state word (and each category's) after a setting has changed.  Callers on other threads see either the old settings or the new ones, never a mixture.
+ */
+-(void)updateFilterState {
+	BOOL recording = self.flightRecorderEnabled && atomic_load(&_flightRecorder) != NULL;
+	BDSeverity recordSeverity = recording ? self.flightRecorderSeverity : BD_FILTER_NONE;
+	BDFilterStateStore(&_filterState, BDFilterStatePack(self.filterSeverity, recordSeverity));
+
+	os_unfair_lock_lock(&_categoriesLock);
+	for (BDLogCategory *category in [self.categories objectEnumerator]) {
+		BDSeverity filterSeverity = category.filterSeverity == nil ? self.filterSeverity : [category.filterSeverity unsignedIntegerValue];
+		BDFilterStateStore(&category->_filterState, BDFilterStatePack(filterSeverity, recordSeverity));
+	}
+	os_unfair_lock_unlock(&_categoriesLock);
+}
+
+-(BDLogCategory *)categoryNamed:(NSString *)name {
+	os_unfair_lock_lock(&_categoriesLock);
+	BDLogCategory *category = self.categories[name];
+	if (category == nil) {
+		category = [[BDLogCategory alloc] initWithName:name logger:self];
+		self.categories[name] = category;
+	}
+	os_unfair_lock_unlock(&_categoriesLock);
+	[self updateFilterState];
+	return category;
+}
+
+#
+#pragma mark - Ring buffer front end
+#
+/** How long BDRingBufferOverflowBlock waits for the writer to make room before spilling instead */
+#define BD_RING_BLOCK_MAX_USECS 100000
+
+/**
+ * Copies the message into the calling thread's ring buffer.  Returns NO if the entry needs to go via the normal
+ * BDEntry path instead (the message is too long for a ring record, or the ring is full and we're spilling).
+ */
+-(BOOL)submitToRingBuffer:(BDSeverity)severity message:(NSString *)message {
+	BDRing *ring = pthread_getspecific(_ringKey);
+	if (ring == NULL)
+		ring = [self createRingForCurrentThread];
+
+	useconds_t waited = 0;
+	size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	while (head - atomic_load_explicit(&ring->tail, memory_order_acquire) >= ring->capacity) {
+		switch (self.ringBufferOverflowPolicy) {
+			case BDRingBufferOverflowDrop:
+				atomic_fetch_add_explicit(&_ringDropped, 1, memory_order_relaxed);
+				BDMetricsCount(&_metrics.entriesDropped, 1);
+				[self scheduleRingDrain];
+				return YES;
+			case BDRingBufferOverflowSpill:
+				return NO;
+			case BDRingBufferOverflowBlock:
+				// the drain runs on the dispatchQueue, so a sink or callback logging from there would be waiting on
+				// itself, and there's no drain at all while the store is closed; either way, spill instead
+				if (dispatch_get_specific(&BDDispatchQueueKey) == (__bridge void *)self || self.insertStatement == NULL || waited >= BD_RING_BLOCK_MAX_USECS)
+					return NO;
+				[self scheduleRingDrain];
+				usleep(100);
+				waited += 100;
+				break;
+		}
+	}
+
+	BDRingRecord *record = &ring->records[head & (ring->capacity - 1)];
+	NSUInteger length = 0;
+	NSRange remaining = NSMakeRange(0, 0);
+	[message getBytes:record->message maxLength:BD_RING_MESSAGE_BYTES usedLength:&length encoding:NSUTF8StringEncoding options:0 range:NSMakeRange(0, [message length]) remainingRange:&remaining];
+	if (remaining.length != 0)
+		return NO;
+	record->timestamp = CFAbsoluteTimeGetCurrent() + kCFAbsoluteTimeIntervalSince1970;
+	record->severity = (uint32_t)severity;
+	record->length = (uint32_t)length;
+	atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+
+	[self scheduleRingDrain];
+	return YES;
+}
+
+-(BDRing *)createRingForCurrentThread {
+	// capacity has to be a power of two so that we can mask rather than divide
+	size_t capacity = 1;
+	while (capacity < MAX([self.ringBufferCapacity unsignedIntegerValue], 1))
+		capacity <<= 1;
+
+	BDRing *ring = calloc(1, sizeof(BDRing) + capacity * sizeof(BDRingRecord));
+	ring->capacity = capacity;
+	atomic_init(&ring->head, 0);
+	atomic_init(&ring->tail, 0);
+	atomic_init(&ring->abandoned, false);
+
+	BDRing *first = atomic_load(&_rings);
+	do {
+		ring->next = first;
+	} while (!atomic_compare_exchange_weak(&_rings, &first, ring));
+
+	pthread_setspecific(_ringKey, ring);
+	return ring;
+}
+
+static void BDLoggerDrainRings(void *context) {
+	BDLogger *logger = (__bridge_transfer BDLogger *)context;
+	[logger drainRingBuffers];
+}
+
+/** Only one drain is ever outstanding, and scheduling it doesn't need a block to be allocated */
+-(void)scheduleRingDrain {
+	if (atomic_flag_test_and_set(&_ringDrainScheduled))
+		return;
+
+	void *context = (__bridge_retained void *)self;
+	if (self.groupCommit) {
+		dispatch_time_t when = dispatch_time(DISPATCH_TIME_NOW, (int64_t)([self.batchLingerSecs doubleValue] * NSEC_PER_SEC));
+		dispatch_after_f(when, self.dispatchQueue, context, BDLoggerDrainRings);
+	}
+	else {
+		dispatch_async_f(self.dispatchQueue, context, BDLoggerDrainRings);
+	}
+}
+
+/** Writes everything currently sitting in the ring buffers in a single transaction. Must be called on the dispatchQueue. */
+-(void)drainRingBuffers {
+	// clear the flag first so that anything submitted while we're draining schedules another drain
+	atomic_flag_clear(&_ringDrainScheduled);
+	if (self.insertStatement == NULL)
+		return;
+
+	BOOL useTransaction = NO;
+	NSUInteger written = 0;
+	BDRing *previous = NULL;
+	BDRing *ring = atomic_load(&_rings);
+	while (ring != NULL) {
+		BOOL abandoned = atomic_load_explicit(&ring->abandoned, memory_order_acquire);
+		size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+		size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+		if (tail != head && written == 0)
+			useTransaction = [self beginBatch];
+		for (; tail != head; tail++) {
+			BDRingRecord *record = &ring->records[tail & (ring->capacity - 1)];
+			if ([self.sinkChannels count] > 0) {
+				BDEntry *entry = [self entryFromRingRecord:record];
+				for (BDSinkChannel *channel in self.sinkChannels) {
+					[channel submitEntry:entry];
+				}
+			}
+			if (![self insertTimestamp:record->timestamp severity:record->severity messageBytes:record->message length:record->length userInfoData:nil userInfo:nil])
+				NSLog(@"%@", [[self entryFromRingRecord:record] description]);
+			else if ([self.tailObservers count] > 0)
+				[self entryWritten:[self entryFromRingRecord:record]];
+			else if (_recentCapacity > 0)
+				[self recordWritten:record];
+			written++;
+		}
+		atomic_store_explicit(&ring->tail, tail, memory_order_release);
+
+		BDRing *next = ring->next;
+		if (abandoned) {
+			// the owning thread has gone away and everything it wrote has been drained, so unlink and free it.
+			// Producers only ever push onto the front of the list, so only that case needs a compare-and-swap.
+			BDRing *expected = ring;
+			if (previous != NULL)
+				previous->next = next;
+			else if (!atomic_compare_exchange_strong(&_rings, &expected, next)) {
+				for (previous = atomic_load(&_rings); previous->next != ring; previous = previous->next)
+					;
+				previous->next = next;
+			}
+			free(ring);
+		}
+		else {
+			previous = ring;
+		}
+		ring = next;
+	}
+
+	unsigned long dropped = atomic_exchange(&_ringDropped, 0);
+	if (dropped > 0) {
+		BDEntry *warning = [[BDEntry alloc] init];
+		warning.severity = BDSeverityWarning;
+		warning.message = [NSString stringWithFormat:@"Log ring buffer overflowed; %lu entries were dropped", dropped];
+		// like any other entry, so that the sinks hear about it too
+		[self log:warning];
+	}
+
+	if (written > 0)
+		BDHistogramRecord(&_metrics.batchSize, written);
+	if (useTransaction && ![self commitBatch])
+		NSLog(@"%lu log entries from the ring buffers were lost", (unsigned long)written);
+}
+
+-(BDEntry *)entryFromRingRecord:(BDRingRecord *)record {
+	BDEntry *entry = [[BDEntry alloc] init];
+	entry.timestamp = [NSDate dateWithTimeIntervalSince1970:record->timestamp];
+	entry.severity = record->severity;
+	entry.message = [[NSString alloc] initWithBytes:record->message length:record->length encoding:NSUTF8StringEncoding];
+	return entry;
+}
+
+#
+#pragma mark - Retrieving entries
+#
+-(NSArray *)retrieveBetweenStart:(NSDate *)startDate end:(NSDate *)endDate severity:(BDSeverity)severity error:(NSError **)error {
+	return [self retrieveBetweenStart:startDate end:endDate severity:severity maxEntries:NSUIntegerMax ascending:YES error:error];
+}
+
+-(NSArray *)retrieveRecent:(NSUInteger)entryCount severity:(BDSeverity)severity error:(NSError **)error {
+	NSArray *cached = [self cachedRecent:entryCount severity:severity];
+	if (cached != nil)
+		return cached;
+	return [self retrieveBetweenStart:nil end:nil severity:severity maxEntries:entryCount ascending:NO error:error];
+}
+
+-(NSArray *)retrieveBetweenStart:(NSDate *)startDate end:(NSDate *)endDate severity:(BDSeverity)severity maxEntries:(NSUInteger)maxEntries ascending:(BOOL)ascending error:(NSError **)error {
+	NSMutableArray *entries = [NSMutableArray array];
+	BOOL success = [self enumerateEntriesBetweenStart:startDate end:endDate severity:severity maxEntries:maxEntries ascending:ascending error:error usingBlock:^(BDEntry *entry, BOOL *stop) {
+		[entries addObject:entry];
+	}];
+	return success ? entries : nil;
+}
+
+-(BOOL)enumerateEntriesBetweenStart:(NSDate *)startDate end:(NSDate *)endDate severity:(BDSeverity)severity ascending:(BOOL)ascending error:(NSError **)error usingBlock:(void (^)(BDEntry *entry, BOOL *stop))block {
+	return [self enumerateEntriesBetweenStart:startDate end:endDate severity:severity maxEntries:NSUIntegerMax ascending:ascending error:error usingBlock:block];
+}
+
+-(BOOL)enumerateEntriesBetweenStart:(NSDate *)startDate end:(NSDate *)endDate severity:(BDSeverity)severity maxEntries:(NSUInteger)maxEntries ascending:(BOOL)ascending error:(NSError **)error usingBlock:(void (^)(BDEntry *entry, BOOL *stop))block {
+	return [self enumerateRowsBetweenStart:startDate end:endDate severity:severity maxEntries:maxEntries ascending:ascending error:error usingBlock:^(BDLogRow *row, BOOL *stop) {
+		block([row entry], stop);
+	}];
+}
+
+-(BOOL)enumerateRowsBetweenStart:(NSDate *)startDate end:(NSDate *)endDate severity:(BDSeverity)severity ascending:(BOOL)ascending error:(NSError **)error usingBlock:(void (^)(BDLogRow *row, BOOL *stop))block {
+	return [self enumerateRowsBetweenStart:startDate end:endDate severity:severity maxEntries:NSUIntegerMax ascending:ascending error:error usingBlock:block];
+}
+
+-(BOOL)enumerateRowsBetweenStart:(NSDate *)startDate end:(NSDate *)endDate severity:(BDSeverity)severity maxEntries:(NSUInteger)maxEntries ascending:(BOOL)ascending error:(NSError **)error usingBlock:(void (^)(BDLogRow *row, BOOL *stop))block {
+	__block BOOL success = YES;
+	CFAbsoluteTime requestTime = CFAbsoluteTimeGetCurrent();
+	dispatch_sync(self.readQueue, ^(void) {
+		success = [self readRowsBetweenStart:startDate end:endDate severity:severity maxEntries:maxEntries ascending:ascending requestTime:requestTime error:error usingBlock:block];
+	});
+	return success;
+}
+
+-(BDRetrievalHandle *)retrieveRecent:(NSUInteger)entryCount severity:(BDSeverity)severity pageSize:(NSUInteger)pageSize queue:(dispatch_queue_t)queue pageHandler:(void (^)(NSArray *entries, BOOL finished, NSError *error))pageHandler {
+	return [self retrieveBetweenStart:nil end:nil severity:severity maxEntries:entryCount ascending:NO pageSize:pageSize queue:queue pageHandler:pageHandler];
+}
+
+-(BDRetrievalHandle *)retrieveBetweenStart:(NSDate *)startDate end:(NSDate *)endDate severity:(BDSeverity)severity maxEntries:(NSUInteger)maxEntries ascending:(BOOL)ascending pageSize:(NSUInteger)pageSize queue:(dispatch_queue_t)queue pageHandler:(void (^)(NSArray *entries, BOOL finished, NSError *error))pageHandler {
+	BDRetrievalHandle *handle = [[BDRetrievalHandle alloc] init];
+	NSUInteger entriesPerPage = MAX(pageSize, 1);
+	CFAbsoluteTime requestTime = CFAbsoluteTimeGetCurrent();
+	dispatch_async(self.readQueue, ^(void) {
+		// cancelled while it was still waiting behind other retrievals
+		if (handle.cancelled)
+			return;
+
+		void (^deliver)(NSArray *, BOOL, NSError *) = ^(NSArray *entries, BOOL finished, NSError *error) {
+			dispatch_async(queue, ^(void) {
+				if (!handle.cancelled)
+					pageHandler(entries, finished, error);
+			});
+		};
+		__block NSMutableArray *page = [NSMutableArray array];
+		NSError *error = nil;
+		[handle beginQueryOnConnection:self.readConnection];
+		BOOL success = [self readRowsBetweenStart:startDate end:endDate severity:severity maxEntries:maxEntries ascending:ascending requestTime:requestTime error:&error usingBlock:^(BDLogRow *row, BOOL *stop) {
+			[page addObject:[row entry]];
+			if ([page count] == entriesPerPage) {
+				deliver(page, NO, nil);
+				page = [NSMutableArray array];
+			}
+			*stop = handle.cancelled;
+		}];
+		[handle endQuery];
+		if (!handle.cancelled)
+			deliver(page, YES, success ? nil : error);
+	});
+	return handle;
+}
+
+/** Does the work of enumerating rows, for both the synchronous and asynchronous retrievals. Must be called on the readQueue. */
+-(BOOL)readRowsBetweenStart:(NSDate *)startDate end:(NSDate *)endDate severity:(BDSeverity)severity maxEntries:(NSUInteger)maxEntries ascending:(BOOL)ascending requestTime:(CFAbsoluteTime)requestTime error:(NSError **)error usingBlock:(void (^)(BDLogRow *row, BOOL *stop))block {
+	CFAbsoluteTime startTime = CFAbsoluteTimeGetCurrent();
+
+	NSTimeInterval startTimeInterval = startDate == nil ? 0 : [startDate timeIntervalSince1970];
+	NSTimeInterval endTimeInterval   = endDate == nil ? [[NSDate date] timeIntervalSince1970] : [endDate timeIntervalSince1970];
+	NSString *sql = @"SELECT Z_TIMESTAMP, Z_SEVERITY, Z_MESSAGE, Z_USERINFO FROM LOG_ENTRIES{P} WHERE Z_TIMESTAMP BETWEEN ?1 AND ?2 AND Z_SEVERITY <= ?3";
+	NSString *orderBy = ascending ? @"Z_TIMESTAMP ASC" : @"Z_TIMESTAMP DESC";
+
+	// entries still waiting in segments are merged in by timestamp with those coming out of the store
+	BDSegmentCursor *cursor = [self segmentCursorBetweenStart:startTimeInterval end:endTimeInterval severity:severity ascending:ascending maxEntries:maxEntries];
+	// the one row is pointed at each entry in turn, whether it comes from the store or from a segment
+	BDLogRow *row = [[BDLogRow alloc] initWithLogger:self];
+	__block NSUInteger delivered = 0;
+	__block BOOL stopped = NO;
+	void (^deliver)(void) = ^(void) {
+		block(row, &stopped);
+		delivered++;
+	};
+	BOOL success = [self queryPartitionsWithSQL:sql orderBy:orderBy start:startTimeInterval end:endTimeInterval severity:severity maxEntries:maxEntries requiring:nil error:error bind:nil usingBlock:^(sqlite3_stmt *statement, BOOL *stop) {
+		NSTimeInterval timestamp = sqlite3_column_double(statement, 0);
+		while (!stopped && delivered < maxEntries && [cursor hasEntryBefore:timestamp]) {
+			@autoreleasepool {
+				[row loadFromSegmentRecord:[cursor next]];
+				deliver();
+			}
+		}
+		// each row's objects are released as soon as the block is done with them, so memory stays flat
+		@autoreleasepool {
+			if (!stopped && delivered < maxEntries) {
+				[row loadFromStatement:statement];
+				deliver();
+			}
+		}
+		*stop = stopped || delivered >= maxEntries;
+	}];
+	while (success && !stopped && delivered < maxEntries && [cursor hasEntryBefore:ascending ? DBL_MAX : -DBL_MAX]) {
+		@autoreleasepool {
+			[row loadFromSegmentRecord:[cursor next]];
+			deliver();
+		}
+	}
+	// a cancelled retrieval's interrupt can land on the COMMIT, and a read transaction left open would pin the
+	// connection to an old snapshot of the store
+	if (cursor != nil && sqlite3_exec(self.readConnection, "COMMIT", NULL, NULL, NULL) != SQLITE_OK && !sqlite3_get_autocommit(self.readConnection))
+		sqlite3_exec(self.readConnection, "ROLLBACK", NULL, NULL, NULL);
+
+	[self recordRetrievalWait:startTime - requestTime query:CFAbsoluteTimeGetCurrent() - startTime];
+	return success;
+}
+
+-(NSArray *)searchEntriesMatching:(NSString *)query betweenStart:(NSDate *)startDate end:(NSDate *)endDate severity:(BDSeverity)severity maxEntries:(NSUInteger)maxEntries ranked:(BOOL)ranked error:(NSError **)error {
+	NSMutableArray *entries = [NSMutableArray array];
+	__block BOOL success = YES;
+	CFAbsoluteTime requestTime = CFAbsoluteTimeGetCurrent();
+	dispatch_sync(self.readQueue, ^(void) {
+		CFAbsoluteTime startTime = CFAbsoluteTimeGetCurrent();
+
+		NSTimeInterval startTimeInterval = startDate == nil ? 0 : [startDate timeIntervalSince1970];
+		NSTimeInterval endTimeInterval   = endDate == nil ? [[NSDate date] timeIntervalSince1970] : [endDate timeIntervalSince1970];
+		NSString *sql = @"SELECT LOG_ENTRIES{P}.Z_TIMESTAMP AS Z_TIMESTAMP, LOG_ENTRIES{P}.Z_SEVERITY, LOG_ENTRIES{P}.Z_MESSAGE, LOG_ENTRIES{P}.Z_USERINFO, bm25(LOG_FTS{P}) AS Z_RANK "
+		                  "FROM LOG_FTS{P} JOIN LOG_ENTRIES{P} ON LOG_ENTRIES{P}.rowid = LOG_FTS{P}.rowid "
+		                  "WHERE LOG_FTS{P} MATCH ?5 AND LOG_ENTRIES{P}.Z_TIMESTAMP BETWEEN ?1 AND ?2 AND LOG_ENTRIES{P}.Z_SEVERITY <= ?3";
+		if (!ranked) {
+			success = [self queryPartitionsWithSQL:sql orderBy:@"Z_TIMESTAMP DESC" start:startTimeInterval end:endTimeInterval severity:severity maxEntries:maxEntries requiring:@"LOG_FTS" error:error bind:^(sqlite3_stmt *statement) {
+				sqlite3_bind_text(statement, 5, [query UTF8String], -1, SQLITE_TRANSIENT);
+			} usingBlock:^(sqlite3_stmt *statement, BOOL *stop) {
+				[entries addObject:[self entryFromStatement:statement]];
+			}];
+		}
+		else {
+			// bm25() scores better matches lower, and most recent first breaks ties.  Each batch of partitions gives
+			// its own best matches (limited by ?6 rather than ?4, which would only leave the first batch any), and
+			// those are merged here.
+			NSMutableArray *ranks = [NSMutableArray array];
+			NSString *compound = @"{U} ORDER BY Z_RANK ASC, Z_TIMESTAMP DESC LIMIT ?6";
+			success = [self queryPartitionsWithSQL:sql compound:compound start:startTimeInterval end:endTimeInterval severity:severity maxEntries:NSUIntegerMax requiring:@"LOG_FTS" error:error bind:^(sqlite3_stmt *statement) {
+				sqlite3_bind_text(statement, 5, [query UTF8String], -1, SQLITE_TRANSIENT);
+				sqlite3_bind_int64(statement, 6, maxEntries > INT64_MAX ? -1 : (sqlite3_int64)maxEntries);
+			} usingBlock:^(sqlite3_stmt *statement, BOOL *stop) {
+				[ranks addObject:@[ @(sqlite3_column_double(statement, 4)), [self entryFromStatement:statement] ]];
+			}];
+			[ranks sortWithOptions:NSSortStable usingComparator:^NSComparisonResult(NSArray *a, NSArray *b) {
+				NSComparisonResult result = [a[0] compare:b[0]];
+				return result != NSOrderedSame ? result : [((BDEntry *)b[1]).timestamp compare:((BDEntry *)a[1]).timestamp];
+			}];
+			for (NSUInteger i = 0; i < MIN([ranks count], maxEntries); i++)
+				[entries addObject:ranks[i][1]];
+		}
+
+		[self recordRetrievalWait:startTime - requestTime query:CFAbsoluteTimeGetCurrent() - startTime];
+	});
+	return success ? entries : nil;
+}
+
+-(NSArray *)retrieveWithUserInfoKey:(NSString *)key value:(id)value betweenStart:(NSDate *)startDate end:(NSDate *)endDate severity:(BDSeverity)severity maxEntries:(NSUInteger)maxEntries ascending:(BOOL)ascending error:(NSError **)error {
+	NSMutableArray *entries = [NSMutableArray array];
+	__block BOOL success = YES;
+	CFAbsoluteTime requestTime = CFAbsoluteTimeGetCurrent();
+	dispatch_sync(self.readQueue, ^(void) {
+		CFAbsoluteTime startTime = CFAbsoluteTimeGetCurrent();
+
+		NSTimeInterval startTimeInterval = startDate == nil ? 0 : [startDate timeIntervalSince1970];
+		NSTimeInterval endTimeInterval   = endDate == nil ? [[NSDate date] timeIntervalSince1970] : [endDate timeIntervalSince1970];
+		// the (Z_KEY, Z_VALUE, Z_ENTRY) index covers the lookup, leaving just a rowid fetch per matching entry
+		NSString *sql = @"SELECT LOG_ENTRIES{P}.Z_TIMESTAMP AS Z_TIMESTAMP, LOG_ENTRIES{P}.Z_SEVERITY, LOG_ENTRIES{P}.Z_MESSAGE, LOG_ENTRIES{P}.Z_USERINFO "
+		                  "FROM LOG_FIELDS{P} JOIN LOG_ENTRIES{P} ON LOG_ENTRIES{P}.rowid = LOG_FIELDS{P}.Z_ENTRY "
+		                  "WHERE LOG_FIELDS{P}.Z_KEY = ?5 AND LOG_FIELDS{P}.Z_VALUE = ?6 AND LOG_ENTRIES{P}.Z_TIMESTAMP BETWEEN ?1 AND ?2 AND LOG_ENTRIES{P}.Z_SEVERITY <= ?3";
+		NSString *orderBy = ascending ? @"Z_TIMESTAMP ASC" : @"Z_TIMESTAMP DESC";
+		success = [self queryPartitionsWithSQL:sql orderBy:orderBy start:startTimeInterval end:endTimeInterval severity:severity maxEntries:maxEntries requiring:@"LOG_FIELDS" error:error bind:^(sqlite3_stmt *statement) {
+			sqlite3_bind_text(statement, 5, [key UTF8String], -1, SQLITE_TRANSIENT);
+			if (!BDBindFieldValue(statement, 6, value))
+				sqlite3_bind_null(statement, 6);
+		} usingBlock:^(sqlite3_stmt *statement, BOOL *stop) {
+			[entries addObject:[self entryFromStatement:statement]];
+		}];
+
+		[self recordRetrievalWait:startTime - requestTime query:CFAbsoluteTimeGetCurrent() - startTime];
+	});
+	return success ? entries : nil;
+}
+
+-(NSUInteger)countEntriesWithFormat:(NSString *)format betweenStart:(NSDate *)startDate end:(NSDate *)endDate severity:(BDSeverity)severity error:(NSError **)error {
+	if (!self.templateInterning) {
+		if (error != NULL) {
+			NSString *message = @"Counting entries by format needs templateInterning to be turned on";
+			*error = [NSError errorWithDomain:BD_ERROR_DOMAIN code:SQLITE_MISUSE userInfo:@{ NSLocalizedDescriptionKey : message }];
+		}
+		return NSNotFound;
+	}
+
+	__block NSUInteger count = 0;
+	__block BOOL success = YES;
+	CFAbsoluteTime requestTime = CFAbsoluteTimeGetCurrent();
+	dispatch_sync(self.readQueue, ^(void) {
+		CFAbsoluteTime startTime = CFAbsoluteTimeGetCurrent();
+
+		sqlite3_int64 templateID = 0;
+		sqlite3_stmt *statement;
+		if (sqlite3_prepare_v2(self.readConnection, "SELECT Z_ID FROM LOG_TEMPLATES WHERE Z_FORMAT = ?", -1, &statement, NULL) == SQLITE_OK) {
+			sqlite3_bind_text(statement, 1, [format UTF8String], -1, SQLITE_TRANSIENT);
+			if (sqlite3_step(statement) == SQLITE_ROW)
+				templateID = sqlite3_column_int64(statement, 0);
+			sqlite3_finalize(statement);
+		}
+		// a format that has never been logged has no template, and so no entries
+		if (templateID == 0)
+			return;
+
+		NSTimeInterval startTimeInterval = startDate == nil ? 0 : [startDate timeIntervalSince1970];
+		NSTimeInterval endTimeInterval   = endDate == nil ? [[NSDate date] timeIntervalSince1970] : [endDate timeIntervalSince1970];
+		NSString *sql = @"SELECT COUNT(*) AS Z_COUNT FROM LOG_ENTRIES{P} WHERE Z_TEMPLATE = ?5 AND Z_TIMESTAMP BETWEEN ?1 AND ?2 AND Z_SEVERITY <= ?3";
+		success = [self queryPartitionsWithSQL:sql orderBy:@"Z_COUNT" start:startTimeInterval end:endTimeInterval severity:severity maxEntries:NSUIntegerMax requiring:nil error:error bind:^(sqlite3_stmt *statement) {
+			sqlite3_bind_int64(statement, 5, templateID);
+		} usingBlock:^(sqlite3_stmt *statement, BOOL *stop) {
+			count += sqlite3_column_int64(statement, 0);
+		}];
+
+		[self recordRetrievalWait:startTime - requestTime query:CFAbsoluteTimeGetCurrent() - startTime];
+	});
+	return success ? count : NSNotFound;
+}
+
+#
+#pragma mark - Aggregates
+#
+-(NSData *)severityCountsBetweenStart:(NSDate *)startDate end:(NSDate *)endDate bucketSecs:(NSTimeInterval)bucketSecs error:(NSError **)error {
+	if (!(bucketSecs > 0)) {
+		if (error != NULL) {
+			NSString *message = [NSString stringWithFormat:@"Unable to count entries in buckets of %g seconds", bucketSecs];
+			*error = [NSError errorWithDomain:BD_ERROR_DOMAIN code:SQLITE_MISUSE userInfo:@{ NSLocalizedDescriptionKey : message }];
+		}
+		return nil;
+	}
+
+	NSMutableData *buckets = [NSMutableData data];
+	__block BOOL success = YES;
+	CFAbsoluteTime requestTime = CFAbsoluteTimeGetCurrent();
+	dispatch_sync(self.readQueue, ^(void) {
+		CFAbsoluteTime startTime = CFAbsoluteTimeGetCurrent();
+
+		NSTimeInterval startTimeInterval = startDate == nil ? 0 : [startDate timeIntervalSince1970];
+		NSTimeInterval endTimeInterval   = endDate == nil ? [[NSDate date] timeIntervalSince1970] : [endDate timeIntervalSince1970];
+		// rows arrive ordered by bucket, but the same bucket can turn up once for each partition holding some of it
+		__block sqlite3_int64 lastBucket = INT64_MIN;
+		void (^accumulate)(sqlite3_int64, BDSeverity, uint64_t) = ^(sqlite3_int64 bucket, BDSeverity severity, uint64_t count) {
+			if (severity > BDSeverityDebug)
+				return;
+			if (bucket != lastBucket) {
+				BDSeverityCounts counts = { .start = bucket * bucketSecs };
+				[buckets appendBytes:&counts length:sizeof(counts)];
+				lastBucket = bucket;
+			}
+			BDSeverityCounts *counts = (BDSeverityCounts *)[buckets mutableBytes] + ([buckets length] / sizeof(BDSeverityCounts) - 1);
+			counts->counts[severity] += (uint32_t)count;
+		};
+
+		if (self.rollupEnabled && fmod(bucketSecs, 60) == 0) {
+			NSString *sql = @"SELECT CAST(Z_BUCKET / ?3 AS INTEGER), Z_SEVERITY, SUM(Z_COUNT) FROM LOG_ROLLUP WHERE Z_BUCKET BETWEEN ?1 AND ?2 GROUP BY 1, 2 ORDER BY 1, 2";
+			sqlite3_stmt *statement = [self readStatementForSQL:sql error:error];
+			if (statement == NULL) {
+				success = NO;
+				return;
+			}
+			sqlite3_bind_int64(statement, 1, (sqlite3_int64)floor(startTimeInterval / 60));
+			sqlite3_bind_int64(statement, 2, (sqlite3_int64)floor(endTimeInterval / 60));
+			sqlite3_bind_int64(statement, 3, (sqlite3_int64)(bucketSecs / 60));
+			while (sqlite3_step(statement) == SQLITE_ROW) {
+				accumulate(sqlite3_column_int64(statement, 0), sqlite3_column_int(statement, 1), sqlite3_column_int64(statement, 2));
+			}
+			NSUInteger rc = sqlite3_reset(statement);
+			sqlite3_clear_bindings(statement);
+			if (rc != SQLITE_OK) {
+				if (error != NULL) {
+					NSString *message = [NSString stringWithFormat:@"Unable to count entries (rc=%d): %s", rc, sqlite3_errmsg(self.readConnection)];
+					*error = [NSError errorWithDomain:BD_ERROR_DOMAIN code:rc userInfo:@{ NSLocalizedDescriptionKey : message }];
+				}
+				success = NO;
+			}
+		}
+		else {
+			// only Z_TIMESTAMP and Z_SEVERITY are needed, so this is answered from the timestamp index alone
+			NSString *sql = @"SELECT CAST(Z_TIMESTAMP / ?5 AS INTEGER) AS Z_BUCKET, Z_SEVERITY, COUNT(*) FROM LOG_ENTRIES{P} WHERE Z_TIMESTAMP BETWEEN ?1 AND ?2 AND Z_SEVERITY <= ?3 GROUP BY 1, 2";
+			success = [self queryPartitionsWithSQL:sql orderBy:@"1, 2" start:startTimeInterval end:endTimeInterval severity:BDSeverityDebug maxEntries:NSUIntegerMax requiring:nil error:error bind:^(sqlite3_stmt *statement) {
+				sqlite3_bind_double(statement, 5, bucketSecs);
+			} usingBlock:^(sqlite3_stmt *statement, BOOL *stop) {
+				accumulate(sqlite3_column_int64(statement, 0), sqlite3_column_int(statement, 1), sqlite3_column_int64(statement, 2));
+			}];
+		}
+
+		[self recordRetrievalWait:startTime - requestTime query:CFAbsoluteTimeGetCurrent() - startTime];
+	});
+	return success ? buckets : nil;
+}
+
+-(NSArray *)topMessagesBetweenStart:(NSDate *)startDate end:(NSDate *)endDate severity:(BDSeverity)severity maxMessages:(NSUInteger)maxMessages error:(NSError **)error {
+	NSMutableArray *messageCounts = [NSMutableArray array];
+	__block BOOL success = YES;
+	CFAbsoluteTime requestTime = CFAbsoluteTimeGetCurrent();
+	dispatch_sync(self.readQueue, ^(void) {
+		CFAbsoluteTime startTime = CFAbsoluteTimeGetCurrent();
+
+		NSTimeInterval startTimeInterval = startDate == nil ? 0 : [startDate timeIntervalSince1970];
+		NSTimeInterval endTimeInterval   = endDate == nil ? [[NSDate date] timeIntervalSince1970] : [endDate timeIntervalSince1970];
+		// templated entries are grouped by their template id, everything else by the stored message
+		NSString *sql = [NSString stringWithFormat:@"SELECT %@ AS Z_KEY, COUNT(*) AS Z_COUNT FROM LOG_ENTRIES{P} WHERE Z_TIMESTAMP BETWEEN ?1 AND ?2 AND Z_SEVERITY <= ?3 GROUP BY 1",
+		                 self.templateInterning ? @"COALESCE(Z_TEMPLATE, Z_MESSAGE)" : @"Z_MESSAGE"];
+		// no LIMIT here: a message's count is only known once its compressed and plain groups (and those from every
+		// batch of partitions) have been merged below, so it is only cut down to maxMessages after that
+		NSString *compound = @"SELECT Z_KEY, SUM(Z_COUNT) FROM ({U}) GROUP BY Z_KEY";
+		NSMutableDictionary *countsByMessage = [NSMutableDictionary dictionary];
+		success = [self queryPartitionsWithSQL:sql compound:compound start:startTimeInterval end:endTimeInterval severity:severity maxEntries:NSUIntegerMax requiring:nil error:error bind:nil usingBlock:^(sqlite3_stmt *statement, BOOL *stop) {
+			NSString *message = nil;
+			BOOL templated = NO;
+			if (sqlite3_column_type(statement, 0) == SQLITE_INTEGER) {
+				message = [self formatForTemplateID:sqlite3_column_int64(statement, 0)];
+				templated = YES;
+			}
+			else if (sqlite3_column_type(statement, 0) == SQLITE_BLOB) {
+				const void *bytes = sqlite3_column_blob(statement, 0);
+				NSUInteger length = sqlite3_column_bytes(statement, 0);
+				if (BDIsTemplated(bytes, length)) {
+					message = [self messageFromTemplatedBytes:bytes length:length];
+				}
+				else {
+					NSData *messageData = BDIsCompressed(bytes, length) ? BDDecompressBytes(bytes, length) : nil;
+					message = messageData == nil ? nil : [[NSString alloc] initWithData:messageData encoding:NSUTF8StringEncoding];
+				}
+			}
+			else {
+				message = [[NSString alloc] initWithBytes:sqlite3_column_text(statement, 0) length:sqlite3_column_bytes(statement, 0) encoding:NSUTF8StringEncoding];
+			}
+			if (message == nil)
+				message = @"";
+
+			// the same message can be stored both compressed and not, so the groups are merged once decoded
+			NSString *key = templated ? [@"T" stringByAppendingString:message] : [@"M" stringByAppendingString:message];
+			BDMessageCount *messageCount = countsByMessage[key];
+			if (messageCount == nil) {
+				messageCount = [[BDMessageCount alloc] init];
+				messageCount.message = message;
+				messageCount.templated = templated;
+				countsByMessage[key] = messageCount;
+				[messageCounts addObject:messageCount];
+			}
+			messageCount.count += sqlite3_column_int64(statement, 1);
+		}];
+		[messageCounts sortWithOptions:NSSortStable usingComparator:^NSComparisonResult(BDMessageCount *a, BDMessageCount *b) {
+			return a.count == b.count ? NSOrderedSame : a.count > b.count ? NSOrderedAscending : NSOrderedDescending;
+		}];
+		if ([messageCounts count] > maxMessages)
+			[messageCounts removeObjectsInRange:NSMakeRange(maxMessages, [messageCounts count] - maxMessages)];
+
+		[self recordRetrievalWait:startTime - requestTime query:CFAbsoluteTimeGetCurrent() - startTime];
+	});
+	return success ? messageCounts : nil;
+}
+
+-(BDEntrySpan)spanOfEntriesBetweenStart:(NSDate *)startDate end:(NSDate *)endDate severity:(BDSeverity)severity error:(NSError **)error {
+	__block BDEntrySpan span = { 0, 0, 0 };
+	CFAbsoluteTime requestTime = CFAbsoluteTimeGetCurrent();
+	dispatch_sync(self.readQueue, ^(void) {
+		CFAbsoluteTime startTime = CFAbsoluteTimeGetCurrent();
+		void (^accumulate)(sqlite3_stmt *) = ^(sqlite3_stmt *statement) {
+			uint64_t count = sqlite3_column_int64(statement, 2);
+			if (count == 0)
+				return;
+			NSTimeInterval first = sqlite3_column_double(statement, 0);
+			NSTimeInterval last = sqlite3_column_double(statement, 1);
+			span.first = span.count == 0 ? first : MIN(span.first, first);
+			span.last = span.count == 0 ? last : MAX(span.last, last);
+			span.count += count;
+		};
+
+		BOOL success = YES;
+		if (self.rollupEnabled && startDate == nil && endDate == nil) {
+			NSString *sql = @"SELECT MIN(Z_FIRST), MAX(Z_LAST), SUM(Z_COUNT) FROM LOG_ROLLUP WHERE Z_SEVERITY <= ?";
+			sqlite3_stmt *statement = [self readStatementForSQL:sql error:error];
+			success = statement != NULL;
+			if (success) {
+				sqlite3_bind_int(statement, 1, severity);
+				if (sqlite3_step(statement) == SQLITE_ROW)
+					accumulate(statement);
+				NSUInteger rc = sqlite3_reset(statement);
+				sqlite3_clear_bindings(statement);
+				if (rc != SQLITE_OK && error != NULL) {
+					NSString *message = [NSString stringWithFormat:@"Unable to retrieve entries (rc=%d): %s", rc, sqlite3_errmsg(self.readConnection)];
+					*error = [NSError errorWithDomain:BD_ERROR_DOMAIN code:rc userInfo:@{ NSLocalizedDescriptionKey : message }];
+				}
+				success = rc == SQLITE_OK;
+			}
+		}
+		else {
+			NSTimeInterval startTimeInterval = startDate == nil ? 0 : [startDate timeIntervalSince1970];
+			NSTimeInterval endTimeInterval   = endDate == nil ? [[NSDate date] timeIntervalSince1970] : [endDate timeIntervalSince1970];
+			NSString *sql = @"SELECT MIN(Z_TIMESTAMP), MAX(Z_TIMESTAMP), COUNT(*) FROM LOG_ENTRIES{P} WHERE Z_TIMESTAMP BETWEEN ?1 AND ?2 AND Z_SEVERITY <= ?3";
+			success = [self queryPartitionsWithSQL:sql orderBy:@"1" start:startTimeInterval end:endTimeInterval severity:severity maxEntries:NSUIntegerMax requiring:nil error:error bind:nil usingBlock:^(sqlite3_stmt *statement, BOOL *stop) {
+				accumulate(statement);
+			}];
+		}
+		if (!success)
+			span = (BDEntrySpan){ 0, 0, 0 };
+
+		[self recordRetrievalWait:startTime - requestTime query:CFAbsoluteTimeGetCurrent() - startTime];
+	});
+	return span;
+}
+
+/**
+ * Runs a retrieval across every partition that overlaps the time range, handing each resulting row to the block.
+ * The SQL is a single SELECT written against LOG_ENTRIES{P} (and any companion tables, also suffixed with {P}).
+ * It is repeated for each partition with {P} replaced by the partition's suffix and the copies joined with
+ * UNION ALL, so that sqlite merges the already-ordered partitions rather than sorting.  Parameters are numbered
+ * so the same bindings work however many partitions are involved: ?1 start, ?2 end, ?3 severity and ?4 the limit,
+ * with anything from ?5 onwards left to the bind block.  If a companion is given, partitions that don't have that
+ * companion table are skipped.  An orderBy ending in DESC is taken to mean newest first.  Must be called on the
+ * readQueue.
+ */
+-(BOOL)queryPartitionsWithSQL:(NSString *)sql orderBy:(NSString *)orderBy start:(NSTimeInterval)start end:(NSTimeInterval)end severity:(BDSeverity)severity maxEntries:(NSUInteger)maxEntries requiring:(NSString *)companion error:(NSError **)error bind:(void (^)(sqlite3_stmt *statement))bind usingBlock:(void (^)(sqlite3_stmt *statement, BOOL *stop))block {
+	NSString *compound = [NSString stringWithFormat:@"{U} ORDER BY %@ LIMIT ?4", orderBy];
+	BOOL descending = [[orderBy uppercaseString] hasSuffix:@" DESC"];
+	return [self queryPartitionsWithSQL:sql compound:compound start:start end:end severity:severity maxEntries:maxEntries descending:descending requiring:companion error:error bind:bind usingBlock:block];
+}
+
+/**
+ * As above, but rather than just being ordered and limited, the partitions' UNION ALL is substituted for {U} in the
+ * compound SQL, eg. to aggregate over it.
+ */
+-(BOOL)queryPartitionsWithSQL:(NSString *)sql compound:(NSString *)compound start:(NSTimeInterval)start end:(NSTimeInterval)end severity:(BDSeverity)severity maxEntries:(NSUInteger)maxEntries requiring:(NSString *)companion error:(NSError **)error bind:(void (^)(sqlite3_stmt *statement))bind usingBlock:(void (^)(sqlite3_stmt *statement, BOOL *stop))block {
+	return [self queryPartitionsWithSQL:sql compound:compound start:start end:end severity:severity maxEntries:maxEntries descending:NO requiring:companion error:error bind:bind usingBlock:block];
+}
+
+/**
+ * Does the work for both of the above.  More than BD_MAX_COMPOUND_PARTITIONS partitions are queried in batches of
+ * consecutive partitions, oldest batch first (or newest first if descending), with ?1 and ?2 narrowed to just the
+ * time each batch covers and ?4 to whatever is left of the limit.  Partitions never overlap each other, so ordered
+ * rows still come out in order, and an aggregate's rows come out once per batch for the block to combine.  The
+ * legacy partition covers all time, so it is part of every batch, and the narrowed range keeps any of its rows from
+ * turning up twice.
+ */
+-(BOOL)queryPartitionsWithSQL:(NSString *)sql compound:(NSString *)compound start:(NSTimeInterval)start end:(NSTimeInterval)end severity:(BDSeverity)severity maxEntries:(NSUInteger)maxEntries descending:(BOOL)descending requiring:(NSString *)companion error:(NSError **)error bind:(void (^)(sqlite3_stmt *statement))bind usingBlock:(void (^)(sqlite3_stmt *statement, BOOL *stop))block {
+	BOOL stop = NO;
+	NSUInteger rows = 0;
+	for (int attempt = 0; ; attempt++) {
+		NSArray *partitions = [self partitions];
+		BDPartition *legacy = nil;
+		NSMutableArray *matching = [NSMutableArray array];
+		for (BDPartition *partition in partitions) {
+			if (![partition overlapsStart:start end:end] || (companion != nil && ![partition.companions containsObject:companion]))
+				continue;
+			if ([partition.suffix length] == 0)
+				legacy = partition;
+			else
+				[matching addObject:partition];
+		}
+		if ([matching count] == 0 && legacy == nil)
+			return YES;
+
+		NSMutableArray *batches = [NSMutableArray array];
+		NSUInteger perBatch = BD_MAX_COMPOUND_PARTITIONS - 1;
+		for (NSUInteger i = 0; i < MAX([matching count], 1); i += perBatch)
+			[batches addObject:[matching subarrayWithRange:NSMakeRange(i, MIN(perBatch, [matching count] - i))]];
+
+		for (NSUInteger b = 0; b < [batches count] && !stop && rows < maxEntries; b++) {
+			NSUInteger index = descending ? [batches count] - 1 - b : b;
+			NSArray *batch = batches[index];
+			// each batch runs from its first partition's start up to (but not including) the next batch's
+			NSTimeInterval batchStart = index == 0 ? start : MAX(start, ((BDPartition *)batch[0]).start);
+			NSTimeInterval batchEnd = index == [batches count] - 1 ? end : MIN(end, nextafter(((BDPartition *)batches[index + 1][0]).start, -DBL_MAX));
+
+			NSMutableArray *selects = [NSMutableArray array];
+			if (legacy != nil)
+				[selects addObject:[sql stringByReplacingOccurrencesOfString:@"{P}" withString:legacy.suffix]];
+			for (BDPartition *partition in batch)
+				[selects addObject:[sql stringByReplacingOccurrencesOfString:@"{P}" withString:partition.suffix]];
+			NSString *compoundSQL = [compound stringByReplacingOccurrencesOfString:@"{U}" withString:[selects componentsJoinedByString:@" UNION ALL "]];
+
+			sqlite3_stmt *statement = [self readStatementForSQL:compoundSQL error:error];
+			if (statement == NULL) {
+				// a partition might have been dropped between us looking at the list and preparing
+				if (attempt == 0 && rows == 0 && [self partitions] != partitions)
+					break;
+				return NO;
+			}
+
+			NSUInteger batchRows = 0;
+			NSUInteger remaining = maxEntries - rows;
+			sqlite3_bind_double(statement, 1, batchStart);
+			sqlite3_bind_double(statement, 2, batchEnd);
+			sqlite3_bind_int(statement, 3, severity);
+			// a negative limit means no limit as far as sqlite is concerned
+			sqlite3_bind_int64(statement, 4, remaining > INT64_MAX ? -1 : (sqlite3_int64)remaining);
+			if (bind != nil)
+				bind(statement);
+			while (!stop && sqlite3_step(statement) == SQLITE_ROW) {
+				block(statement, &stop);
+				batchRows++;
+			}
+			rows += batchRows;
+			NSUInteger rc = sqlite3_reset(statement);
+			sqlite3_clear_bindings(statement);
+			if (rc == SQLITE_OK)
+				continue;
+
+			[self discardReadStatementForSQL:compoundSQL];
+			if (attempt == 0 && rows == 0 && [self partitions] != partitions)
+				break;
+			if (error != NULL) {
+				NSString *message = [NSString stringWithFormat:@"Unable to retrieve entries (rc=%d): %s", rc, sqlite3_errmsg(self.readConnection)];
+				*error = [NSError errorWithDomain:BD_ERROR_DOMAIN code:rc userInfo:@{ NSLocalizedDescriptionKey : message }];
+			}
+			return NO;
+		}
+		// only a failure that broke out above, before any rows were handed over, goes round again
+		if (attempt == 0 && rows == 0 && !stop && [self partitions] != partitions)
+			continue;
+		return YES;
+	}
+}
+
+-(void)discardReadStatementForSQL:(NSString *)sql {
+	NSValue *value = self.readStatements[sql];
+	if (value != nil) {
+		sqlite3_finalize([value pointerValue]);
+		[self.readStatements removeObjectForKey:sql];
+	}
+}
+
+/**
+ * Returns a prepared statement on the readConnection for the SQL, preparing it the first time it is asked for.
+ * The statement belongs to the cache, so callers reset it rather than finalizing it.  Must be called on the readQueue.
+ */
+-(sqlite3_stmt *)readStatementForSQL:(NSString *)sql error:(NSError **)error {
+	NSValue *value = self.readStatements[sql];
+	if (value != nil)
+		return [value pointerValue];
+
+	sqlite3_stmt *statement;
+	NSUInteger rc = sqlite3_prepare_v2(self.readConnection, [sql UTF8String], -1, &statement, NULL);
+	if (rc != SQLITE_OK) {
+		if (error != NULL) {
+			NSString *message = [NSString stringWithFormat:@"Unable to prepare statement for retrieving entries (rc=%d): %s", rc, sqlite3_errmsg(self.readConnection)];
+			*error = [NSError errorWithDomain:BD_ERROR_DOMAIN code:rc userInfo:@{ NSLocalizedDescriptionKey : message }];
+		}
+		return NULL;
+	}
+#ifdef DEBUG
+	[self verifyQueryPlanForSQL:sql];
+#endif
+	// as partitions come and go the SQL changes, so old statements are thrown away rather than kept forever
+	if ([self.readStatements count] >= 32) {
+		for (NSValue *cached in [self.readStatements allValues]) {
+			sqlite3_finalize([cached pointerValue]);
+		}
+		[self.readStatements removeAllObjects];
+	}
+	self.readStatements[sql] = [NSValue valueWithPointer:statement];
+	return statement;
+}
+
+#ifdef DEBUG
+/** Complains (in debug builds only) if sqlite is planning to satisfy a retrieval without using any index */
+-(void)verifyQueryPlanForSQL:(NSString *)sql {
+	sqlite3_stmt *statement;
+	NSString *explainSQL = [@"EXPLAIN QUERY PLAN " stringByAppendingString:sql];
+	if (sqlite3_prepare_v2(self.readConnection, [explainSQL UTF8String], -1, &statement, NULL) != SQLITE_OK)
+		return;
+
+	NSMutableArray *details = [NSMutableArray array];
+	BOOL usesIndex = NO;
+	while (sqlite3_step(statement) == SQLITE_ROW) {
+		const char *detail = (const char *)sqlite3_column_text(statement, 3);
+		if (detail == NULL)
+			continue;
+		[details addObject:@(detail)];
+		if (strstr(detail, "INDEX") != NULL || strstr(detail, "PRIMARY KEY") != NULL)
+			usesIndex = YES;
+	}
+	sqlite3_finalize(statement);
+	if (!usesIndex)
+		NSLog(@"BDLogger retrieval is not using an index: %@ (%@)", sql, [details componentsJoinedByString:@"; "]);
+}
+#endif
+
+/**
+ * Returns a cursor over the first maxEntries matching entries that are still in segments, or nil if there are no
+ * segments.  When
+ * a cursor is returned, a read transaction has been started so that the store can't change underneath it (and
+ * sneak in a copy of a segment that the cursor is also reading); the caller must COMMIT it once it is done.
+ * Must be called on the readQueue.
+ */
+-(BDSegmentCursor *)segmentCursorBetweenStart:(NSTimeInterval)start end:(NSTimeInterval)end severity:(BDSeverity)severity ascending:(BOOL)ascending maxEntries:(NSUInteger)maxEntries {
+	// the list has to be taken before the read transaction starts: a segment compacted after that point is still in
+	// the list, and a segment that is no longer in the list was compacted before the transaction started
+	NSArray *segments = [self segments];
+	if ([segments count] == 0)
+		return nil;
+
+	sqlite3_exec(self.readConnection, "BEGIN", NULL, NULL, NULL);
+	sqlite3_int64 lastCompacted = 0;
+	sqlite3_stmt *statement;
+	const char *sql = self.sharedStore ? "SELECT Z_SEGMENT FROM LOG_STAGING WHERE Z_PRODUCER = ?" : "SELECT MAX(Z_SEGMENT) FROM LOG_SEGMENTS";
+	if (sqlite3_prepare_v2(self.readConnection, sql, -1, &statement, NULL) == SQLITE_OK) {
+		if (self.sharedStore)
+			sqlite3_bind_text(statement, 1, [self.producerID UTF8String], -1, SQLITE_TRANSIENT);
+		if (sqlite3_step(statement) == SQLITE_ROW)
+			lastCompacted = sqlite3_column_int64(statement, 0);
+		sqlite3_finalize(statement);
+	}
+	NSMutableArray *uncompacted = [NSMutableArray array];
+	for (BDSegment *segment in segments) {
+		if (segment.number > lastCompacted)
+			[uncompacted addObject:segment];
+	}
+	return [[BDSegmentCursor alloc] initWithSegments:uncompacted start:start end:end severity:severity ascending:ascending maxEntries:maxEntries];
+}
+
+/** Returns the format string of a template, or nil if there is no such template. Must be called on the readQueue. */
+-(NSString *)formatForTemplateID:(sqlite3_int64)templateID {
+	NSString *format = self.readTemplates[@(templateID)];
+	if (format == nil) {
+		// not from the statement cache, as this runs while a cached retrieval statement is part way through its rows
+		sqlite3_stmt *statement;
+		if (sqlite3_prepare_v2(self.readConnection, "SELECT Z_FORMAT FROM LOG_TEMPLATES WHERE Z_ID = ?", -1, &statement, NULL) == SQLITE_OK) {
+			sqlite3_bind_int64(statement, 1, templateID);
+			if (sqlite3_step(statement) == SQLITE_ROW)
+				format = @((const char *)sqlite3_column_text(statement, 0));
+			sqlite3_finalize(statement);
+		}
+		if (format != nil)
+			self.readTemplates[@(templateID)] = format;
+	}
+	return format;
+}
+
+/** Renders a message that was stored as a template. Must be called on the readQueue. */
+-(NSString *)messageFromTemplatedBytes:(const void *)bytes length:(NSUInteger)length {
+	NSString *format = [self formatForTemplateID:OSReadLittleInt32(bytes, 2)];
+	if (format == nil)
+		return @"";
+	NSData *arguments = [NSData dataWithBytesNoCopy:(void *)((const uint8_t *)bytes + BD_TEMPLATED_HEADER_BYTES) length:length - BD_TEMPLATED_HEADER_BYTES freeWhenDone:NO];
+	BDDeferredFormat *deferredFormat = [BDDeferredFormat deferredFormatWithFormat:format encodedArguments:arguments];
+	return deferredFormat == nil ? format : [deferredFormat render];
+}
+
+-(BDEntry *)entryFromStatement:(sqlite3_stmt *)statement {
+	// timestamp
+	NSDate *timestamp = [[NSDate alloc] initWithTimeIntervalSince1970:sqlite3_column_double(statement, 0)];
+	// severity
+	BDSeverity severity = sqlite3_column_int(statement, 1);
+	// message
+	NSString *message;
+	if (sqlite3_column_type(statement, 2) == SQLITE_BLOB) {
+		const void *compressedBytes = sqlite3_column_blob(statement, 2);
+		NSUInteger compressedLength = sqlite3_column_bytes(statement, 2);
+		if (BDIsTemplated(compressedBytes, compressedLength)) {
+			message = [self messageFromTemplatedBytes:compressedBytes length:compressedLength];
+		}
+		else {
+			NSData *messageData = BDIsCompressed(compressedBytes, compressedLength) ? BDDecompressBytes(compressedBytes, compressedLength) : nil;
+			message = messageData == nil ? @"" : [[NSString alloc] initWithData:messageData encoding:NSUTF8StringEncoding];
+		}
+	}
+	else {
+		const unsigned char *messageBytes = sqlite3_column_text(statement, 2);
+		NSUInteger messageLength = sqlite3_column_bytes(statement, 2);
+		message = [[NSString alloc] initWithBytes:messageBytes length:messageLength encoding:NSUTF8StringEncoding];
+	}
+	// userInfo
+	const void *userInfoBytes = sqlite3_column_blob(statement, 3);
+	NSUInteger userInfoLength = sqlite3_column_bytes(statement, 3);
+	NSDictionary *userInfo = nil;
+	if (userInfoLength != 0) {
+		NSData *userInfoData = [NSData dataWithBytesNoCopy:(void *)userInfoBytes length:userInfoLength freeWhenDone:NO];
+		if (BDIsCompressed(userInfoBytes, userInfoLength))
+			userInfoData = BDDecompressBytes(userInfoBytes, userInfoLength);
+		userInfo = userInfoData == nil ? nil : [self.userInfoCodec decodeUserInfo:userInfoData];
+	}
+	// create entry and populate
+	BDEntry *entry = [[BDEntry alloc] init];
+	entry.timestamp = timestamp;
+	entry.severity = severity;
+	entry.message = message;
+	entry.userInfo = userInfo;
+	return entry;
+}
+
+-(void)recordRetrievalWait:(NSTimeInterval)waitSecs query:(NSTimeInterval)querySecs {
+	BDHistogramRecord(&_metrics.retrievalMicros, (uint64_t)(MAX(waitSecs + querySecs, 0) * USEC_PER_SEC));
+	os_unfair_lock_lock(&_retrievalStatsLock);
+	_retrievalStats.count++;
+	_retrievalStats.totalWaitSecs += waitSecs;
+	_retrievalStats.maxWaitSecs = MAX(_retrievalStats.maxWaitSecs, waitSecs);
+	_retrievalStats.totalQuerySecs += querySecs;
+	_retrievalStats.maxQuerySecs = MAX(_retrievalStats.maxQuerySecs, querySecs);
+	os_unfair_lock_unlock(&_retrievalStatsLock);
+}
+
+-(BDRetrievalStats)retrievalStats {
+	os_unfair_lock_lock(&_retrievalStatsLock);
+	BDRetrievalStats stats = _retrievalStats;
+	os_unfair_lock_unlock(&_retrievalStatsLock);
+	return stats;
+}
+
+/** Gives the calling thread a counter of its own, reusing one left by a thread that has gone if there is one */
+-(BDThreadCounter *)claimThreadCounter {
+	BDThreadCounter *counter;
+	for (counter = atomic_load(&_threadCounters); counter != NULL; counter = counter->next) {
+		bool unclaimed = false;
+		if (atomic_compare_exchange_strong(&counter->claimed, &unclaimed, true))
+			break;
+	}
+	if (counter == NULL) {
+		counter = calloc(1, sizeof(BDThreadCounter));
+		atomic_init(&counter->claimed, true);
+		// counters are never unlinked, so pushing onto the front is all that's needed
+		BDThreadCounter *head = atomic_load(&_threadCounters);
+		do {
+			counter->next = head;
+		} while (!atomic_compare_exchange_weak(&_threadCounters, &head, counter));
+	}
+	pthread_setspecific(_counterKey, counter);
+	return counter;
+}
+
+-(BDLoggerMetrics)metrics {
+	BDLoggerMetrics metrics;
+	metrics.entriesFiltered = 0;
+	for (BDThreadCounter *counter = atomic_load(&_threadCounters); counter != NULL; counter = counter->next) {
+		metrics.entriesFiltered += atomic_load_explicit(&counter->filtered, memory_order_relaxed);
+	}
+	metrics.entriesSubmitted = metrics.entriesFiltered + atomic_load_explicit(&_metrics.entriesAccepted, memory_order_relaxed);
+	metrics.entriesDropped = atomic_load_explicit(&_metrics.entriesDropped, memory_order_relaxed);
+	metrics.entriesWritten = atomic_load_explicit(&_metrics.entriesWritten, memory_order_relaxed);
+	metrics.entriesFailed = atomic_load_explicit(&_metrics.entriesFailed, memory_order_relaxed);
+	metrics.queueDepth = self.queueDepth;
+	metrics.batchSize = BDHistogramSnapshot(&_metrics.batchSize);
+	metrics.insertMicros = BDHistogramSnapshot(&_metrics.insertMicros);
+	metrics.commitMicros = BDHistogramSnapshot(&_metrics.commitMicros);
+	metrics.pruneMicros = BDHistogramSnapshot(&_metrics.pruneMicros);
+	metrics.retrievalMicros = BDHistogramSnapshot(&_metrics.retrievalMicros);
+	return metrics;
+}
+
+#
+#pragma mark - Archives
+#
+-(BOOL)exportArchiveToURL:(NSURL *)archiveURL betweenStart:(NSDate *)startDate end:(NSDate *)endDate severity:(BDSeverity)severity error:(NSError **)error {
+	int fd = open([[archiveURL path] fileSystemRepresentation], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0 || !BDWriteAll(fd, BD_ARCHIVE_MAGIC, 4) || !BDWriteAll(fd, &(uint32_t){ OSSwapHostToLittleInt32(BD_ARCHIVE_VERSION) }, 4)) {
+		int writeError = errno;
+		if (fd >= 0)
+			close(fd);
+		if (error != NULL) {
+			NSString *message = [NSString stringWithFormat:@"Unable to create archive %@ (errno=%d): %s", [archiveURL path], writeError, strerror(writeError)];
+			*error = [NSError errorWithDomain:BD_ERROR_DOMAIN code:writeError userInfo:@{ NSLocalizedDescriptionKey : message }];
 		}
-		self.insertStatement = insertStatement;
+		return NO;
+	}
+
+	BDArchiveWriter *writer = [[BDArchiveWriter alloc] initWithFileDescriptor:fd];
+	__block BOOL success = YES;
+	__block BOOL written = YES;
+	dispatch_sync(self.readQueue, ^(void) {
+		NSTimeInterval startTimeInterval = startDate == nil ? 0 : [startDate timeIntervalSince1970];
+		NSTimeInterval endTimeInterval   = endDate == nil ? [[NSDate date] timeIntervalSince1970] : [endDate timeIntervalSince1970];
+		NSString *sql = @"SELECT Z_TIMESTAMP, Z_SEVERITY, Z_MESSAGE, Z_USERINFO FROM LOG_ENTRIES{P} WHERE Z_TIMESTAMP BETWEEN ?1 AND ?2 AND Z_SEVERITY <= ?3";
+		// the rows go straight from sqlite's buffers into the columns, only stopping to decode stored blobs
+		success = [self queryPartitionsWithSQL:sql orderBy:@"Z_TIMESTAMP ASC" start:startTimeInterval end:endTimeInterval severity:severity maxEntries:NSUIntegerMax requiring:nil error:error bind:nil usingBlock:^(sqlite3_stmt *statement, BOOL *stop) {
+			@autoreleasepool {
+				const void *messageBytes = sqlite3_column_blob(statement, 2);
+				size_t messageLength = sqlite3_column_bytes(statement, 2);
+				if (sqlite3_column_type(statement, 2) == SQLITE_BLOB) {
+					NSData *message = nil;
+					if (BDIsTemplated(messageBytes, messageLength))
+						message = [[self messageFromTemplatedBytes:messageBytes length:messageLength] dataUsingEncoding:NSUTF8StringEncoding];
+					else if (BDIsCompressed(messageBytes, messageLength))
+						message = BDDecompressBytes(messageBytes, messageLength);
+					messageBytes = [message bytes];
+					messageLength = [message length];
+				}
+				const void *userInfoBytes = sqlite3_column_blob(statement, 3);
+				size_t userInfoLength = sqlite3_column_bytes(statement, 3);
+				if (BDIsCompressed(userInfoBytes, userInfoLength)) {
+					NSData *userInfo = BDDecompressBytes(userInfoBytes, userInfoLength);
+					userInfoBytes = [userInfo bytes];
+					userInfoLength = [userInfo length];
+				}
+				if (![writer appendTimestamp:sqlite3_column_double(statement, 0) severity:sqlite3_column_int(statement, 1) messageBytes:messageBytes length:messageLength userInfoBytes:userInfoBytes length:userInfoLength]) {
+					written = NO;
+					*stop = YES;
+				}
+			}
+		}];
 	});
+	written = written && [writer finish] && fsync(fd) == 0;
+	int writeError = errno;
+	close(fd);
+	if (success && !written) {
+		if (error != NULL) {
+			NSString *message = [NSString stringWithFormat:@"Unable to write archive %@ (errno=%d): %s", [archiveURL path], writeError, strerror(writeError)];
+			*error = [NSError errorWithDomain:BD_ERROR_DOMAIN code:writeError userInfo:@{ NSLocalizedDescriptionKey : message }];
+		}
+		success = NO;
+	}
+	if (!success)
+		unlink([[archiveURL path] fileSystemRepresentation]);
 	return success;
 }
 
--(BOOL)close:(NSError **)error {
+-(BOOL)importArchiveFromURL:(NSURL *)archiveURL error:(NSError **)error {
+	NSError *readError = nil;
+	NSData *archive = [NSData dataWithContentsOfURL:archiveURL options:NSDataReadingMappedIfSafe error:&readError];
+	if (archive == nil) {
+		if (error != NULL)
+			*error = readError;
+		return NO;
+	}
+
 	__block BOOL success = YES;
 	dispatch_sync(self.dispatchQueue, ^(void) {
-
-		if (self.insertStatement != NULL) {
-			NSUInteger rc = sqlite3_finalize(self.insertStatement);
-			if (rc != SQLITE_OK) {
-				if (error != NULL) {
-					NSString *message = [NSString stringWithFormat:@"Unable to finalize insert statement (rc=%d): %s", rc, sqlite3_errmsg(self.connection)];
-					*error = [NSError errorWithDomain:BD_ERROR_DOMAIN code:rc userInfo:@{ NSLocalizedDescriptionKey : message }];
-				}
-				success = NO;
-				return;
+		// queued entries go in first, so they don't end up in the same transaction as the import
+		if (self.connection != NULL)
+			[self flushPendingEntries];
+		if (self.connection == NULL || ![self beginBatch]) {
+			if (error != NULL) {
+				NSString *message = [NSString stringWithFormat:@"Unable to start importing %@: %s", [archiveURL path], self.connection == NULL ? "log store isn't open" : sqlite3_errmsg(self.connection)];
+				*error = [NSError errorWithDomain:BD_ERROR_DOMAIN code:SQLITE_MISUSE userInfo:@{ NSLocalizedDescriptionKey : message }];
 			}
-			self.insertStatement = NULL;
+			success = NO;
+			return;
 		}
-			
-		if (self.connection != NULL) {
-			NSUInteger rc = sqlite3_close(self.connection);
-			if (rc != SQLITE_OK) {
-				if (error != NULL) {
-					NSString *message = [NSString stringWithFormat:@"Unable to close connection (rc=%d): %s", rc, sqlite3_errmsg(self.connection)];
-					*error = [NSError errorWithDomain:BD_ERROR_DOMAIN code:rc userInfo:@{ NSLocalizedDescriptionKey : message }];
-				}
-				success = NO;
-				return;
+
+		// keeping the timestamp indexes up to date row by row costs far more than building them once at the end
+		for (BDPartition *partition in [self partitions]) {
+			NSString *sql = [NSString stringWithFormat:@"DROP INDEX IF EXISTS %@", [partition tableNamed:@"LOG_TSTAMP_I"]];
+			sqlite3_exec(self.connection, [sql UTF8String], NULL, NULL, NULL);
+		}
+
+		BOOL decodeUserInfo = [self.indexedUserInfoKeys count] > 0;
+		self.deferTimestampIndexes = YES;
+		BOOL valid = BDArchiveEnumerate(archive, ^BOOL(NSTimeInterval timestamp, BDSeverity severity, const char *messageBytes, int messageLength, const void *userInfoBytes, int userInfoLength) {
+			NSData *userInfoData = userInfoLength == 0 ? nil : [NSData dataWithBytesNoCopy:(void *)userInfoBytes length:userInfoLength freeWhenDone:NO];
+			NSDictionary *userInfo = decodeUserInfo && userInfoData != nil ? [self.userInfoCodec decodeUserInfo:userInfoData] : nil;
+			BDMetricsCount(&self->_metrics.entriesAccepted, 1);
+			return [self storeTimestamp:timestamp severity:severity messageBytes:messageBytes length:messageLength userInfoData:userInfoData userInfo:userInfo templateID:0 templateArguments:nil];
+		});
+
+		self.deferTimestampIndexes = NO;
+
+		// including any partitions the import itself created, which readers haven't been told about yet
+		NSError *indexError = nil;
+		for (BDPartition *partition in [[self partitions] arrayByAddingObjectsFromArray:self.uncommittedPartitions]) {
+			if (valid && ![self createTimestampIndexForPartition:partition error:&indexError])
+				valid = NO;
+		}
+		if (!valid || ![self commitBatch]) {
+			if (!valid)
+				[self rollbackBatch];
+			if (error != NULL) {
+				NSString *message = indexError != nil ? [indexError localizedDescription] : [NSString stringWithFormat:@"Unable to import %@, as it is corrupt or couldn't be written to the log store", [archiveURL path]];
+				*error = [NSError errorWithDomain:BD_ERROR_DOMAIN code:indexError != nil ? indexError.code : SQLITE_CORRUPT userInfo:@{ NSLocalizedDescriptionKey : message }];
 			}
-			self.connection = NULL;
+			success = NO;
+		}
+		else {
+			// the imported entries never went through the cache, and some of them may well be newer than what's in it
+			[self forgetRecentEntriesBefore:DBL_MAX];
 		}
 	});
 	return success;
 }
 
 #
-#pragma mark - Logging entries
+#pragma mark - Maintenance
 #
--(void)log:(BDSeverity)severity message:(NSString *)message {
-	// no point proceeding further if we aren't going to log
-	if (![self isLoggingSeverity:severity])
+/** Starts the timer that runs pruning, checkpointing and optimizing. Called once the log store is open. */
+-(void)startMaintenanceTimer {
+	if (self.maintenanceTimer != nil)
 		return;
-	
-	BDEntry *entry = [[BDEntry alloc] init];
-	entry.message = message;
-	entry.severity = severity;
-	[self log:entry];
+
+	uint64_t interval = (uint64_t)(MAX([self.maintenanceIntervalSecs doubleValue], 1.0) * NSEC_PER_SEC);
+	dispatch_source_t timer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, dispatch_get_global_queue(QOS_CLASS_BACKGROUND, 0));
+	// a generous leeway lets the system fire the timer along with other work instead of waking up just for us
+	dispatch_source_set_timer(timer, dispatch_time(DISPATCH_TIME_NOW, (int64_t)interval), interval, interval / 4);
+	__weak BDLogger *weakSelf = self;
+	dispatch_source_set_event_handler(timer, ^(void) {
+		[weakSelf maintenanceTimerFired];
+	});
+	self.maintenanceTimer = timer;
+	dispatch_resume(timer);
 }
 
--(void)log:(BDSeverity)severity messageWithFormat:(NSString *)messageFormat, ... {
-	// no point proceeding further if we aren't going to log
-	if (![self isLoggingSeverity:severity])
+-(void)stopMaintenanceTimer {
+	if (self.maintenanceTimer == nil)
 		return;
-
-	va_list args;
-	va_start(args, messageFormat);
-	NSString *message = [[NSString alloc] initWithFormat:messageFormat arguments:args];
-	va_end(args);
-	[self log:severity message:message];
+	dispatch_source_cancel(self.maintenanceTimer);
+	self.maintenanceTimer = nil;
 }
 
--(void)log:(BDEntry *)entry {
-	// OK, so do we really even need to log this entry?
-	if (![self isLoggingSeverity:entry.severity])
+/**
+ * Hands a maintenance pass to the dispatchQueue, at utility QoS so that it never competes with the app.  Entries
+ * waiting to be written go first, so a busy tick is skipped, but only a few times in a row.
+ */
+-(void)maintenanceTimerFired {
+	if (self.queueDepth > 0 && atomic_fetch_add(&_maintenanceDeferrals, 1) + 1 < BD_MAINTENANCE_MAX_DEFERRALS)
+		return;
+	atomic_store(&_maintenanceDeferrals, 0);
+	if (atomic_flag_test_and_set(&_maintenanceScheduled))
 		return;
 
-	// now we'll make sure our pruning is up-to-date
-	[self pruneIfNecessary];
-	
-	dispatch_async(self.dispatchQueue, ^(void) {
-		if (self.shouldNSLog) {
-			NSLog(@"%@", [entry description]);
-		}
-		
-		sqlite3_reset(self.insertStatement);
-		sqlite3_bind_double(self.insertStatement, 1, [entry.timestamp timeIntervalSince1970]);
-		sqlite3_bind_int(self.insertStatement, 2, entry.severity);
-		sqlite3_bind_text(self.insertStatement, 3, [entry.message UTF8String], -1, NULL);
-		if (entry.userInfo == nil)
-			sqlite3_bind_blob(self.insertStatement, 4, NULL, 0, NULL);
-		else {
-			NSData *data = [NSKeyedArchiver archivedDataWithRootObject:entry.userInfo];
-			sqlite3_bind_blob(self.insertStatement, 4, [data bytes], (int)[data length], NULL);
-		}
-		
-		NSUInteger rc = sqlite3_step(self.insertStatement);
-		if (rc != SQLITE_DONE) {
-			// hmm... if, for some reason, we can't save it into the log store, let's at least dump it
-			// out via NSLog along with an error
-			NSLog(@"Failed to save log entry (rc=%d): %s", rc, sqlite3_errmsg(self.connection));
-			NSLog(@"%@", [entry description]);
-		}
+	dispatch_block_t block = dispatch_block_create_with_qos_class(DISPATCH_BLOCK_ENFORCE_QOS_CLASS, QOS_CLASS_UTILITY, 0, ^(void) {
+		atomic_flag_clear(&self->_maintenanceScheduled);
+		[self runMaintenance];
 	});
+	dispatch_async(self.dispatchQueue, block);
 }
 
--(BOOL)isLoggingSeverity:(BDSeverity)severity {
-	return self.filterSeverity >= severity;
+/** Runs whichever of the maintenance tasks are due. Must be called on the dispatchQueue. */
+-(void)runMaintenance {
+	if (self.connection == NULL)
+		return;
+
+	// in a shared store, housekeeping is left to the process doing the merging
+	BOOL housekeeping = !self.sharedStore || self.sharedWriter;
+	if (housekeeping)
+		[self pruneIfNecessary];
+
+	// the WAL hook only asks for a checkpoint once walAutocheckpointPages have built up, and a quiet moment is the
+	// cheapest time to catch up on whatever is left over
+	if (self.backgroundCheckpoint && self.durability != BDLoggerDurabilityStrict)
+		[self scheduleCheckpoint];
+
+	NSDate *now = [NSDate date];
+	if (housekeeping && [now timeIntervalSinceDate:self.lastOptimize] >= [self.optimizeFrequencySecs doubleValue]) {
+		self.lastOptimize = now;
+		// sqlite only runs ANALYZE on the tables (and partitions) that have changed enough since last time
+		NSUInteger rc = sqlite3_exec(self.connection, "PRAGMA optimize", NULL, NULL, NULL);
+		if (rc != SQLITE_OK)
+			NSLog(@"Unable to optimize log store (rc=%d): %s", rc, sqlite3_errmsg(self.connection));
+	}
 }
 
 #
-#pragma mark - Retrieving entries
+#pragma mark - Housekeeping and pruning
 #
--(NSArray *)retrieveBetweenStart:(NSDate *)startDate end:(NSDate *)endDate severity:(BDSeverity)severity error:(NSError **)error {
-	return [self retrieveBetweenStart:startDate end:endDate severity:severity maxEntries:NSUIntegerMax ascending:YES error:error];
+/** Starts a prune if pruneFrequencySecs have passed since the last one. Must be called on the dispatchQueue. */
+-(void)pruneIfNecessary {
+	NSDate *now = [NSDate date];
+	NSTimeInterval nextPruneCheckTime = [self.lastCheckForPruning timeIntervalSince1970] + [self.pruneFrequencySecs doubleValue];
+	if (nextPruneCheckTime >= [now timeIntervalSince1970] || self.pruneInProgress)
+		return;
+
+	self.pruneInProgress = YES;
+	self.pruneStartMicros = BDMetricsMicros();
+	self.pruneCutoffTime = [now timeIntervalSince1970] - ([self.pruneLimitDays doubleValue] * 24 * 60 * 60);
+	self.prunedEntryCount = 0;
+	self.lastCheckForPruning = now;
+
+	// whole partitions that are past the cutoff can just be dropped, which leaves only the partitions
+	// straddling the cutoff needing to have individual entries deleted
+	self.prunePartitions = [NSMutableArray array];
+	for (BDPartition *partition in [self partitions]) {
+		if (partition.end <= self.pruneCutoffTime)
+			[self dropPartition:partition];
+		else if (partition.start < self.pruneCutoffTime)
+			[self.prunePartitions addObject:partition];
+	}
+	if (self.rollupPrepared)
+		[self pruneRollup];
+	[self forgetRecentEntriesBefore:self.pruneCutoffTime];
+	[self pruneNextChunk];
 }
 
--(NSArray *)retrieveRecent:(NSUInteger)entryCount severity:(BDSeverity)severity error:(NSError **)error {
-	return [self retrieveBetweenStart:nil end:nil severity:severity maxEntries:entryCount ascending:NO error:error];
+/**
+ * Removes the rollup's minutes that are entirely older than the cutoff.  The minute straddling the cutoff keeps
+ * counting the entries that are about to be pruned from it.  Must be called on the dispatchQueue.
+ */
+-(void)pruneRollup {
+	sqlite3_stmt *statement;
+	NSUInteger rc = sqlite3_prepare_v2(self.connection, "DELETE FROM LOG_ROLLUP WHERE Z_LAST < ?", -1, &statement, NULL);
+	if (rc == SQLITE_OK) {
+		sqlite3_bind_double(statement, 1, self.pruneCutoffTime);
+		rc = sqlite3_step(statement) == SQLITE_DONE ? SQLITE_OK : sqlite3_errcode(self.connection);
+		sqlite3_finalize(statement);
+	}
+	if (rc != SQLITE_OK)
+		NSLog(@"Unable to prune LOG_ROLLUP (rc=%d): %s", rc, sqlite3_errmsg(self.connection));
 }
 
--(NSArray *)retrieveBetweenStart:(NSDate *)startDate end:(NSDate *)endDate severity:(BDSeverity)severity maxEntries:(NSUInteger)maxEntries ascending:(BOOL)ascending error:(NSError **)error {
-	// first thing to do is to make sure our pruning is up-to-date
-	[self pruneIfNecessary];
-	
-	__block NSMutableArray *entries = [NSMutableArray array];
-	dispatch_sync(self.dispatchQueue, ^(void) {
-		sqlite3_stmt *statement;
-		NSTimeInterval startTimeInterval = startDate == nil ? 0 : [startDate timeIntervalSince1970];
-		NSTimeInterval endTimeInterval   = endDate == nil ? [[NSDate date] timeIntervalSince1970] : [endDate timeIntervalSince1970];
-		NSString *sql = [NSString stringWithFormat:@"SELECT Z_TIMESTAMP, Z_SEVERITY, Z_MESSAGE, Z_USERINFO FROM LOG_ENTRIES WHERE Z_TIMESTAMP BETWEEN ? AND ? AND Z_SEVERITY <= ? ORDER BY Z_TIMESTAMP %@", (ascending ? @"ASC" : @"DESC")];
-		NSUInteger rc = sqlite3_prepare_v2(self.connection, [sql UTF8String], -1, &statement, NULL);
-		if (rc == SQLITE_OK) {
-			NSUInteger count = 0;
-			sqlite3_bind_double(statement, 1, startTimeInterval);
-			sqlite3_bind_double(statement, 2, endTimeInterval);
-			sqlite3_bind_int(statement, 3, severity);
-			while (sqlite3_step(statement) == SQLITE_ROW && count < maxEntries) {
-				// timestamp
-				NSDate *timestamp = [[NSDate alloc] initWithTimeIntervalSince1970:sqlite3_column_double(statement, 0)];
-				// severity
-				BDSeverity severity = sqlite3_column_int(statement, 1);
-				// message
-				const unsigned char *messageBytes = sqlite3_column_text(statement, 2);
-				NSUInteger messageLength = sqlite3_column_bytes(statement, 2);
-				NSString *message = [[NSString alloc] initWithBytes:messageBytes length:messageLength encoding:NSUTF8StringEncoding];
-				// userInfo
-				const void *userInfoBytes = sqlite3_column_blob(statement, 3);
-				NSUInteger userInfoLength = sqlite3_column_bytes(statement, 3);
-				NSDictionary *userInfo = nil;
-				if (userInfoLength != 0) {
-					userInfo = [NSKeyedUnarchiver unarchiveObjectWithData:[NSData dataWithBytes:userInfoBytes length:userInfoLength]];
-				}
-				// create entry and populate
-				BDEntry *entry = [[BDEntry alloc] init];
-				entry.timestamp = timestamp;
-				entry.severity = severity;
-				entry.message = message;
-				entry.userInfo = userInfo;
-				[entries addObject:entry];
-				
-				count++;
-			}
-			rc = sqlite3_finalize(statement);
-			if (rc != SQLITE_OK) {
-				if (error != NULL) {
-					NSString *message = [NSString stringWithFormat:@"Unable to finalise retrieve entries statement (rc=%d): %s", rc, sqlite3_errmsg(self.connection)];
-					*error = [NSError errorWithDomain:BD_ERROR_DOMAIN code:rc userInfo:@{ NSLocalizedDescriptionKey : message }];
-				}
-				entries = nil;
-			}
-		}
-		else {
-			if (error != NULL) {
-				NSString *message = [NSString stringWithFormat:@"Unable to prepare statement for retrieving entries (rc=%d): %s", rc, sqlite3_errmsg(self.connection)];
-				*error = [NSError errorWithDomain:BD_ERROR_DOMAIN code:rc userInfo:@{ NSLocalizedDescriptionKey : message }];
-			}
-			entries = nil;
-		}
-	});
-	return entries;
+/** Removes a partition and everything in it from the store. Must be called on the dispatchQueue. */
+-(void)dropPartition:(BDPartition *)partition {
+	NSMutableString *sql = [NSMutableString stringWithString:@"BEGIN;"];
+	for (NSString *baseName in partition.companions) {
+		[sql appendFormat:@"DROP TABLE IF EXISTS %@;", [partition tableNamed:baseName]];
+	}
+	[sql appendFormat:@"DROP TABLE IF EXISTS %@; COMMIT;", [partition tableNamed:@"LOG_ENTRIES"]];
+	NSUInteger rc = sqlite3_exec(self.connection, [sql UTF8String], NULL, NULL, NULL);
+	if (rc != SQLITE_OK) {
+		// it'll get another go next time around
+		NSLog(@"Unable to drop partition %@ (rc=%d): %s", [partition tableNamed:@"LOG_ENTRIES"], rc, sqlite3_errmsg(self.connection));
+		sqlite3_exec(self.connection, "ROLLBACK", NULL, NULL, NULL);
+		return;
+	}
+	self.prunedEntryCount++;
+
+	NSMutableArray *partitions = [[self partitions] mutableCopy];
+	[partitions removeObject:partition];
+	[self setPartitions:partitions];
+	if ([partition.suffix isEqualToString:self.insertPartitionSuffix])
+		self.insertPartitionSuffix = nil;
 }
 
-#
-#pragma mark - Housekeeping and pruning
-#
--(void)pruneIfNecessary {
-	dispatch_async(self.dispatchQueue, ^(void) {
-		NSDate *now = [NSDate date];
-		NSTimeInterval nextPruneCheckTime = [self.lastCheckForPruning timeIntervalSince1970] + [self.pruneFrequencySecs doubleValue];
-		if (nextPruneCheckTime >= [now timeIntervalSince1970])
-			return;
-		
-		NSTimeInterval pruneCutoffTime = [now timeIntervalSince1970] - ([self.pruneLimitDays doubleValue] * 24 * 60 * 60);
-		
+/**
+ * Deletes at most pruneChunkSize entries older than the cutoff.  If there might be more, the next chunk is
+ * scheduled a little later so that any inserts queued up in the meantime get to run first.  Must be called on
+ * the dispatchQueue.
+ */
+-(void)pruneNextChunk {
+	BDPartition *partition = [self.prunePartitions firstObject];
+	if (self.connection == NULL || partition == nil) {
+		[self finishPrune];
+		return;
+	}
+
+	// companion rows are removed first, using the same (deterministic) chunk of rowids as the entries themselves,
+	// all within the one transaction so they can never drift apart
+	NSInteger chunkSize = [self.pruneChunkSize integerValue];
+	NSInteger deleted = 0;
+	NSString *tableName = [partition tableNamed:@"LOG_ENTRIES"];
+	NSString *chunkSQL = [NSString stringWithFormat:@"SELECT rowid FROM %@ WHERE Z_TIMESTAMP < ?1 ORDER BY rowid LIMIT ?2", tableName];
+	NSMutableArray *statements = [NSMutableArray array];
+	for (NSString *baseName in partition.companions) {
+		[statements addObject:[NSString stringWithFormat:@"DELETE FROM %@ WHERE %@ IN (%@)", [partition tableNamed:baseName], BDCompanionTables()[baseName], chunkSQL]];
+	}
+	[statements addObject:[NSString stringWithFormat:@"DELETE FROM %@ WHERE rowid IN (%@)", tableName, chunkSQL]];
+
+	NSUInteger rc = sqlite3_exec(self.connection, "BEGIN", NULL, NULL, NULL);
+	for (NSString *sql in statements) {
+		if (rc != SQLITE_OK)
+			break;
 		sqlite3_stmt *statement;
-		NSString *sql = @"DELETE FROM LOG_ENTRIES WHERE Z_TIMESTAMP < ?";
-		NSUInteger rc = sqlite3_prepare_v2(self.connection, [sql UTF8String], -1, &statement, NULL);
-		if (rc == SQLITE_OK) {
-			sqlite3_bind_double(statement, 1, pruneCutoffTime);
-			rc = sqlite3_step(statement);
-			if (rc != SQLITE_DONE) {
-				NSLog(@"Unable to execute prune statement (rc=%d): %s", rc, sqlite3_errmsg(self.connection));
-			}
-			rc = sqlite3_finalize(statement);
-			if (rc != SQLITE_OK) {
-				NSLog(@"Unable to finalise prune statement (rc=%d): %s", rc, sqlite3_errmsg(self.connection));
-			}
+		rc = sqlite3_prepare_v2(self.connection, [sql UTF8String], -1, &statement, NULL);
+		if (rc != SQLITE_OK) {
+			NSLog(@"Unable to prepare prune statement (rc=%d): %s", rc, sqlite3_errmsg(self.connection));
+			break;
+		}
+		sqlite3_bind_double(statement, 1, self.pruneCutoffTime);
+		sqlite3_bind_int64(statement, 2, chunkSize);
+		rc = sqlite3_step(statement);
+		if (rc == SQLITE_DONE) {
+			rc = SQLITE_OK;
+			deleted = sqlite3_changes(self.connection);
 		}
 		else {
-			NSLog(@"Unable to prepare prune statement (rc=%d): %s", rc, sqlite3_errmsg(self.connection));
+			NSLog(@"Unable to execute prune statement (rc=%d): %s", rc, sqlite3_errmsg(self.connection));
 		}
-		self.lastCheckForPruning = now;
-	});
+		sqlite3_finalize(statement);
+	}
+	if (rc == SQLITE_OK)
+		rc = sqlite3_exec(self.connection, "COMMIT", NULL, NULL, NULL);
+	if (rc != SQLITE_OK) {
+		sqlite3_exec(self.connection, "ROLLBACK", NULL, NULL, NULL);
+		deleted = 0;
+	}
+	self.prunedEntryCount += deleted;
+
+	// once a partition comes up short, it has nothing older than the cutoff left in it
+	if (deleted < chunkSize)
+		[self.prunePartitions removeObjectAtIndex:0];
+
+	if ([self.prunePartitions count] > 0)
+		[self schedulePruneStep:^(void) { [self pruneNextChunk]; }];
+	else
+		[self finishPrune];
+}
+
+-(void)finishPrune {
+	self.prunePartitions = nil;
+	BDHistogramRecord(&_metrics.pruneMicros, BDMetricsMicros() - self.pruneStartMicros);
+	if (self.incrementalVacuumAvailable && self.prunedEntryCount > 0) {
+		self.vacuumFreePages = NSIntegerMax;
+		[self vacuumNextChunk];
+	}
+	else
+		self.pruneInProgress = NO;
+}
+
+/**
+ * Hands a bounded number of free pages back to the file system, rescheduling itself until none are left.  Gives up
+ * as soon as a step stops shrinking the free list, so that it can never keep prunes from running again.
+ */
+-(void)vacuumNextChunk {
+	if (self.connection == NULL) {
+		self.pruneInProgress = NO;
+		return;
+	}
+
+	NSInteger freePages = [self integerForPragma:"PRAGMA freelist_count"];
+	if (freePages <= 0 || freePages >= self.vacuumFreePages) {
+		self.pruneInProgress = NO;
+		return;
+	}
+	self.vacuumFreePages = freePages;
+
+	NSString *sql = [NSString stringWithFormat:@"PRAGMA incremental_vacuum(%d)", [self.vacuumChunkPages intValue]];
+	NSUInteger rc = sqlite3_exec(self.connection, [sql UTF8String], NULL, NULL, NULL);
+	if (rc != SQLITE_OK) {
+		NSLog(@"Unable to execute incremental vacuum (rc=%d): %s", rc, sqlite3_errmsg(self.connection));
+		self.pruneInProgress = NO;
+		return;
+	}
+	[self schedulePruneStep:^(void) { [self vacuumNextChunk]; }];
+}
+
+/** Returns the value of a pragma that answers with a single integer, or -1 if it can't be read */
+-(NSInteger)integerForPragma:(const char *)pragma {
+	NSInteger value = -1;
+	sqlite3_stmt *statement;
+	if (sqlite3_prepare_v2(self.connection, pragma, -1, &statement, NULL) == SQLITE_OK) {
+		if (sqlite3_step(statement) == SQLITE_ROW)
+			value = sqlite3_column_int64(statement, 0);
+		sqlite3_finalize(statement);
+	}
+	return value;
+}
+
+-(void)schedulePruneStep:(dispatch_block_t)step {
+	dispatch_time_t when = dispatch_time(DISPATCH_TIME_NOW, (int64_t)(0.05 * NSEC_PER_SEC));
+	dispatch_after(when, self.dispatchQueue, step);
 }
 
 -(void)dealloc {
 	[self close:nil];
+
+	BDFlightRecorderHeader *recorder = atomic_load(&_flightRecorder);
+	if (recorder != NULL) {
+		BDFlightRecorderHeader *expected = recorder;
+		atomic_compare_exchange_strong(&BDActiveFlightRecorder, &expected, NULL);
+		munmap(recorder, _flightRecorderSize);
+	}
+
+	for (NSUInteger i = 0; i < BD_CALL_SITE_SLOTS; i++) {
+		if (atomic_load(&_callSiteSlots[i].ready) && _callSiteSlots[i].site.line == 0)
+			free((void *)_callSiteSlots[i].site.file);
+	}
+	free(_callSiteSlots);
+	for (NSUInteger i = 0; i <= BDSeverityDebug; i++) {
+		free(_recentRecords[i].records);
+	}
+
+	// once the keys are deleted no more thread exit destructors can fire, so the counters and rings are ours to free
+	pthread_key_delete(_counterKey);
+	BDThreadCounter *counter = atomic_load(&_threadCounters);
+	while (counter != NULL) {
+		BDThreadCounter *next = counter->next;
+		free(counter);
+		counter = next;
+	}
+	pthread_key_delete(_ringKey);
+	BDRing *ring = atomic_load(&_rings);
+	while (ring != NULL) {
+		BDRing *next = ring->next;
+		free(ring);
+		ring = next;
+	}
 }
 
 #
@@ -377,9 +6207,205 @@
 			logger = nil;
 			NSLog(@"Unable to open %@: %@", logFilePath, [error localizedDescription]);
 		}
+		BDLoggerSharedInstance = logger;
 	});
 	return logger;
 }
 @end
 
 
+// --------------------------------------------------------------------------------------------------
+// Log categories
+// --------------------------------------------------------------------------------------------------
+@implementation BDLogCategory
+
+-(instancetype)initWithName:(NSString *)name logger:(BDLogger *)logger {
+	self = [super init];
+	if (self != nil) {
+		_name = [name copy];
+		_logger = logger;
+		_filterSeverity = nil;
+		// nothing gets through until the logger fills in the real filter state
+		_filterState = 0;
+	}
+	return self;
+}
+
+-(void)setFilterSeverity:(NSNumber *)filterSeverity {
+	_filterSeverity = filterSeverity;
+	[self.logger updateFilterState];
+}
+
+-(void)log:(BDSeverity)severity message:(NSString *)message {
+	[self.logger log:severity message:message filterState:__atomic_load_n(&_filterState, __ATOMIC_RELAXED)];
+}
+
+-(void)log:(BDSeverity)severity messageWithFormat:(NSString *)messageFormat, ... {
+	uint32_t filterState = __atomic_load_n(&_filterState, __ATOMIC_RELAXED);
+	BDLogger *logger = self.logger;
+	if (!BDFilterStateAdmits(filterState, severity)) {
+		BDLoggerCountFiltered(logger);
+		return;
+	}
+	if (![logger admitFormat:messageFormat])
+		return;
+
+	va_list args;
+	va_start(args, messageFormat);
+	[logger log:severity format:messageFormat arguments:args filterState:filterState];
+	va_end(args);
+}
+
+-(void)log:(BDSeverity)severity callSite:(BDCallSite *)callSite messageWithFormat:(NSString *)messageFormat, ... {
+	va_list args;
+	va_start(args, messageFormat);
+	[self.logger log:severity format:messageFormat arguments:args filterState:__atomic_load_n(&_filterState, __ATOMIC_RELAXED)];
+	va_end(args);
+}
+
+-(void)log:(BDEntry *)entry {
+	[self.logger log:entry filterState:__atomic_load_n(&_filterState, __ATOMIC_RELAXED)];
+}
+
+@end
+
+
+// --------------------------------------------------------------------------------------------------
+// Row views
+// --------------------------------------------------------------------------------------------------
+@implementation BDLogRow {
+	__unsafe_unretained BDLogger *_logger;
+	BDArena _arena;
+	/** The message and userInfo as they were stored: possibly compressed, or for the message, templated */
+	const void *_storedMessage;
+	size_t _storedMessageLength;
+	const void *_storedUserInfo;
+	size_t _storedUserInfoLength;
+	/** The message as plain UTF-8, once it has been decoded */
+	const char *_messageBytes;
+	size_t _messageLength;
+	BOOL _messageDecoded;
+	BOOL _userInfoDecoded;
+}
+
+@synthesize message = _message;
+@synthesize userInfo = _userInfo;
+
+-(instancetype)initWithLogger:(BDLogger *)logger {
+	self = [super init];
+	if (self != nil) {
+		_logger = logger;
+		_arena.chunk = NULL;
+	}
+	return self;
+}
+
+-(void)dealloc {
+	BDArenaFree(&_arena);
+}
+
+-(void)clear {
+	BDArenaReset(&_arena);
+	_message = nil;
+	_userInfo = nil;
+	_messageBytes = NULL;
+	_messageLength = 0;
+	_messageDecoded = NO;
+	_userInfoDecoded = NO;
+}
+
+-(void)loadFromStatement:(sqlite3_stmt *)statement {
+	[self clear];
+	_timeIntervalSince1970 = sqlite3_column_double(statement, 0);
+	_severity = sqlite3_column_int(statement, 1);
+	// the column pointers stay valid until the statement steps on, which is after the block has returned
+	if (sqlite3_column_type(statement, 2) == SQLITE_BLOB)
+		_storedMessage = sqlite3_column_blob(statement, 2);
+	else
+		_storedMessage = sqlite3_column_text(statement, 2);
+	_storedMessageLength = sqlite3_column_bytes(statement, 2);
+	_storedUserInfo = sqlite3_column_blob(statement, 3);
+	_storedUserInfoLength = sqlite3_column_bytes(statement, 3);
+}
+
+-(void)loadFromSegmentRecord:(const BDSegmentRecord *)record {
+	[self clear];
+	_timeIntervalSince1970 = record->timestamp;
+	_severity = record->severity;
+	// segments are never compressed, and stay mapped until the enumeration is over
+	_storedMessage = (const char *)(record + 1);
+	_storedMessageLength = record->messageLength;
+	_messageBytes = _storedMessage;
+	_messageLength = _storedMessageLength;
+	_messageDecoded = YES;
+	_storedUserInfo = (const char *)_storedMessage + record->messageLength;
+	_storedUserInfoLength = record->userInfoLength;
+}
+
+-(void)decodeMessage {
+	if (_messageDecoded)
+		return;
+	_messageDecoded = YES;
+	if (BDIsTemplated(_storedMessage, _storedMessageLength)) {
+		_message = [_logger messageFromTemplatedBytes:_storedMessage length:_storedMessageLength];
+		const char *utf8 = [_message UTF8String];
+		_messageLength = strlen(utf8);
+		char *copy = BDArenaAllocate(&_arena, _messageLength);
+		if (copy != NULL)
+			memcpy(copy, utf8, _messageLength);
+		_messageBytes = copy;
+	}
+	else if (BDIsCompressed(_storedMessage, _storedMessageLength)) {
+		_messageBytes = BDDecompressBytesIntoArena(_storedMessage, _storedMessageLength, &_arena, &_messageLength);
+	}
+	else {
+		_messageBytes = _storedMessage;
+		_messageLength = _storedMessageLength;
+	}
+	if (_messageBytes == NULL) {
+		_messageBytes = "";
+		_messageLength = 0;
+	}
+}
+
+-(const char *)messageBytes {
+	[self decodeMessage];
+	return _messageBytes;
+}
+
+-(NSUInteger)messageLength {
+	[self decodeMessage];
+	return _messageLength;
+}
+
+-(NSString *)message {
+	if (_message == nil) {
+		[self decodeMessage];
+		_message = _messageLength == 0 ? @"" : [[NSString alloc] initWithBytes:_messageBytes length:_messageLength encoding:NSUTF8StringEncoding];
+	}
+	return _message;
+}
+
+-(NSDictionary *)userInfo {
+	if (!_userInfoDecoded) {
+		_userInfoDecoded = YES;
+		const void *bytes = _storedUserInfo;
+		size_t length = _storedUserInfoLength;
+		if (length != 0 && BDIsCompressed(bytes, length))
+			bytes = BDDecompressBytesIntoArena(bytes, length, &_arena, &length);
+		if (bytes != NULL && length != 0)
+			_userInfo = [_logger.userInfoCodec decodeUserInfo:[NSData dataWithBytesNoCopy:(void *)bytes length:length freeWhenDone:NO]];
+	}
+	return _userInfo;
+}
+
+-(BDEntry *)entry {
+	BDEntry *entry = [[BDEntry alloc] init];
+	entry.timestamp = [[NSDate alloc] initWithTimeIntervalSince1970:self.timeIntervalSince1970];
+	entry.severity = self.severity;
+	entry.message = self.message;
+	entry.userInfo = self.userInfo;
+	return entry;
+}
+
+@end
@@ -0,0 +1,392 @@
+//
+// BDLoggerBench.m
+//
+// Copyright (c) 2013 Craig Edwards
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+// A standalone benchmark harness for BDLogger's hot paths.  Build and run it from the repository root with:
+//
+//     clang -fobjc-arc -O2 -I. bench/BDLoggerBench.m BDLogger.m -framework Foundation -lsqlite3 -lcompression -o bdbench
+//     ./bdbench [--entries 1000000] [--record bench/baseline.txt] [--compare bench/baseline.txt]
+//
+// Each result is printed as one "name value unit" line.  --record also writes them to a file, and --compare prints
+// how far each result has moved from a previously recorded file, so a change can be checked against the baseline
+// recorded on the same machine.
+
+#import <Foundation/Foundation.h>
+// Debug entries are compiled out of this file, so the disabled call benchmark can time both kinds of disabled call
+#define BD_MIN_SEVERITY BDSeverityInfo
+#import "BDLogger.h"
+
+// --------------------------------------------------------------------------------------------------
+// Timing and reporting
+// --------------------------------------------------------------------------------------------------
+static uint64_t BDBenchNanos(void) {
+	return clock_gettime_nsec_np(CLOCK_UPTIME_RAW);
+}
+
+/** Every result so far as "name value unit" lines, in the order they were reported */
+static NSMutableArray *BDBenchResults = nil;
+/** The value of each result so far, by name */
+static NSMutableDictionary *BDBenchValues = nil;
+
+static void BDBenchReport(NSString *name, double value, NSString *unit) {
+	char line[256];
+	snprintf(line, sizeof(line), "%-36s %14.3f %s", [name UTF8String], value, [unit UTF8String]);
+	[BDBenchResults addObject:@(line)];
+	BDBenchValues[name] = @(value);
+	printf("%s\n", line);
+}
+
+static int BDBenchCompareDoubles(const void *a, const void *b) {
+	double x = *(const double *)a, y = *(const double *)b;
+	return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+/** Sorts the samples and returns the value at the given percentile (0-100) */
+static double BDBenchPercentile(double *samples, NSUInteger count, double percentile) {
+	qsort(samples, count, sizeof(double), BDBenchCompareDoubles);
+	NSUInteger index = MIN((NSUInteger)(percentile / 100.0 * count), count - 1);
+	return samples[index];
+}
+
+/** Reads a file written by --record back into a dictionary of name -> value */
+static NSDictionary *BDBenchLoadResults(NSString *path) {
+	NSString *contents = [NSString stringWithContentsOfFile:path encoding:NSUTF8StringEncoding error:NULL];
+	NSMutableDictionary *results = [NSMutableDictionary dictionary];
+	for (NSString *line in [contents componentsSeparatedByString:@"\n"]) {
+		NSArray *fields = [[line componentsSeparatedByCharactersInSet:[NSCharacterSet whitespaceCharacterSet]] filteredArrayUsingPredicate:[NSPredicate predicateWithFormat:@"length > 0"]];
+		if ([fields count] >= 2 && ![fields[0] hasPrefix:@"#"])
+			results[fields[0]] = @([fields[1] doubleValue]);
+	}
+	return results;
+}
+
+// --------------------------------------------------------------------------------------------------
+// Log stores
+// --------------------------------------------------------------------------------------------------
+static NSString *BDBenchStorePath(NSString *name) {
+	return [NSTemporaryDirectory() stringByAppendingPathComponent:[NSString stringWithFormat:@"bdbench-%@-%d.sqlite", name, getpid()]];
+}
+
+/** Returns a logger on a brand new store, set up the way a busy app would run it */
+static BDLogger *BDBenchOpenLogger(NSString *name, void (^configure)(BDLogger *logger)) {
+	NSString *path = BDBenchStorePath(name);
+	for (NSString *suffix in @[ @"", @"-wal", @"-shm", @"-journal" ])
+		[[NSFileManager defaultManager] removeItemAtPath:[path stringByAppendingString:suffix] error:NULL];
+
+	BDLogger *logger = [[BDLogger alloc] initWithURL:[NSURL fileURLWithPath:path]];
+	logger.shouldNSLog = NO;
+	logger.filterSeverity = BDSeverityDebug;
+	logger.durability = BDLoggerDurabilityNormal;
+	logger.groupCommit = YES;
+	// nothing should be pruned until the prune benchmark asks for it
+	logger.pruneFrequencySecs = @(1e9);
+	if (configure != nil)
+		configure(logger);
+
+	NSError *error = nil;
+	if (![logger open:&error]) {
+		fprintf(stderr, "Unable to open %s: %s\n", [path UTF8String], [[error localizedDescription] UTF8String]);
+		exit(1);
+	}
+	return logger;
+}
+
+static void BDBenchCloseLogger(BDLogger *logger) {
+	[logger flush];
+	[logger close:NULL];
+}
+
+/** A userInfo dictionary of the size apps typically attach */
+static NSDictionary *BDBenchUserInfo(NSUInteger i) {
+	return @{ @"request" : @(i), @"path" : @"/api/v2/items", @"status" : @200, @"elapsed" : @(0.125), @"cached" : @NO };
+}
+
+/** Logs count entries spread evenly over the days leading up to now, oldest first */
+static void BDBenchPopulate(BDLogger *logger, NSUInteger count, double days) {
+	NSTimeInterval now = [[NSDate date] timeIntervalSince1970];
+	NSTimeInterval step = days * 24 * 60 * 60 / count;
+	for (NSUInteger i = 0; i < count; i++) {
+		@autoreleasepool {
+			BDEntry *entry = [[BDEntry alloc] init];
+			entry.timestamp = [NSDate dateWithTimeIntervalSince1970:now - (count - i) * step];
+			entry.severity = (BDSeverity)(i % (BDSeverityDebug + 1));
+			entry.message = [NSString stringWithFormat:@"request %lu finished in %lu ms", (unsigned long)i, (unsigned long)(i % 997)];
+			entry.userInfo = (i % 8) == 0 ? BDBenchUserInfo(i) : nil;
+			[logger log:entry];
+		}
+	}
+	[logger flush];
+}
+
+// --------------------------------------------------------------------------------------------------
+// Benchmarks
+// --------------------------------------------------------------------------------------------------
+/** How long -log:messageWithFormat: takes to return, from one thread and from several at once */
+static void BDBenchSubmit(NSString *name, NSUInteger count, void (^configure)(BDLogger *logger)) {
+	BDLogger *logger = BDBenchOpenLogger(name, configure);
+
+	uint64_t start = BDBenchNanos();
+	for (NSUInteger i = 0; i < count; i++) {
+		@autoreleasepool {
+			[logger log:BDSeverityInfo messageWithFormat:@"request %lu finished in %lu ms", (unsigned long)i, (unsigned long)(i % 997)];
+		}
+	}
+	uint64_t elapsed = BDBenchNanos() - start;
+	BDBenchReport([name stringByAppendingString:@".single"], (double)elapsed / count, @"ns/entry");
+	[logger flush];
+
+	NSUInteger threads = MAX([[NSProcessInfo processInfo] activeProcessorCount], 2);
+	NSUInteger perThread = count / threads;
+	start = BDBenchNanos();
+	dispatch_apply(threads, dispatch_get_global_queue(QOS_CLASS_USER_INITIATED, 0), ^(size_t thread) {
+		for (NSUInteger i = 0; i < perThread; i++) {
+			@autoreleasepool {
+				[logger log:BDSeverityInfo messageWithFormat:@"thread %lu request %lu", (unsigned long)thread, (unsigned long)i];
+			}
+		}
+	});
+	elapsed = BDBenchNanos() - start;
+	BDBenchReport([name stringByAppendingFormat:@".threads%lu", (unsigned long)threads], (double)elapsed / (perThread * threads), @"ns/entry");
+
+	start = BDBenchNanos();
+	BDBenchCloseLogger(logger);
+	BDBenchReport([name stringByAppendingString:@".drain"], (double)(BDBenchNanos() - start) / 1e6, @"ms");
+}
+
+/** How long an entry takes to reach the log store, from -log: until -flush returns */
+static void BDBenchLatency(NSUInteger count) {
+	BDLogger *logger = BDBenchOpenLogger(@"latency", nil);
+	double *samples = calloc(count, sizeof(double));
+	for (NSUInteger i = 0; i < count; i++) {
+		@autoreleasepool {
+			uint64_t start = BDBenchNanos();
+			[logger log:BDSeverityWarning messageWithFormat:@"request %lu failed", (unsigned long)i];
+			[logger flush];
+			samples[i] = (double)(BDBenchNanos() - start) / 1e3;
+		}
+	}
+	BDBenchReport(@"latency.p50", BDBenchPercentile(samples, count, 50), @"us");
+	BDBenchReport(@"latency.p90", BDBenchPercentile(samples, count, 90), @"us");
+	BDBenchReport(@"latency.p99", BDBenchPercentile(samples, count, 99), @"us");
+	BDBenchReport(@"latency.max", samples[count - 1], @"us");
+	free(samples);
+	BDBenchCloseLogger(logger);
+}
+
+/** Runs a retrieval a number of times and reports the median */
+static void BDBenchRetrieval(NSString *name, NSUInteger repeats, NSArray *(^retrieve)(void)) {
+	double *samples = calloc(repeats, sizeof(double));
+	NSUInteger rows = 0;
+	for (NSUInteger i = 0; i < repeats; i++) {
+		@autoreleasepool {
+			uint64_t start = BDBenchNanos();
+			rows = [retrieve() count];
+			samples[i] = (double)(BDBenchNanos() - start) / 1e6;
+		}
+	}
+	BDBenchReport([NSString stringWithFormat:@"%@(%lu)", name, (unsigned long)rows], BDBenchPercentile(samples, repeats, 50), @"ms");
+	free(samples);
+}
+
+/** Retrieval and pruning over a store of the given size, spread over ten days */
+static void BDBenchLargeStore(NSUInteger count) {
+	// the maintenance timer only picks up its interval at -open:, and nothing is pruned until pruneFrequencySecs says so
+	BDLogger *logger = BDBenchOpenLogger(@"large", ^(BDLogger *logger) {
+		logger.maintenanceIntervalSecs = @1;
+	});
+	uint64_t start = BDBenchNanos();
+	BDBenchPopulate(logger, count, 10.0);
+	BDBenchReport(@"populate", (double)(BDBenchNanos() - start) / count, @"ns/entry");
+
+	NSDate *now = [NSDate date];
+	BDBenchRetrieval(@"retrieve.recent", 20, ^NSArray *(void) {
+		return [logger retrieveRecent:100 severity:BDSeverityDebug error:NULL];
+	});
+	BDBenchRetrieval(@"retrieve.recent.errors", 20, ^NSArray *(void) {
+		return [logger retrieveRecent:100 severity:BDSeverityError error:NULL];
+	});
+	BDBenchRetrieval(@"retrieve.hour", 5, ^NSArray *(void) {
+		NSDate *end = [now dateByAddingTimeInterval:-5 * 24 * 60 * 60];
+		return [logger retrieveBetweenStart:[end dateByAddingTimeInterval:-60 * 60] end:end severity:BDSeverityDebug error:NULL];
+	});
+	BDBenchRetrieval(@"retrieve.day.errors", 5, ^NSArray *(void) {
+		NSDate *end = [now dateByAddingTimeInterval:-5 * 24 * 60 * 60];
+		return [logger retrieveBetweenStart:[end dateByAddingTimeInterval:-24 * 60 * 60] end:end severity:BDSeverityError error:NULL];
+	});
+
+	// keeping 5 of the 10 days prunes half of the store
+	uint64_t prunes = [logger metrics].pruneMicros.count;
+	logger.pruneLimitDays = @5.0;
+	logger.pruneFrequencySecs = @0;
+	start = BDBenchNanos();
+	while ([logger metrics].pruneMicros.count == prunes) {
+		if (BDBenchNanos() - start > 600 * NSEC_PER_SEC) {
+			fprintf(stderr, "Gave up waiting for the prune to finish\n");
+			break;
+		}
+		usleep(10000);
+	}
+	BDLoggerMetrics metrics = [logger metrics];
+	BDBenchReport(@"prune.half", (double)metrics.pruneMicros.max / 1e3, @"ms");
+	BDBenchCloseLogger(logger);
+}
+
+/** Counts how many times a log statement's arguments were evaluated */
+static NSUInteger BDBenchArgumentEvaluations = 0;
+
+static NSUInteger BDBenchArgument(NSUInteger i) {
+	BDBenchArgumentEvaluations++;
+	return i;
+}
+
+/**
+ * What a log statement costs when its severity isn't being logged: compiled out by BD_MIN_SEVERITY, turned away by
+ * the BDLog macro's inlined filterSeverity check, and turned away by -log:messageWithFormat: itself.  None of them
+ * should evaluate the arguments, apart from the plain method call.
+ */
+static void BDBenchDisabled(NSUInteger count) {
+	BDLogger *logger = BDBenchOpenLogger(@"disabled", ^(BDLogger *logger) {
+		logger.filterSeverity = BDSeverityWarning;
+	});
+
+	BDBenchArgumentEvaluations = 0;
+	uint64_t start = BDBenchNanos();
+	for (NSUInteger i = 0; i < count; i++)
+		BDLogTo(logger, BDSeverityDebug, @"request %lu", (unsigned long)BDBenchArgument(i));
+	BDBenchReport(@"disabled.compiled", (double)(BDBenchNanos() - start) / count, @"ns/call");
+
+	start = BDBenchNanos();
+	for (NSUInteger i = 0; i < count; i++)
+		BDLogTo(logger, BDSeverityInfo, @"request %lu", (unsigned long)BDBenchArgument(i));
+	BDBenchReport(@"disabled.macro", (double)(BDBenchNanos() - start) / count, @"ns/call");
+	if (BDBenchArgumentEvaluations != 0)
+		fprintf(stderr, "Disabled BDLog macros evaluated their arguments %lu times\n", (unsigned long)BDBenchArgumentEvaluations);
+
+	start = BDBenchNanos();
+	for (NSUInteger i = 0; i < count; i++)
+		[logger log:BDSeverityInfo messageWithFormat:@"request %lu", (unsigned long)BDBenchArgument(i)];
+	BDBenchReport(@"disabled.method", (double)(BDBenchNanos() - start) / count, @"ns/call");
+	BDBenchCloseLogger(logger);
+}
+
+/** How long the logger's userInfoCodec takes to encode and decode a typical dictionary */
+static void BDBenchCodec(NSString *name, id<BDUserInfoCodec> codec, NSUInteger count) {
+	NSDictionary *userInfo = BDBenchUserInfo(42);
+	NSData *data = nil;
+	uint64_t start = BDBenchNanos();
+	for (NSUInteger i = 0; i < count; i++) {
+		@autoreleasepool {
+			data = [codec encodeUserInfo:userInfo];
+		}
+	}
+	BDBenchReport([name stringByAppendingString:@".encode"], (double)(BDBenchNanos() - start) / count, @"ns");
+
+	start = BDBenchNanos();
+	for (NSUInteger i = 0; i < count; i++) {
+		@autoreleasepool {
+			[codec decodeUserInfo:data];
+		}
+	}
+	BDBenchReport([name stringByAppendingString:@".decode"], (double)(BDBenchNanos() - start) / count, @"ns");
+	BDBenchReport([name stringByAppendingString:@".bytes"], [data length], @"bytes");
+}
+
+/** How big a store of entries that all carry userInfo ends up with the given codec, including its write-ahead log */
+static void BDBenchCodecStoreSize(NSString *name, id<BDUserInfoCodec> codec, NSUInteger count) {
+	BDLogger *logger = BDBenchOpenLogger(name, ^(BDLogger *logger) {
+		logger.userInfoCodec = codec;
+	});
+	for (NSUInteger i = 0; i < count; i++) {
+		@autoreleasepool {
+			BDEntry *entry = [[BDEntry alloc] init];
+			entry.severity = BDSeverityInfo;
+			entry.message = @"request finished";
+			entry.userInfo = BDBenchUserInfo(i);
+			[logger log:entry];
+		}
+	}
+	BDBenchCloseLogger(logger);
+
+	NSString *path = BDBenchStorePath(name);
+	unsigned long long bytes = 0;
+	for (NSString *suffix in @[ @"", @"-wal" ])
+		bytes += [[[NSFileManager defaultManager] attributesOfItemAtPath:[path stringByAppendingString:suffix] error:NULL] fileSize];
+	BDBenchReport([name stringByAppendingString:@".store"], (double)bytes / count, @"bytes/entry");
+}
+
+// --------------------------------------------------------------------------------------------------
+// main
+// --------------------------------------------------------------------------------------------------
+int main(int argc, const char *argv[]) {
+	@autoreleasepool {
+		NSUInteger entries = 1000000;
+		NSString *recordPath = nil;
+		NSString *comparePath = nil;
+		for (int i = 1; i + 1 < argc; i += 2) {
+			if (strcmp(argv[i], "--entries") == 0)
+				entries = (NSUInteger)strtoull(argv[i + 1], NULL, 10);
+			else if (strcmp(argv[i], "--record") == 0)
+				recordPath = @(argv[i + 1]);
+			else if (strcmp(argv[i], "--compare") == 0)
+				comparePath = @(argv[i + 1]);
+		}
+
+		BDBenchResults = [NSMutableArray array];
+		BDBenchValues = [NSMutableDictionary dictionary];
+		BDBenchSubmit(@"submit", 200000, nil);
+		BDBenchSubmit(@"submit.ring", 200000, ^(BDLogger *logger) {
+			logger.ringBufferEnabled = YES;
+		});
+		BDBenchSubmit(@"submit.deferred", 200000, ^(BDLogger *logger) {
+			logger.deferredFormatting = YES;
+		});
+		BDBenchDisabled(10000000);
+		BDBenchLatency(2000);
+		BDBenchLargeStore(entries);
+		BDBenchCodec(@"codec.compact", [[BDCompactUserInfoCodec alloc] init], 100000);
+		BDBenchCodec(@"codec.keyed", [[BDKeyedArchiverUserInfoCodec alloc] init], 100000);
+		BDBenchCodecStoreSize(@"codec.compact", [[BDCompactUserInfoCodec alloc] init], 100000);
+		BDBenchCodecStoreSize(@"codec.keyed", [[BDKeyedArchiverUserInfoCodec alloc] init], 100000);
+
+		if (recordPath != nil) {
+			NSProcessInfo *process = [NSProcessInfo processInfo];
+			NSString *header = [NSString stringWithFormat:@"# %@, %lu cores, %@, %lu entries\n", [process operatingSystemVersionString], (unsigned long)[process activeProcessorCount], [NSDate date], (unsigned long)entries];
+			NSString *contents = [header stringByAppendingString:[[BDBenchResults componentsJoinedByString:@"\n"] stringByAppendingString:@"\n"]];
+			[contents writeToFile:recordPath atomically:YES encoding:NSUTF8StringEncoding error:NULL];
+		}
+
+		if (comparePath != nil) {
+			NSDictionary *baseline = BDBenchLoadResults(comparePath);
+			printf("\nCompared with %s:\n", [comparePath UTF8String]);
+			for (NSString *line in BDBenchResults) {
+				NSString *name = [line componentsSeparatedByString:@" "][0];
+				double value = [BDBenchValues[name] doubleValue];
+				NSNumber *previous = baseline[name];
+				if (previous == nil || [previous doubleValue] == 0)
+					printf("%-36s %14s\n", [name UTF8String], "new");
+				else
+					printf("%-36s %+13.1f%%\n", [name UTF8String], (value - [previous doubleValue]) / [previous doubleValue] * 100.0);
+			}
+		}
+	}
+	return 0;
+}